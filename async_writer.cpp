@@ -0,0 +1,132 @@
+#include "async_writer.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h> // write, close
+
+using namespace std;
+
+AsyncWriter::AsyncWriter(size_t max_buffers)
+  : max_buffers_(max_buffers > 0 ? max_buffers : 1),
+    done_(false),
+    failed_fd_(-1),
+    thread_(&AsyncWriter::run, this)
+{
+}
+
+AsyncWriter::~AsyncWriter()
+{
+  try {
+    finish();
+  }
+  catch (const runtime_error&) {
+    // Nowhere to report it.
+  }
+}
+
+void
+AsyncWriter::write(int fd, const string& fname, string&& data)
+{
+  push(Job{ fd, fname, std::move(data), false });
+}
+
+void
+AsyncWriter::close(int fd, const string& fname)
+{
+  push(Job{ fd, fname, string(), true });
+}
+
+void
+AsyncWriter::finish()
+{
+  if (!thread_.joinable()) {
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    done_ = true;
+  }
+  not_empty_.notify_one();
+
+  thread_.join();
+
+  if (!error_.empty()) {
+    const string error = error_;
+    error_.clear();
+    throw runtime_error(error);
+  }
+}
+
+void
+AsyncWriter::push(Job&& job)
+{
+  {
+    unique_lock<mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return queue_.size() < max_buffers_; });
+    queue_.push_back(std::move(job));
+  }
+  not_empty_.notify_one();
+}
+
+void
+AsyncWriter::run()
+{
+  while (true) {
+    Job job;
+    {
+      unique_lock<mutex> lock(mutex_);
+      not_empty_.wait(lock, [this] { return done_ || !queue_.empty(); });
+
+      if (queue_.empty()) {
+        return;
+      }
+
+      job = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    not_full_.notify_one();
+
+    run_job(job);
+  }
+}
+
+void
+AsyncWriter::run_job(Job& job)
+{
+  if (job.close) {
+    if (::close(job.fd) != 0 && error_.empty()) {
+      error_ = "couldn't write '" + job.fname + "': " + strerror(errno);
+    }
+    if (failed_fd_ == job.fd) {
+      failed_fd_ = -1;
+    }
+    return;
+  }
+
+  if (job.fd == failed_fd_) {
+    return;
+  }
+
+  const char* data = job.data.data();
+  size_t      left = job.data.size();
+
+  while (left > 0) {
+    const ssize_t written = ::write(job.fd, data, left);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (error_.empty()) {
+        error_ = "couldn't write '" + job.fname + "': " + strerror(errno);
+      }
+      failed_fd_ = job.fd;
+      return;
+    }
+
+    data += written;
+    left -= written;
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef CODA_ASYNC_WRITER_H
+#define CODA_ASYNC_WRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/// Buffers that may wait in the queue before write() blocks.  With the one
+/// being filled, that's double buffering plus one in flight.
+#define async_writer_max_buffers ((size_t)2)
+
+/// A thread that writes buffers to files while the caller gets on with the
+/// next thing.
+///
+/// Buffers go through a bounded FIFO queue, so writes to any one file land in
+/// the order they were handed over.  When the queue is full, write() blocks
+/// until the thread catches up (backpressure), which bounds the memory held
+/// by pending output.
+///
+/// A failed write doesn't stop anything: later buffers for that file are
+/// dropped, and the error is reported by finish().
+class AsyncWriter
+{
+public:
+  explicit AsyncWriter(size_t max_buffers = async_writer_max_buffers);
+
+  /// Finishes without reporting errors.  Call finish() to find out about
+  /// them.
+  ~AsyncWriter();
+
+  AsyncWriter(const AsyncWriter&) = delete;
+  AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+  /// Queue `data` to be written to `fd`.  `fname` is only for error
+  /// messages.
+  void
+  write(int fd, const std::string& fname, std::string&& data);
+
+  /// Queue closing `fd` once everything before it is written.
+  void
+  close(int fd, const std::string& fname);
+
+  /// Waits for the queue to drain and stops the thread.
+  ///
+  /// Throws std::runtime_error with the first error any write or close hit.
+  void
+  finish();
+
+private:
+  struct Job
+  {
+    int         fd;
+    std::string fname;
+    std::string data;
+    bool        close;
+  };
+
+  void
+  push(Job&& job);
+
+  void
+  run();
+
+  void
+  run_job(Job& job);
+
+  size_t max_buffers_;
+
+  std::mutex              mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<Job>         queue_;
+  bool                    done_;
+
+  // Only touched by the writer thread until it is joined.
+  std::string error_;
+  int         failed_fd_;
+
+  std::thread thread_;
+};
+
+#endif //CODA_ASYNC_WRITER_H
@@ -0,0 +1,246 @@
+#include "binary_table.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+#define table_alignment 64
+
+static size_t
+align_up(size_t n, size_t alignment)
+{
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+size_t
+name_block_bytes(const NameTable& names)
+{
+  size_t bytes = sizeof(uint64_t) * (names.size() + 2);
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    bytes += names.name(i).size();
+  }
+
+  // Keep whatever follows 8-byte aligned.
+  return align_up(bytes, sizeof(uint64_t));
+}
+
+bool
+is_binary_table(const string& fname)
+{
+  char magic[sizeof(binary_table_magic)];
+
+  FILE* file = fopen(fname.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+
+  bool found = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+               && memcmp(magic, binary_table_magic, sizeof(magic)) == 0;
+
+  fclose(file);
+
+  return found;
+}
+
+void
+write_bytes(FILE* file, const void* data, size_t size, const string& fname)
+{
+  if (size > 0 && fwrite(data, 1, size, file) != size) {
+    throw runtime_error("couldn't write '" + fname + "': " + strerror(errno));
+  }
+}
+
+void
+write_padding(FILE* file, size_t size, const string& fname)
+{
+  static const char zeros[table_alignment] = { 0 };
+
+  write_bytes(file, zeros, size, fname);
+}
+
+void
+write_name_block(FILE* file, const NameTable& names, const string& fname)
+{
+  uint64_t num_names = names.size();
+  write_bytes(file, &num_names, sizeof(num_names), fname);
+
+  vector<uint64_t> offsets(names.size() + 1, 0);
+  for (size_t i = 0; i < names.size(); ++i) {
+    offsets[i + 1] = offsets[i] + names.name(i).size();
+  }
+  write_bytes(file, offsets.data(), offsets.size() * sizeof(uint64_t), fname);
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    write_bytes(file, names.name(i).data(), names.name(i).size(), fname);
+  }
+
+  size_t written = sizeof(uint64_t) * (names.size() + 2) + offsets.back();
+  write_padding(file, align_up(written, sizeof(uint64_t)) - written, fname);
+}
+
+void
+write_binary_table(const string& fname, Counts& counts)
+{
+  if (counts.is_sparse) {
+    throw runtime_error("binary tables can only hold dense counts");
+  }
+
+  Eigen::Map<Eigen::MatrixXf> table = counts_table(counts);
+
+  BinaryTableHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, binary_table_magic, sizeof(header.magic));
+
+  header.version         = binary_table_version;
+  header.byte_order      = binary_table_byte_order;
+  header.nrows           = table.rows();
+  header.ncols           = table.cols();
+  header.zero_counts     = counts.zero_counts;
+  header.samples_offset  = sizeof(header);
+  header.otus_offset     = header.samples_offset + name_block_bytes(counts.samples);
+  header.log_sums_offset = header.otus_offset + name_block_bytes(counts.otus);
+  header.table_offset    = align_up(header.log_sums_offset + header.ncols * sizeof(double),
+                                    table_alignment);
+
+  FILE* file = fopen(fname.c_str(), "wb");
+  if (file == nullptr) {
+    throw runtime_error("couldn't open '" + fname + "' for writing: " + strerror(errno));
+  }
+
+  // Make sure the file gets closed if a write throws.
+  unique_ptr<FILE, int (*)(FILE*)> closer(file, fclose);
+
+  write_bytes(file, &header, sizeof(header), fname);
+  write_name_block(file, counts.samples, fname);
+  write_name_block(file, counts.otus, fname);
+  write_bytes(file, counts.col_log_sums.data(), header.ncols * sizeof(double), fname);
+  write_padding(file,
+                header.table_offset - header.log_sums_offset - header.ncols * sizeof(double),
+                fname);
+  write_bytes(file, table.data(), table.size() * sizeof(float), fname);
+
+  if (fclose(closer.release()) != 0) {
+    throw runtime_error("couldn't write '" + fname + "': " + strerror(errno));
+  }
+}
+
+uint64_t
+read_name_block(const MappedFile& file, uint64_t offset, NameTable& names)
+{
+  uint64_t num_names;
+
+  if (offset % sizeof(uint64_t) != 0 || offset > file.size() || sizeof(num_names) > file.size() - offset) {
+    throw runtime_error("bad name block offset");
+  }
+  memcpy(&num_names, file.data() + offset, sizeof(num_names));
+
+  const uint64_t offsets_at  = offset + sizeof(num_names);
+  const uint64_t max_offsets = (file.size() - offsets_at) / sizeof(uint64_t);
+  if (max_offsets == 0 || num_names > max_offsets - 1) {
+    throw runtime_error("truncated name block");
+  }
+
+  const uint64_t* offsets = (const uint64_t*)(file.data() + offsets_at);
+  const char*     bytes   = (const char*)(offsets + num_names + 1);
+
+  if (offsets[num_names] > (uint64_t)(file.end() - bytes)) {
+    throw runtime_error("truncated name block");
+  }
+
+  for (uint64_t i = 0; i < num_names; ++i) {
+    if (offsets[i] > offsets[i + 1]) {
+      throw runtime_error("corrupt name block");
+    }
+
+    size_t index = names.intern(string_view(bytes + offsets[i], offsets[i + 1] - offsets[i]));
+    if (index != i) {
+      throw runtime_error("duplicate name in name block");
+    }
+  }
+
+  return offsets_at + (num_names + 1) * sizeof(uint64_t) + offsets[num_names];
+}
+
+bool
+section_fits(uint64_t offset, uint64_t rows, uint64_t cols, uint64_t item_bytes, uint64_t limit)
+{
+  if (offset > limit) {
+    return false;
+  }
+  if (cols != 0 && rows > UINT64_MAX / cols) {
+    return false;
+  }
+
+  return rows * cols <= (limit - offset) / item_bytes;
+}
+
+Counts
+read_binary_table(const string& fname, bool writable)
+{
+  auto file = make_unique<MappedFile>(fname, writable);
+
+  BinaryTableHeader header;
+
+  if (file->size() < sizeof(header)) {
+    throw runtime_error("'" + fname + "' is too short to be a binary table");
+  }
+  memcpy(&header, file->data(), sizeof(header));
+
+  if (memcmp(header.magic, binary_table_magic, sizeof(header.magic)) != 0) {
+    throw runtime_error("'" + fname + "' is not a binary table");
+  }
+  if (header.byte_order != binary_table_byte_order) {
+    throw runtime_error("'" + fname + "' was written on a machine with a different byte order");
+  }
+  if (header.version != binary_table_version) {
+    throw runtime_error("'" + fname + "' is binary table version "
+                        + to_string(header.version) + ", but this coda reads version "
+                        + to_string(binary_table_version));
+  }
+
+  Counts counts;
+  counts.is_sparse   = false;
+  counts.zero_counts = header.zero_counts;
+
+  try {
+    uint64_t stop = read_name_block(*file, header.samples_offset, counts.samples);
+    if (stop > header.otus_offset) {
+      throw runtime_error("overlapping sections");
+    }
+
+    stop = read_name_block(*file, header.otus_offset, counts.otus);
+    if (stop > header.log_sums_offset) {
+      throw runtime_error("overlapping sections");
+    }
+  }
+  catch (const runtime_error& e) {
+    throw runtime_error("'" + fname + "' is corrupt (" + e.what() + ")");
+  }
+
+  if (counts.samples.size() != header.ncols || counts.otus.size() != header.nrows
+      || header.table_offset % table_alignment != 0
+      || !section_fits(header.log_sums_offset, header.ncols, 1, sizeof(double), header.table_offset)
+      || !section_fits(header.table_offset, header.nrows, header.ncols, sizeof(float), file->size())) {
+    throw runtime_error("'" + fname + "' is corrupt (bad dimensions or offsets)");
+  }
+
+  counts.col_log_sums.resize(header.ncols);
+  memcpy(counts.col_log_sums.data(),
+         file->data() + header.log_sums_offset,
+         header.ncols * sizeof(double));
+
+  // A read-only table is never written through `table`.
+  char* base = writable ? file->writable_data() : (char*)file->data();
+
+  counts.table   = (float*)(base + header.table_offset);
+  counts.mapping = move(file);
+
+  return counts;
+}
@@ -0,0 +1,97 @@
+#ifndef CODA_BINARY_TABLE_H
+#define CODA_BINARY_TABLE_H
+
+#include <cstdio>
+#include <string>
+
+#include "ingest.h"
+#include "mapped_file.h"
+#include "name_table.h"
+
+/// Binary count table, as written by `coda convert`.
+///
+/// Everything is in native byte order; `byte_order` lets a reader on another
+/// machine notice.  Offsets are from the start of the file.
+///
+///   header      BinaryTableHeader
+///   samples     name block
+///   otus        name block
+///   log sums    ncols doubles, sum of clr_log(table) down each column
+///   table       nrows * ncols floats, column-major, 64-byte aligned
+///
+/// A name block is a uint64 name count n, then n + 1 uint64 offsets into the
+/// name bytes that follow (name i is bytes [offsets[i], offsets[i + 1])).
+#define binary_table_magic "CODATBL"
+#define binary_table_version 3
+#define binary_table_byte_order 0x01020304u
+
+typedef struct BinaryTableHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t nrows;
+  uint64_t ncols;
+  uint64_t zero_counts;
+  uint64_t samples_offset;
+  uint64_t otus_offset;
+  uint64_t log_sums_offset;
+  uint64_t table_offset;
+} BinaryTableHeader;
+
+/// True if `fname` starts with the binary table magic.
+bool
+is_binary_table(const std::string& fname);
+
+/// `counts` must be dense.  Throws std::runtime_error if the file can't be
+/// written.
+void
+write_binary_table(const std::string& fname, Counts& counts);
+
+/// @brief Load a binary table without parsing or copying the counts.
+///
+/// The file is mapped copy-on-write and the table points straight into the
+/// mapping, so startup costs about as much as reading the names.  Changing
+/// the table (e.g. clr_in_place()) only touches private pages; the file on
+/// disk is never modified.
+///
+/// Without `writable`, the mapping is read-only and the table must only be
+/// read (e.g. through ClrRowBlocks).  Its pages stay clean, so the kernel can
+/// drop them under memory pressure and tables bigger than RAM still work.
+///
+/// Throws std::runtime_error if the file is not a usable binary table.
+Counts
+read_binary_table(const std::string& fname, bool writable = true);
+
+// Name blocks and checked writes, shared with other files laid out like a
+// binary table (see incremental.h).
+
+/// Bytes write_name_block() writes for `names`, a multiple of 8.
+size_t
+name_block_bytes(const NameTable& names);
+
+void
+write_name_block(FILE* file, const NameTable& names, const std::string& fname);
+
+/// Interns the name block at `offset` into `names`, which must be empty.
+/// Returns the offset just past it.
+///
+/// Throws std::runtime_error if the block is truncated or corrupt.
+uint64_t
+read_name_block(const MappedFile& file, uint64_t offset, NameTable& names);
+
+/// True if `rows` x `cols` items of `item_bytes` bytes each, starting at
+/// `offset`, end by `limit`.  Header fields come straight from the file, so
+/// this checks without any sum or product that could overflow.
+bool
+section_fits(uint64_t offset, uint64_t rows, uint64_t cols, uint64_t item_bytes, uint64_t limit);
+
+/// Throws std::runtime_error if the write comes up short.
+void
+write_bytes(FILE* file, const void* data, size_t size, const std::string& fname);
+
+/// `size` (at most 64) zero bytes.
+void
+write_padding(FILE* file, size_t size, const std::string& fname);
+
+#endif //CODA_BINARY_TABLE_H
@@ -0,0 +1,48 @@
+#include "clr_blocks.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "clr_kernel.h"
+
+ClrRowBlocks::ClrRowBlocks(const Counts& counts)
+  : table_(counts.table),
+    rows_((Eigen::Index)counts.otus.size()),
+    cols_((Eigen::Index)counts.samples.size())
+{
+  assert(!counts.is_sparse);
+
+  block_rows_ = std::max((Eigen::Index)1,
+                         (Eigen::Index)(clr_block_bytes / (std::max(cols_, (Eigen::Index)1) * sizeof(float))));
+
+  // Same rounding as clr_in_place(), so blocks match the in-memory table.
+  col_means_.resize(cols_);
+  for (Eigen::Index j = 0; j < cols_; ++j) {
+    col_means_(j) = (float)(counts.col_log_sums(j) / rows_);
+  }
+}
+
+Eigen::MatrixXf
+ClrRowBlocks::row_block(Eigen::Index first, Eigen::Index count) const
+{
+  return block(first, count, 0, cols_);
+}
+
+Eigen::MatrixXf
+ClrRowBlocks::block(Eigen::Index first_row,
+                    Eigen::Index nrows,
+                    Eigen::Index first_col,
+                    Eigen::Index ncols) const
+{
+  Eigen::MatrixXf out(nrows, ncols);
+
+#pragma omp parallel for schedule(static)
+  for (Eigen::Index j = 0; j < ncols; ++j) {
+    const float* col = table_ + (first_col + j) * rows_ + first_row;
+
+    clr_column(col, out.col(j).data(), nrows, col_means_(first_col + j));
+  }
+
+  return out;
+}
@@ -0,0 +1,57 @@
+#ifndef CODA_CLR_BLOCKS_H
+#define CODA_CLR_BLOCKS_H
+
+#include <Eigen/Dense>
+
+#include "ingest.h"
+
+/// Bytes of CLR values handed out per row block.
+#define clr_block_bytes ((size_t)256 << 20)
+
+/// @brief CLR table computed on the fly, a block of rows at a time, from a
+/// dense count table that is never changed.
+///
+/// Meant for a binary table mapped read-only (read_binary_table() without
+/// `writable`): only one block of CLR values is in memory at once, and the
+/// mapped counts can be paged out again, so the table can be bigger than
+/// RAM.  Everything that uses it makes a few passes over the blocks in order.
+class ClrRowBlocks
+{
+public:
+  /// Keeps a pointer to `counts.table`, so `counts` must outlive this.
+  explicit ClrRowBlocks(const Counts& counts);
+
+  Eigen::Index
+  rows() const
+  { return rows_; }
+
+  Eigen::Index
+  cols() const
+  { return cols_; }
+
+  /// Rows per block, sized to about clr_block_bytes.
+  Eigen::Index
+  block_rows() const
+  { return block_rows_; }
+
+  /// Rows [first, first + count) of the CLR table.
+  Eigen::MatrixXf
+  row_block(Eigen::Index first, Eigen::Index count) const;
+
+  /// Rows [first_row, first_row + nrows), columns [first_col, first_col +
+  /// ncols) of the CLR table.
+  Eigen::MatrixXf
+  block(Eigen::Index first_row,
+        Eigen::Index nrows,
+        Eigen::Index first_col,
+        Eigen::Index ncols) const;
+
+private:
+  const float*    table_;
+  Eigen::Index    rows_;
+  Eigen::Index    cols_;
+  Eigen::Index    block_rows_;
+  Eigen::VectorXf col_means_;
+};
+
+#endif //CODA_CLR_BLOCKS_H
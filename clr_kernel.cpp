@@ -0,0 +1,421 @@
+#include "clr_kernel.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "element.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CODA_CLR_X86 1
+#include <immintrin.h>
+#endif
+
+// Cephes logf: log(1 + f) = f - f^2 / 2 + f^3 P(f) for f in [sqrt(1/2) - 1,
+// sqrt(2) - 1), and e log(2) added in two parts, ln2_hi + ln2_lo.
+static const float sqrt_half = 0.707106781186547524f;
+static const float ln2_hi    = 0.693359375f;
+static const float ln2_lo    = -2.12194440e-4f;
+
+static const float log_poly[9] = {
+  7.0376836292e-2f,  -1.1514610310e-1f, 1.1676998740e-1f,
+  -1.2420140846e-1f, 1.4249322787e-1f,  -1.6668057665e-1f,
+  2.0000714765e-1f,  -2.4999993993e-1f, 3.3333331174e-1f,
+};
+
+/// The polynomial only handles these; anything else goes to logf.
+static inline bool
+clr_log_in_range(float x)
+{
+  return x >= FLT_MIN && x <= FLT_MAX;
+}
+
+float
+clr_log(float x)
+{
+  if (!clr_log_in_range(x)) {
+    return logf(x);
+  }
+
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+
+  // x = m 2^e with m in [1/2, 1).
+  int32_t e = (int32_t)(bits >> 23) - 126;
+
+  bits = (bits & 0x007FFFFFu) | 0x3F000000u;
+
+  float m;
+  memcpy(&m, &bits, sizeof(m));
+
+  // Then m in [sqrt(1/2), sqrt(2)).
+  float f;
+  if (m < sqrt_half) {
+    e -= 1;
+    f = (m + m) - 1.0f;
+  }
+  else {
+    f = m - 1.0f;
+  }
+
+  const float z = f * f;
+
+  float y = log_poly[0];
+  for (int k = 1; k < 9; ++k) {
+    y = y * f + log_poly[k];
+  }
+  y = y * f;
+  y = y * z;
+
+  const float fe = (float)e;
+
+  y = y + fe * ln2_lo;
+  y = y + -0.5f * z;
+
+  return (f + y) + fe * ln2_hi;
+}
+
+float
+clr_log_zero_replacement()
+{
+  static const float log_zero_replacement = clr_log(zero_replacement);
+
+  return log_zero_replacement;
+}
+
+/// Partial sums in clr_log_column(): lane k sums the logs at k, k + 16,
+/// k + 32, ... of the whole 16-value blocks, on every path.
+#define clr_sum_lanes ((size_t)16)
+
+/// Adds up the partial sums pairwise (lane k + width onto lane k, for width
+/// 8, 4, 2, 1), then the `n` logs after the last whole block, in order.
+static double
+clr_sum_partials(double lanes[clr_sum_lanes], const float* rest, size_t n)
+{
+  for (size_t width = clr_sum_lanes / 2; width > 0; width /= 2) {
+    for (size_t k = 0; k < width; ++k) {
+      lanes[k] += lanes[k + width];
+    }
+  }
+
+  double sum = lanes[0];
+  for (size_t i = 0; i < n; ++i) {
+    sum += rest[i];
+  }
+
+  return sum;
+}
+
+static void
+clr_log_scalar(const float* in, float* out, size_t n)
+{
+  const float log_zr = clr_log_zero_replacement();
+
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = in[i] == zero_replacement ? log_zr : clr_log(in[i]);
+  }
+}
+
+static double
+clr_log_column_scalar(const float* in, float* out, size_t n)
+{
+  double lanes[clr_sum_lanes] = {};
+
+  size_t i = 0;
+  for (; i + clr_sum_lanes <= n; i += clr_sum_lanes) {
+    clr_log_scalar(in + i, out + i, clr_sum_lanes);
+
+    for (size_t k = 0; k < clr_sum_lanes; ++k) {
+      lanes[k] += out[i + k];
+    }
+  }
+
+  clr_log_scalar(in + i, out + i, n - i);
+
+  return clr_sum_partials(lanes, out + i, n - i);
+}
+
+static void
+clr_column_scalar(const float* in, float* out, size_t n, float mean)
+{
+  const float log_zr = clr_log_zero_replacement();
+
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = (in[i] == zero_replacement ? log_zr : clr_log(in[i])) - mean;
+  }
+}
+
+#ifdef CODA_CLR_X86
+
+/// clr_log() on 8 lanes, same operations in the same order.
+__attribute__((target("avx2"))) static inline __m256
+clr_log_avx2(__m256 x)
+{
+  const __m256i bits = _mm256_castps_si256(x);
+
+  __m256i e = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126));
+
+  const __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)),
+                                                       _mm256_set1_epi32(0x3F000000)));
+
+  // m < sqrt(1/2): e - 1 and f = (m + m) - 1, otherwise f = m - 1.
+  const __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(sqrt_half), _CMP_LT_OQ);
+
+  e = _mm256_sub_epi32(e, _mm256_and_si256(_mm256_castps_si256(small), _mm256_set1_epi32(1)));
+
+  const __m256 f = _mm256_sub_ps(_mm256_add_ps(m, _mm256_and_ps(small, m)), _mm256_set1_ps(1.0f));
+  const __m256 z = _mm256_mul_ps(f, f);
+
+  __m256 y = _mm256_set1_ps(log_poly[0]);
+  for (int k = 1; k < 9; ++k) {
+    y = _mm256_add_ps(_mm256_mul_ps(y, f), _mm256_set1_ps(log_poly[k]));
+  }
+  y = _mm256_mul_ps(y, f);
+  y = _mm256_mul_ps(y, z);
+
+  const __m256 fe = _mm256_cvtepi32_ps(e);
+
+  y = _mm256_add_ps(y, _mm256_mul_ps(fe, _mm256_set1_ps(ln2_lo)));
+  y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(-0.5f), z));
+
+  return _mm256_add_ps(_mm256_add_ps(f, y), _mm256_mul_ps(fe, _mm256_set1_ps(ln2_hi)));
+}
+
+/// clr_log() of 8 values, or the constant if they're all zero_replacement.
+__attribute__((target("avx2"))) static inline __m256
+clr_log_or_zr_avx2(__m256 x, __m256 zr, __m256 log_zr)
+{
+  if (_mm256_movemask_ps(_mm256_cmp_ps(x, zr, _CMP_EQ_OQ)) == 0xFF) {
+    return log_zr;
+  }
+
+  const __m256 r = clr_log_avx2(x);
+
+  const __m256 in_range = _mm256_and_ps(_mm256_cmp_ps(x, _mm256_set1_ps(FLT_MIN), _CMP_GE_OQ),
+                                        _mm256_cmp_ps(x, _mm256_set1_ps(FLT_MAX), _CMP_LE_OQ));
+
+  if (_mm256_movemask_ps(in_range) == 0xFF) {
+    return r;
+  }
+
+  // Lanes outside the polynomial's range get clr_log()'s logf.
+  float xs[8], rs[8];
+  _mm256_storeu_ps(xs, x);
+  _mm256_storeu_ps(rs, r);
+  for (int k = 0; k < 8; ++k) {
+    if (!clr_log_in_range(xs[k])) {
+      rs[k] = clr_log(xs[k]);
+    }
+  }
+
+  return _mm256_loadu_ps(rs);
+}
+
+__attribute__((target("avx2"))) static double
+clr_log_column_avx2(const float* in, float* out, size_t n)
+{
+  const __m256 zr     = _mm256_set1_ps(zero_replacement);
+  const __m256 log_zr = _mm256_set1_ps(clr_log_zero_replacement());
+
+  // Lanes 0-3, 4-7, 8-11 and 12-15 of the partial sums.
+  __m256d acc[4] = { _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd() };
+
+  size_t i = 0;
+  for (; i + clr_sum_lanes <= n; i += clr_sum_lanes) {
+    const __m256 r0 = clr_log_or_zr_avx2(_mm256_loadu_ps(in + i), zr, log_zr);
+    const __m256 r1 = clr_log_or_zr_avx2(_mm256_loadu_ps(in + i + 8), zr, log_zr);
+
+    _mm256_storeu_ps(out + i, r0);
+    _mm256_storeu_ps(out + i + 8, r1);
+
+    acc[0] = _mm256_add_pd(acc[0], _mm256_cvtps_pd(_mm256_castps256_ps128(r0)));
+    acc[1] = _mm256_add_pd(acc[1], _mm256_cvtps_pd(_mm256_extractf128_ps(r0, 1)));
+    acc[2] = _mm256_add_pd(acc[2], _mm256_cvtps_pd(_mm256_castps256_ps128(r1)));
+    acc[3] = _mm256_add_pd(acc[3], _mm256_cvtps_pd(_mm256_extractf128_ps(r1, 1)));
+  }
+
+  double lanes[clr_sum_lanes];
+  for (int k = 0; k < 4; ++k) {
+    _mm256_storeu_pd(lanes + 4 * k, acc[k]);
+  }
+
+  const size_t rest = i;
+  if (i + 8 <= n) {
+    _mm256_storeu_ps(out + i, clr_log_or_zr_avx2(_mm256_loadu_ps(in + i), zr, log_zr));
+    i += 8;
+  }
+  clr_log_scalar(in + i, out + i, n - i);
+
+  return clr_sum_partials(lanes, out + rest, n - rest);
+}
+
+__attribute__((target("avx2"))) static void
+clr_column_avx2(const float* in, float* out, size_t n, float mean)
+{
+  const __m256 zr     = _mm256_set1_ps(zero_replacement);
+  const __m256 log_zr = _mm256_set1_ps(clr_log_zero_replacement());
+  const __m256 m      = _mm256_set1_ps(mean);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, _mm256_sub_ps(clr_log_or_zr_avx2(_mm256_loadu_ps(in + i), zr, log_zr), m));
+  }
+
+  clr_column_scalar(in + i, out + i, n - i, mean);
+}
+
+/// clr_log() on 16 lanes, same operations in the same order.
+__attribute__((target("avx512f"))) static inline __m512
+clr_log_avx512(__m512 x)
+{
+  const __m512i bits = _mm512_castps_si512(x);
+
+  __m512i e = _mm512_sub_epi32(_mm512_srli_epi32(bits, 23), _mm512_set1_epi32(126));
+
+  const __m512 m = _mm512_castsi512_ps(_mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi32(0x007FFFFF)),
+                                                       _mm512_set1_epi32(0x3F000000)));
+
+  const __mmask16 small = _mm512_cmp_ps_mask(m, _mm512_set1_ps(sqrt_half), _CMP_LT_OQ);
+
+  e = _mm512_mask_sub_epi32(e, small, e, _mm512_set1_epi32(1));
+
+  const __m512 f = _mm512_sub_ps(_mm512_add_ps(m, _mm512_maskz_mov_ps(small, m)), _mm512_set1_ps(1.0f));
+  const __m512 z = _mm512_mul_ps(f, f);
+
+  __m512 y = _mm512_set1_ps(log_poly[0]);
+  for (int k = 1; k < 9; ++k) {
+    y = _mm512_add_ps(_mm512_mul_ps(y, f), _mm512_set1_ps(log_poly[k]));
+  }
+  y = _mm512_mul_ps(y, f);
+  y = _mm512_mul_ps(y, z);
+
+  const __m512 fe = _mm512_cvtepi32_ps(e);
+
+  y = _mm512_add_ps(y, _mm512_mul_ps(fe, _mm512_set1_ps(ln2_lo)));
+  y = _mm512_add_ps(y, _mm512_mul_ps(_mm512_set1_ps(-0.5f), z));
+
+  return _mm512_add_ps(_mm512_add_ps(f, y), _mm512_mul_ps(fe, _mm512_set1_ps(ln2_hi)));
+}
+
+__attribute__((target("avx512f"))) static inline __m512
+clr_log_or_zr_avx512(__m512 x, __m512 zr, __m512 log_zr)
+{
+  if (_mm512_cmp_ps_mask(x, zr, _CMP_EQ_OQ) == 0xFFFF) {
+    return log_zr;
+  }
+
+  const __m512 r = clr_log_avx512(x);
+
+  const __mmask16 in_range = _mm512_mask_cmp_ps_mask(_mm512_cmp_ps_mask(x, _mm512_set1_ps(FLT_MIN), _CMP_GE_OQ),
+                                                     x,
+                                                     _mm512_set1_ps(FLT_MAX),
+                                                     _CMP_LE_OQ);
+
+  if (in_range == 0xFFFF) {
+    return r;
+  }
+
+  // Lanes outside the polynomial's range get clr_log()'s logf.
+  float xs[16], rs[16];
+  _mm512_storeu_ps(xs, x);
+  _mm512_storeu_ps(rs, r);
+  for (int k = 0; k < 16; ++k) {
+    if (!clr_log_in_range(xs[k])) {
+      rs[k] = clr_log(xs[k]);
+    }
+  }
+
+  return _mm512_loadu_ps(rs);
+}
+
+__attribute__((target("avx512f"))) static double
+clr_log_column_avx512(const float* in, float* out, size_t n)
+{
+  const __m512 zr     = _mm512_set1_ps(zero_replacement);
+  const __m512 log_zr = _mm512_set1_ps(clr_log_zero_replacement());
+
+  __m512d lo = _mm512_setzero_pd();
+  __m512d hi = _mm512_setzero_pd();
+
+  size_t i = 0;
+  for (; i + clr_sum_lanes <= n; i += clr_sum_lanes) {
+    const __m512 r = clr_log_or_zr_avx512(_mm512_loadu_ps(in + i), zr, log_zr);
+
+    _mm512_storeu_ps(out + i, r);
+
+    lo = _mm512_add_pd(lo, _mm512_cvtps_pd(_mm512_castps512_ps256(r)));
+    hi = _mm512_add_pd(hi, _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(r), 1))));
+  }
+
+  double lanes[clr_sum_lanes];
+  _mm512_storeu_pd(lanes, lo);
+  _mm512_storeu_pd(lanes + 8, hi);
+
+  clr_log_scalar(in + i, out + i, n - i);
+
+  return clr_sum_partials(lanes, out + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void
+clr_column_avx512(const float* in, float* out, size_t n, float mean)
+{
+  const __m512 zr     = _mm512_set1_ps(zero_replacement);
+  const __m512 log_zr = _mm512_set1_ps(clr_log_zero_replacement());
+  const __m512 m      = _mm512_set1_ps(mean);
+
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(out + i, _mm512_sub_ps(clr_log_or_zr_avx512(_mm512_loadu_ps(in + i), zr, log_zr), m));
+  }
+
+  clr_column_scalar(in + i, out + i, n - i, mean);
+}
+
+#endif // CODA_CLR_X86
+
+/// The kernels for this CPU, picked once.
+typedef struct ClrKernels
+{
+  const char* isa;
+  double (*log_column)(const float*, float*, size_t);
+  void (*column)(const float*, float*, size_t, float);
+} ClrKernels;
+
+static const ClrKernels&
+clr_kernels()
+{
+  static const ClrKernels kernels = []() {
+#ifdef CODA_CLR_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f")) {
+      return ClrKernels{ "avx512", clr_log_column_avx512, clr_column_avx512 };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      return ClrKernels{ "avx2", clr_log_column_avx2, clr_column_avx2 };
+    }
+#endif
+    return ClrKernels{ "scalar", clr_log_column_scalar, clr_column_scalar };
+  }();
+
+  return kernels;
+}
+
+double
+clr_log_column(const float* in, float* out, size_t n)
+{
+  return clr_kernels().log_column(in, out, n);
+}
+
+void
+clr_column(const float* in, float* out, size_t n, float mean)
+{
+  clr_kernels().column(in, out, n, mean);
+}
+
+const char*
+clr_kernel_isa()
+{
+  return clr_kernels().isa;
+}
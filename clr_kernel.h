@@ -0,0 +1,47 @@
+#ifndef CODA_CLR_KERNEL_H
+#define CODA_CLR_KERNEL_H
+
+#include <cstddef>
+
+/// @brief Natural log for the CLR transformation.
+///
+/// Cephes' logf polynomial on the mantissa, reduced to [sqrt(1/2),
+/// sqrt(2)).  Less than 1 ulp from the exact log for every positive, normal,
+/// finite float (checked exhaustively against the double log).  Zero,
+/// subnormal, negative, infinite and NaN inputs go to logf instead, so they
+/// still come out as -inf, NaN and so on rather than plausible numbers.
+/// parse_data_line() rejects the counts and OTU lengths that would give
+/// them, but tables handed over in memory aren't checked.
+///
+/// The SIMD versions in clr_log_column() and clr_column() do exactly the same
+/// operations lane by lane, and the file is built without FMA contraction,
+/// so every path gives the same bits as this one.
+float
+clr_log(float x);
+
+/// clr_log(zero_replacement), for cells known to hold it.
+float
+clr_log_zero_replacement();
+
+/// @brief out[i] = clr_log(in[i]) for i in [0, n), and the sum of the logs in
+/// double.  `out` may be `in`.
+///
+/// The sum is in the same order on every path: 16 partial sums over the
+/// whole blocks of 16 logs, added up pairwise, then the logs left over.  So
+/// like the logs, it has the same bits whatever the CPU.
+///
+/// Uses AVX-512 or AVX2 if the CPU has it.  Runs of zero_replacement cells
+/// take the precomputed clr_log_zero_replacement() instead of the polynomial.
+double
+clr_log_column(const float* in, float* out, size_t n);
+
+/// out[i] = clr_log(in[i]) - mean for i in [0, n).  `out` may be `in`.
+void
+clr_column(const float* in, float* out, size_t n, float mean);
+
+/// Name of the instruction set the kernels use on this CPU ("avx512",
+/// "avx2" or "scalar").
+const char*
+clr_kernel_isa();
+
+#endif //CODA_CLR_KERNEL_H
@@ -1,237 +1,991 @@
+#include <getopt.h> // getopt_long
+#include <sys/stat.h> // stat
 #include <stdlib.h> // exit, EXIT_FAILURE
+#include <string.h> // strcmp
+#include <unistd.h> // STDIN_FILENO, STDOUT_FILENO
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <vector>
-#include <unordered_map>
 #include <iostream>
-#include <fstream>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <algorithm>
+#include <atomic>
 
 #include "utils.h"
-#include "mat.h"
-#include "rsvd.h"
-#include "element.h"
-
-#define VERSION "0.2.2"
+#include "mapped_file.h"
+#include "ingest.h"
+#include "binary_table.h"
+#include "clr_kernel.h"
+#include "incremental.h"
+#include "pipeline.h"
+#include "query_server.h"
+#include "precision.h"
+#include "tiled_distance.h"
+#include "task_graph.h"
+#include "trace.h"
+#include "tsv_writer.h"
+#include "async_writer.h"
+#include "version.h"
 
 using namespace std;
 
+typedef struct Options
+{
+  const char* in_fname;
+
+  PipelineOptions pipeline;
 
-int main(int argc, char* argv[])
+  DistanceLayout distance_layout;
+
+  // With k > 0, write each sample's k nearest neighbours instead of the
+  // distance matrix.
+  Eigen::Index neighbours;
+
+  // Outputs to write; what only the others need is skipped.
+  bool stage_clr;
+  bool stage_distance;
+  bool stage_pca;
+
+  // Where to save the state for adding samples later, and the state to add
+  // the counts' samples to.
+  const char* save_state_fname;
+  const char* update_fname;
+
+  // Recompute the PCA of an updated state when more than this fraction of
+  // the samples are folded in.
+  double refresh;
+
+  // Where to write the trace, if anywhere.
+  const char* trace_fname;
+  const char* trace_events_fname;
+  bool        perf_counters;
+} Options;
+
+static void
+print_usage(const char* prog)
 {
-  if (argc != 3) {
-    fprintf(stderr,
-            "VERSION: %s"
-            "\n\n"
-            "Usage: %s <seed> <counts>\n\n"
-            "Rows are OTUs, columns are samples.\n\n"
-            "IMPORTANT:  assumes more OTUs than samples, but doesn't check for it!\n\n",
-            VERSION,
-            argv[0]);
+  fprintf(stderr,
+          "VERSION: %s"
+          "\n\n"
+          "Usage: %s [options] <seed> <counts>\n"
+          "       %s convert <counts> <binary_table>\n"
+          "       %s serve <state> [<socket>]\n\n"
+          "Rows are OTUs, columns are samples.\n\n"
+          "<counts> can be a binary table made by `convert`, which skips parsing.\n\n"
+          "`serve` answers queries about a state saved with --save-state, on the\n"
+          "Unix domain socket <socket>, or on stdin and stdout.  See the README.\n\n"
+          "Options:\n"
+          "  -x, --stages <list>\n"
+          "      Comma separated outputs to write, of clr, distance (or the\n"
+          "      neighbours) and pca (default: all of them).  The others, and\n"
+          "      whatever only they need, aren't computed.  Outputs that don't\n"
+          "      need each other are computed side by side, with the threads\n"
+          "      split between them.\n"
+          "  -l, --distance-layout <square|condensed>\n"
+          "      square (default): n x n matrix in coda__ait.tsv\n"
+          "      condensed: upper triangle in scipy pdist order, one distance per\n"
+          "      line, in coda__ait_condensed.tsv\n"
+          "  -t, --tile-size <n>\n"
+          "      Samples per distance tile (default: %ld).  Distances are\n"
+          "      computed and written n rows at a time, so memory for them is\n"
+          "      about n * samples floats.\n"
+          "  -n, --neighbours <k>\n"
+          "      Write each sample's k nearest neighbours and their distances to\n"
+          "      coda__knn.tsv instead of the distance matrix.  Memory for them is\n"
+          "      about k * samples.\n"
+          "  -j, --sketch <d>\n"
+          "      Approximate the distances (or neighbours) from a random\n"
+          "      projection of the CLR table down to d dimensions, made from the\n"
+          "      seed in one pass over the table.  Each distance then costs d\n"
+          "      rather than OTUs.  The distortion of a sample of pairs is\n"
+          "      checked against the exact distances and logged.\n"
+          "  -e, --sketch-eps <eps>\n"
+          "      Same, with as many dimensions as the Johnson-Lindenstrauss\n"
+          "      lemma asks for to keep every distance within 1 +- eps\n"
+          "      (0 < eps < 1).\n"
+          "  -k, --rank <k>\n"
+          "      Keep k principal components (default: all of them).\n"
+          "  -v, --variance <f>\n"
+          "      Keep the fewest principal components that explain at least\n"
+          "      fraction f (0 < f <= 1) of the variance.\n"
+          "  -s, --single-pass\n"
+          "      Compute the PCA from a sketch made in one pass over the CLR\n"
+          "      table.  Faster, especially --out-of-core, but less accurate.\n"
+          "      Needs --rank.\n"
+          "  -g, --gram <auto|always|never>\n"
+          "      Compute the samples x samples Gram matrix once and get both the\n"
+          "      distances and an exact PCA from it.  auto (default) does when\n"
+          "      there are at most %ld samples and --single-pass isn't given.\n"
+          "  -o, --out-of-core\n"
+          "      Don't load the table: compute the CLR a block of rows at a time\n"
+          "      while streaming over it.  For tables bigger than memory.  Needs a\n"
+          "      binary table and doesn't work with --variance, unless given\n"
+          "      --gram always.\n"
+          "  -p, --precision <f32|f64|bf16|f16>\n"
+          "      Number type of the dense CLR table (default: f32).  f64 does\n"
+          "      all the arithmetic in double; bf16 and f16 store the table in\n"
+          "      half the memory and compute in f32.  Not with --out-of-core;\n"
+          "      the table is read dense.\n"
+          "  -T, --trace <file>\n"
+          "      Write the time, peak RSS, rows and bytes of each stage to <file>\n"
+          "      as JSON.\n"
+          "  -E, --trace-events <file>\n"
+          "      Write the same in Chrome's trace event format, for\n"
+          "      chrome://tracing or Perfetto.\n"
+          "  -P, --perf-counters\n"
+          "      Add CPU cycles, instructions and last level cache misses to the\n"
+          "      trace (Linux perf events).\n"
+          "  -S, --save-state <file>\n"
+          "      Also save the CLR table, distances and principal axes to <file>,\n"
+          "      so samples can be added to them later with --update.\n"
+          "  -U, --update <file>\n"
+          "      Add the samples in <counts> to the state saved in <file>: only\n"
+          "      their CLR, their distances and their projections onto the saved\n"
+          "      principal axes are computed.  The outputs are for all samples,\n"
+          "      and the state is saved back to <file> (or to --save-state).\n"
+          "  -R, --refresh <f>\n"
+          "      With --update, recompute the PCA of all samples when more than\n"
+          "      fraction f (0 <= f < 1) of them have folded in projections\n"
+          "      (default: never).\n\n"
+          "IMPORTANT:  assumes more OTUs than samples, but doesn't check for it!\n\n",
+          VERSION,
+          prog,
+          prog,
+          prog,
+          (long)distance_tile_cols,
+          (long)gram_max_samples);
+}
+
+/// Returns false (after saying why) if the command line is bad.
+static bool
+parse_options(int argc, char* argv[], Options& opts)
+{
+  static const struct option long_options[] = {
+    { "distance-layout", required_argument, nullptr, 'l' },
+    { "tile-size", required_argument, nullptr, 't' },
+    { "stages", required_argument, nullptr, 'x' },
+    { "neighbours", required_argument, nullptr, 'n' },
+    { "sketch", required_argument, nullptr, 'j' },
+    { "sketch-eps", required_argument, nullptr, 'e' },
+    { "rank", required_argument, nullptr, 'k' },
+    { "variance", required_argument, nullptr, 'v' },
+    { "single-pass", no_argument, nullptr, 's' },
+    { "gram", required_argument, nullptr, 'g' },
+    { "out-of-core", no_argument, nullptr, 'o' },
+    { "precision", required_argument, nullptr, 'p' },
+    { "trace", required_argument, nullptr, 'T' },
+    { "trace-events", required_argument, nullptr, 'E' },
+    { "perf-counters", no_argument, nullptr, 'P' },
+    { "save-state", required_argument, nullptr, 'S' },
+    { "update", required_argument, nullptr, 'U' },
+    { "refresh", required_argument, nullptr, 'R' },
+    { nullptr, 0, nullptr, 0 },
+  };
+
+  opts.pipeline        = PipelineOptions();
+  opts.distance_layout = DistanceLayout::square;
+  opts.neighbours      = 0;
+
+  opts.stage_clr      = true;
+  opts.stage_distance = true;
+  opts.stage_pca      = true;
+
+  opts.trace_fname        = nullptr;
+  opts.trace_events_fname = nullptr;
+  opts.perf_counters      = false;
+
+  opts.save_state_fname = nullptr;
+  opts.update_fname     = nullptr;
+  opts.refresh          = 1;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "x:l:t:n:j:e:k:v:sg:op:T:E:PS:U:R:", long_options, nullptr)) != -1) {
+    switch (opt) {
+      case 'x':
+        opts.stage_clr      = false;
+        opts.stage_distance = false;
+        opts.stage_pca      = false;
+
+        for (const string& stage : split(optarg, ',')) {
+          if (stage == "clr") {
+            opts.stage_clr = true;
+          }
+          else if (stage == "distance") {
+            opts.stage_distance = true;
+          }
+          else if (stage == "pca") {
+            opts.stage_pca = true;
+          }
+          else {
+            cerr << "ERROR -- unknown stage '" << stage << "'" << endl;
+            return false;
+          }
+        }
+        break;
+      case 'l':
+        if (strcmp(optarg, "square") == 0) {
+          opts.distance_layout = DistanceLayout::square;
+        }
+        else if (strcmp(optarg, "condensed") == 0) {
+          opts.distance_layout = DistanceLayout::condensed;
+        }
+        else {
+          cerr << "ERROR -- unknown distance layout '" << optarg << "'" << endl;
+          return false;
+        }
+        break;
+      case 't':
+        try {
+          opts.pipeline.tile_cols = stol(optarg);
+        }
+        catch (const exception& e) {
+          opts.pipeline.tile_cols = 0;
+        }
+        if (opts.pipeline.tile_cols < 1) {
+          cerr << "ERROR -- the tile size must be a positive number!" << endl;
+          return false;
+        }
+        break;
+      case 'n':
+        try {
+          opts.neighbours = stol(optarg);
+        }
+        catch (const exception& e) {
+          opts.neighbours = 0;
+        }
+        if (opts.neighbours < 1) {
+          cerr << "ERROR -- the number of neighbours must be a positive number!" << endl;
+          return false;
+        }
+        break;
+      case 'j':
+        try {
+          opts.pipeline.sketch_dim = stol(optarg);
+        }
+        catch (const exception& e) {
+          opts.pipeline.sketch_dim = 0;
+        }
+        if (opts.pipeline.sketch_dim < 1) {
+          cerr << "ERROR -- the sketch dimensions must be a positive number!" << endl;
+          return false;
+        }
+        break;
+      case 'e':
+        try {
+          opts.pipeline.sketch_eps = stod(optarg);
+        }
+        catch (const exception& e) {
+          opts.pipeline.sketch_eps = 0;
+        }
+        if (!(opts.pipeline.sketch_eps > 0 && opts.pipeline.sketch_eps < 1)) {
+          cerr << "ERROR -- the sketch distortion must be in (0, 1)!" << endl;
+          return false;
+        }
+        break;
+      case 'k':
+        try {
+          opts.pipeline.pca.rank = stol(optarg);
+        }
+        catch (const exception& e) {
+          opts.pipeline.pca.rank = 0;
+        }
+        if (opts.pipeline.pca.rank < 1) {
+          cerr << "ERROR -- the rank must be a positive number!" << endl;
+          return false;
+        }
+        break;
+      case 'v':
+        try {
+          opts.pipeline.pca.variance = stod(optarg);
+        }
+        catch (const exception& e) {
+          opts.pipeline.pca.variance = 0;
+        }
+        if (!(opts.pipeline.pca.variance > 0 && opts.pipeline.pca.variance <= 1)) {
+          cerr << "ERROR -- the variance fraction must be in (0, 1]!" << endl;
+          return false;
+        }
+        break;
+      case 's':
+        opts.pipeline.pca_method = PcaMethod::single_pass;
+        break;
+      case 'g':
+        if (strcmp(optarg, "auto") == 0) {
+          opts.pipeline.gram = GramMode::automatic;
+        }
+        else if (strcmp(optarg, "always") == 0) {
+          opts.pipeline.gram = GramMode::always;
+        }
+        else if (strcmp(optarg, "never") == 0) {
+          opts.pipeline.gram = GramMode::never;
+        }
+        else {
+          cerr << "ERROR -- unknown Gram mode '" << optarg << "'" << endl;
+          return false;
+        }
+        break;
+      case 'o':
+        opts.pipeline.out_of_core = true;
+        break;
+      case 'p':
+        if (!parse_precision(optarg, opts.pipeline.precision)) {
+          cerr << "ERROR -- unknown precision '" << optarg << "'" << endl;
+          return false;
+        }
+        break;
+      case 'T':
+        opts.trace_fname = optarg;
+        break;
+      case 'E':
+        opts.trace_events_fname = optarg;
+        break;
+      case 'P':
+        opts.perf_counters = true;
+        break;
+      case 'S':
+        opts.save_state_fname = optarg;
+        break;
+      case 'U':
+        opts.update_fname = optarg;
+        break;
+      case 'R':
+        try {
+          opts.refresh = stod(optarg);
+        }
+        catch (const exception& e) {
+          opts.refresh = -1;
+        }
+        if (!(opts.refresh >= 0 && opts.refresh < 1)) {
+          cerr << "ERROR -- the refresh fraction must be in [0, 1)!" << endl;
+          return false;
+        }
+        break;
+      default:
+        return false;
+    }
+  }
 
-    return 1;
+  if (opts.pipeline.pca.rank > 0 && opts.pipeline.pca.variance > 0) {
+    cerr << "ERROR -- give a rank or a variance fraction, not both!" << endl;
+    return false;
+  }
+
+  if (opts.pipeline.pca_method == PcaMethod::single_pass && opts.pipeline.pca.rank == 0) {
+    cerr << "ERROR -- --single-pass needs a rank!" << endl;
+    return false;
+  }
+
+  if (opts.pipeline.pca_method == PcaMethod::single_pass && opts.pipeline.gram == GramMode::always) {
+    cerr << "ERROR -- --single-pass doesn't use the Gram matrix!" << endl;
+    return false;
+  }
+
+  // Out of core, only the Gram path can grow the PCA to a variance target,
+  // and `auto` only takes it for few enough samples.
+  if (opts.pipeline.out_of_core && opts.pipeline.pca.variance > 0 && opts.pipeline.gram != GramMode::always) {
+    cerr << "ERROR -- --variance needs --gram always with --out-of-core; or give a rank instead!"
+         << endl;
+    return false;
   }
 
-  char* seed_str = argv[1];
-  char* in_fname = argv[2];
+  if (opts.pipeline.out_of_core && opts.pipeline.precision != Precision::f32) {
+    cerr << "ERROR -- --out-of-core only works in f32!" << endl;
+    return false;
+  }
 
-  unsigned long zero_counts = 0;
+  if (opts.perf_counters && !opts.trace_fname && !opts.trace_events_fname) {
+    cerr << "ERROR -- --perf-counters needs --trace or --trace-events!" << endl;
+    return false;
+  }
 
-  array<string, 4> tokens;
-  vector <Element> elements;
+  // The state holds the whole CLR table and distance matrix in f32.
+  if ((opts.save_state_fname || opts.update_fname)
+      && (opts.pipeline.out_of_core || opts.pipeline.precision != Precision::f32)) {
+    cerr << "ERROR -- --save-state and --update only work in memory and in f32!" << endl;
+    return false;
+  }
 
-  // Map samples to columns.  Will be columns.
-  unordered_map <string, size_t> sample_index;
+  if (opts.neighbours > 0 && (opts.save_state_fname || opts.update_fname)) {
+    cerr << "ERROR -- --neighbours doesn't keep the distance matrix a state needs!" << endl;
+    return false;
+  }
 
-  // Map otu to rows.  Will be rows.
-  unordered_map <string, size_t> otu_index;
+  if (opts.pipeline.sketch_dim > 0 && opts.pipeline.sketch_eps > 0) {
+    cerr << "ERROR -- give the sketch dimensions or its distortion, not both!" << endl;
+    return false;
+  }
 
-  // Need a map from index to sample name.
-  unordered_map <size_t, string> index_to_sample;
+  // Distances added to a state are exact, so its old ones must be too.
+  if ((opts.pipeline.sketch_dim > 0 || opts.pipeline.sketch_eps > 0)
+      && (opts.save_state_fname || opts.update_fname)) {
+    cerr << "ERROR -- --sketch doesn't work with --save-state or --update!" << endl;
+    return false;
+  }
 
-  // Need a map from index to otu_name name.
-  unordered_map <size_t, string> index_to_otu;
+  if (opts.save_state_fname && !(opts.stage_distance && opts.stage_pca)) {
+    cerr << "ERROR -- --save-state needs the distance and pca stages!" << endl;
+    return false;
+  }
+
+  // An update always writes everything, from the state.
+  if (opts.update_fname && !(opts.stage_clr && opts.stage_distance && opts.stage_pca)) {
+    cerr << "ERROR -- --stages doesn't work with --update!" << endl;
+    return false;
+  }
+
+  if (opts.refresh < 1 && !opts.update_fname) {
+    cerr << "ERROR -- --refresh needs --update!" << endl;
+    return false;
+  }
 
-  string   line;
-  ifstream in_file(in_fname);
+  if (argc - optind != 2) {
+    return false;
+  }
 
   // Parse seed
-  int seed;
   try {
-    seed = stoi(seed_str);
+    opts.pipeline.seed = stoi(argv[optind]);
   }
   catch (const invalid_argument& ia) {
     cerr << "ERROR -- could not convert the seed!" << endl;
-    return EXIT_FAILURE;
+    return false;
   }
   catch (const out_of_range& oof) {
     cerr << "ERROR -- the seed you entered is out of range!" << endl;
+    return false;
+  }
+
+  opts.in_fname = argv[optind + 1];
+
+  return true;
+}
+
+/// `coda convert`: parse a counts file once and save it as a binary table.
+static int
+convert_counts(const char* in_fname, const char* out_fname)
+{
+  try {
+    log_msg("Reading and normalizing counts");
+
+    MappedFile in_file(in_fname);
+    Counts     counts = read_counts(in_file, TableLayout::dense);
+
+    log_msg("Writing binary table");
+
+    write_binary_table(out_fname, counts);
+  }
+  catch (const runtime_error& e) {
+    cerr << "ERROR -- " << e.what() << endl;
     return EXIT_FAILURE;
   }
 
-  fprintf(stderr, "INFO -- seed: %d\n", seed);
+  return 0;
+}
 
-  log_msg("Reading data");
+/// OpenMP threads for the stages of write_outputs() to share.
+static int
+stage_threads(const Options& opts)
+{
+  // The hardware counters are only open on the main thread's team, so with
+  // them the stages run one at a time, on it.
+  if (opts.perf_counters) {
+    return 1;
+  }
 
-  // Read input file
-  if (in_file.is_open()) {
-    while (getline(in_file, line)) {
-      split(tokens, line, '\t');
-      Element element = parse_data_line(tokens, true);
-
-      // Track "zero" counts
-      if (element.count < 1) {
-        zero_counts++;
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+/// Writes the CLR table, Aitchison distances and sample projection, those of
+/// them in opts' stages.  Each output is a stage of a TaskGraph, after the
+/// Gram matrix or sketch it needs, so stages that don't need each other run
+/// side by side when there are threads for it.
+///
+/// Returns false (after saying why) if any output couldn't be computed or
+/// written; the others are still written.
+static bool
+write_outputs(Pipeline& pipeline, const Options& opts)
+{
+  // Output files are written on this thread while the stages run.
+  AsyncWriter writer;
+
+  // Set by any stage that fails, maybe from several at once.
+  atomic<bool> failed(false);
+
+  const double rows  = (double)pipeline.otus();
+  const double bytes = pipeline.clr_bytes();
+
+  const bool use_gram = pipeline.uses_gram();
+  const bool sketches = opts.stage_distance && pipeline.sketches();
+
+  // Sketched distances don't need the Gram matrix, only the PCA might.
+  const bool need_gram = use_gram && (opts.stage_pca || (opts.stage_distance && !sketches));
+
+  TaskGraph graph;
+
+  if (opts.stage_clr) {
+    graph.add({}, [&] {
+      TraceSpan span("Printing CLR matrix");
+
+      try {
+        pipeline.write_clr("coda__clr.tsv", &writer);
       }
+      catch (const runtime_error& e) {
+        cerr << "ERROR -- " << e.what() << endl;
+        failed = true;
+      }
+
+      span.add_rows(rows);
+      span.add_bytes(bytes);
+    });
+  }
+
+  vector<size_t> gram_stage;
+  if (need_gram) {
+    gram_stage.push_back(graph.add({}, [&] {
+      TraceSpan span("Calculating Gram matrix");
+
+      pipeline.gram();
+
+      span.add_rows(rows);
+      span.add_bytes(bytes);
+    }));
+  }
+
+  Eigen::MatrixXf distances;
+  SamplePca       pca;
 
-      // map sample to index
-      sample_index.try_emplace(element.sample, sample_index.size());
+  vector<size_t> state_after;
 
-      // map otu to index
-      otu_index.try_emplace(element.otu, otu_index.size());
+  if (opts.stage_distance) {
+    vector<size_t> distance_after = gram_stage;
 
-      // track the indices of this element
-      element.sample_index = sample_index.at(element.sample);
-      element.otu_index    = otu_index.at(element.otu);
+    if (sketches) {
+      distance_after = { graph.add({}, [&] {
+        TraceSpan span("Sketching CLR table");
 
-      elements.push_back(element);
+        const JlSketch& sketch = pipeline.sketch();
+
+        span.add_rows(rows);
+        span.add_bytes(bytes);
+
+        fprintf(stderr,
+                "INFO -- %ld dimension sketch: distances off by %.3f%% on average and %.3f%% at most, "
+                "over %ld pairs\n",
+                (long)sketch.sketch.rows(),
+                sketch.distortion.size() > 0 ? sketch.distortion.cwiseAbs().mean() * 100 : 0.0,
+                sketch.distortion.size() > 0 ? sketch.distortion.cwiseAbs().maxCoeff() * 100 : 0.0,
+                (long)sketch.distortion.size());
+      }) };
     }
-    in_file.close();
+
+    // Without the Gram matrix, the distances read the table, or the sketch.
+    const double distance_bytes = sketches   ? (double)pipeline.sketch_dim() * pipeline.samples() * sizeof(float)
+                                  : use_gram ? 0
+                                             : bytes;
+
+    state_after.push_back(graph.add(distance_after, [&, distance_bytes] {
+      if (opts.neighbours > 0) {
+        TraceSpan span("Finding nearest neighbours");
+
+        try {
+          pipeline.write_neighbours("coda__knn.tsv", opts.neighbours, &writer);
+        }
+        catch (const runtime_error& e) {
+          cerr << "ERROR -- " << e.what() << endl;
+          failed = true;
+        }
+
+        span.add_rows((double)pipeline.samples());
+        span.add_bytes(distance_bytes);
+        return;
+      }
+
+      TraceSpan span("Calculating Aitchison distance");
+
+      const char* ait_fname = opts.distance_layout == DistanceLayout::square
+                              ? "coda__ait.tsv"
+                              : "coda__ait_condensed.tsv";
+
+      try {
+        if (opts.save_state_fname) {
+          // The state keeps them.
+          distances = pipeline.distances();
+
+          write_distance_matrix(ait_fname, distances, pipeline.counts().samples, opts.distance_layout, &writer);
+        }
+        else {
+          pipeline.write_distances(ait_fname, opts.distance_layout, &writer);
+        }
+      }
+      catch (const runtime_error& e) {
+        cerr << "ERROR -- " << e.what() << endl;
+        failed = true;
+      }
+
+      // Rows of distances.
+      span.add_rows((double)pipeline.samples());
+      span.add_bytes(distance_bytes);
+    }));
   }
-  else {
-    cerr << "ERROR -- Couldn't open the file!";
-    return EXIT_FAILURE;
+
+  if (opts.stage_pca) {
+    const size_t pca_stage = graph.add(use_gram ? gram_stage : vector<size_t>(), [&] {
+      TraceSpan span(use_gram ? "Calculating PCA from the Gram matrix" : "Calculating SVD");
+
+      pca = pipeline.pca();
+
+      if (!use_gram) {
+        span.add_rows(rows);
+        span.add_bytes(bytes);
+      }
+
+      fprintf(stderr,
+              "INFO -- %ld principal components explain %.3f%% of the variance\n",
+              (long)pca.projection.cols(),
+              pca.explained.sum() * 100);
+
+      if (pca.sketch_error > sketch_max_error) {
+        fprintf(stderr,
+                "INFO -- The spectrum hasn't decayed enough for --single-pass (the sketch's error is about "
+                "%.0f%% of the variance it shows), so the components and variance are rough; drop "
+                "--single-pass for exact ones\n",
+                pca.sketch_error * 100);
+      }
+    });
+
+    graph.add({ pca_stage }, [&] {
+      TraceSpan span("Writing sample projection");
+
+      try {
+        pipeline.write_projection("coda__projection.tsv", pca, &writer);
+      }
+      catch (const runtime_error& e) {
+        cerr << "ERROR -- " << e.what() << endl;
+        failed = true;
+      }
+
+      span.add_rows((double)pca.projection.rows());
+    });
+
+    state_after.push_back(pca_stage);
   }
 
-  log_msg("Creating sample lookup table");
-  // Need to look up samples and OTUs by index
+  if (opts.save_state_fname) {
+    graph.add(state_after, [&] {
+      TraceSpan span("Saving state");
+
+      try {
+        write_state(opts.save_state_fname, make_state(pipeline, pca, std::move(distances)));
+      }
+      catch (const runtime_error& e) {
+        cerr << "ERROR -- " << e.what() << endl;
+        failed = true;
+      }
 
-  for (const auto& pair : sample_index) {
-    index_to_sample.try_emplace(pair.second, pair.first);
+      span.add_rows(rows);
+      span.add_bytes(bytes);
+    });
   }
 
-  log_msg("Creating OTU lookup table");
-  for (const auto& pair : otu_index) {
-    index_to_otu.try_emplace(pair.second, pair.first);
+  try {
+    graph.run(stage_threads(opts));
+  }
+  catch (const runtime_error& e) {
+    cerr << "ERROR -- " << e.what() << endl;
+    failed = true;
+  }
+
+  TraceSpan span("Finishing output");
+
+  try {
+    writer.finish();
+  }
+  catch (const runtime_error& e) {
+    cerr << "ERROR -- " << e.what() << endl;
+    failed = true;
   }
 
-  log_msg("Normalizing counts");
+  return !failed;
+}
 
-  // nrows = nOTUs, ncols = nsamples
-  Eigen::MatrixXf otu_table = Eigen::MatrixXf::Constant(otu_index.size(), sample_index.size(), zero_replacement);
+/// Returns false (after saying why) if a trace file can't be written.
+static bool
+write_trace(const Options& opts)
+{
+  try {
+    if (opts.trace_fname) {
+      trace_write_json(opts.trace_fname);
+    }
+    if (opts.trace_events_fname) {
+      trace_write_chrome(opts.trace_events_fname);
+    }
+  }
+  catch (const runtime_error& e) {
+    cerr << "ERROR -- " << e.what() << endl;
+    return false;
+  }
 
-  fprintf(stderr,
-          "INFO -- Table %% zeros: %.3f\n",
-          zero_counts / (double)otu_table.size() * 100);
+  return true;
+}
 
-  // Convert input to normalized counts and into an Eigen matrix
-  for (const auto& element : elements) {
-    float norm_count = element_normalize_count(element);
+/// Adds the samples in `counts` to the state in opts.update_fname, writes the
+/// outputs for all of them, and saves the state again.
+static int
+update_state(Counts& counts, const Options& opts)
+{
+  CodaState state;
+  {
+    TraceSpan span("Reading state");
 
-    otu_table(element.otu_index, element.sample_index) = norm_count;
+    try {
+      state = read_state(opts.update_fname);
+    }
+    catch (const runtime_error& e) {
+      cerr << "ERROR -- " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+    span.add_rows((double)state.clr.rows());
   }
 
-  // Empty and free elements.
-  elements.clear();
-  vector<Element>().swap(elements);
+  const size_t old_samples = state.samples.size();
+  {
+    TraceSpan span("Adding samples");
 
-  log_msg("Calculating CLR transformation");
+    try {
+      add_samples(state, counts, opts.pipeline.tile_cols);
+    }
+    catch (const runtime_error& e) {
+      cerr << "ERROR -- " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
 
-  clr_in_place(otu_table);
+    span.add_rows((double)counts.samples.size());
+  }
 
-  log_msg("Printing CLR matrix");
+  fprintf(stderr,
+          "INFO -- Added %zu samples to %zu; %.3f%% of the projections are folded in\n",
+          counts.samples.size(),
+          old_samples,
+          folded_fraction(state) * 100);
+
+  if (folded_fraction(state) > opts.refresh) {
+    TraceSpan span("Refreshing PCA");
 
-  // Print CLR matrix
-  ofstream clr_out;
-  clr_out.open("coda__clr.tsv");
+    refresh_pca(state, opts.pipeline);
 
-  if (!clr_out.is_open()) {
-    fprintf(stderr,
-            "ERROR -- Couldn't open clr_outfile for writing.");
+    span.add_rows((double)state.clr.rows());
+    span.add_bytes((double)sizeof(float) * state.clr.size());
   }
 
-  clr_out << "otu";
-  for (size_t i = 0; i < index_to_sample.size(); ++i) {
-    clr_out << "\t" << index_to_sample.at(i);
+  const SamplePca pca = state_pca(state);
+
+  fprintf(stderr,
+          "INFO -- %ld principal components explain %.3f%% of the variance\n",
+          (long)pca.projection.cols(),
+          pca.explained.sum() * 100);
+
+  AsyncWriter writer;
+
+  try {
+    {
+      TraceSpan span("Printing CLR matrix");
+
+      write_state_clr("coda__clr.tsv", state, &writer);
+    }
+    {
+      TraceSpan span("Writing Aitchison distance");
+
+      write_distance_matrix(opts.distance_layout == DistanceLayout::square ? "coda__ait.tsv"
+                                                                           : "coda__ait_condensed.tsv",
+                            state.distances,
+                            state.samples,
+                            opts.distance_layout,
+                            &writer);
+    }
+    {
+      TraceSpan span("Writing sample projection");
+
+      write_projection("coda__projection.tsv", state.samples, pca.projection, &writer);
+    }
+    {
+      TraceSpan span("Saving state");
+
+      write_state(opts.save_state_fname ? opts.save_state_fname : opts.update_fname, state);
+    }
+
+    TraceSpan span("Finishing output");
+
+    writer.finish();
+  }
+  catch (const runtime_error& e) {
+    cerr << "ERROR -- " << e.what() << endl;
+    return EXIT_FAILURE;
   }
-  clr_out << endl;
 
-  for (Eigen::Index i = 0; i < otu_table.rows(); ++i) {
-    string otu = index_to_otu.at(i);
-    clr_out << otu
-            << "\t"
-            << otu_table.row(i).format(TSVFormat)
-            << endl;
+  return 0;
+}
+
+/// Loads a saved state and answers queries about it until the input ends
+/// (or forever, on a socket).
+static int
+serve_state(const char* state_fname, const char* socket_path)
+{
+  Eigen::setNbThreads(1);
+
+  CodaState state;
+  try {
+    state = read_state(state_fname);
   }
+  catch (const runtime_error& e) {
+    cerr << "ERROR -- " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+#ifdef _OPENMP
+  const int num_threads = omp_get_max_threads();
+#else
+  const int num_threads = 1;
+#endif
 
-  clr_out.close();
+  fprintf(stderr,
+          "INFO -- Serving %zu samples with %d threads on %s\n",
+          state.samples.size(),
+          num_threads,
+          socket_path ? socket_path : "stdin and stdout");
 
-  log_msg("Calculating Aitchison distance");
+  QueryServer server(state, num_threads);
 
-  Eigen::MatrixXf aitchison_distance = colwise_distance(otu_table);
+  try {
+    if (socket_path) {
+      server.listen(socket_path);
+    }
+    else {
+      server.serve(STDIN_FILENO, STDOUT_FILENO);
+    }
+  }
+  catch (const runtime_error& e) {
+    cerr << "ERROR -- " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
 
-  ofstream ait_out;
-  ait_out.open("coda__ait.tsv");
+  return 0;
+}
 
-  if (!ait_out.is_open()) {
-    fprintf(stderr,
-            "ERROR -- Couldn't open clr_outfile for writing.");
+int main(int argc, char* argv[])
+{
+  if (argc == 4 && strcmp(argv[1], "convert") == 0) {
+    return convert_counts(argv[2], argv[3]);
   }
 
-  // Print Aitchison distance
-  ait_out << "sample";
-  for (size_t i = 0; i < index_to_sample.size(); ++i) {
-    ait_out << "\t" << index_to_sample.at(i);
+  if ((argc == 3 || argc == 4) && strcmp(argv[1], "serve") == 0) {
+    return serve_state(argv[2], argc == 4 ? argv[3] : nullptr);
   }
-  ait_out << endl;
 
-  for (int i = 0; i < aitchison_distance.rows(); ++i) {
-    string sample = index_to_sample.at(i);
-    ait_out << sample
-            << "\t"
-            << aitchison_distance.row(i).format(TSVFormat)
-            << endl;
+  Options opts;
+  if (!parse_options(argc, argv, opts)) {
+    print_usage(argv[0]);
+
+    return 1;
   }
 
-  ait_out.close();
+  // All parallel work is split into pieces that don't depend on the number
+  // of threads, and run by OpenMP.  Eigen's own threaded products would
+  // round differently with the thread count, so keep those serial.
+  Eigen::setNbThreads(1);
 
-  // Do the SVD
-  std::mt19937_64 random_engine{};
-  random_engine.seed(seed);
+  const char* in_fname = opts.in_fname;
 
-  log_msg("Calculating SVD");
+  fprintf(stderr, "INFO -- seed: %d\n", opts.pipeline.seed);
 
-  Rsvd::RandomizedSvd<Eigen::MatrixXf, std::mt19937_64, Rsvd::SubspaceIterationConditioner::Lu> rsvd = randomized_svd(random_engine, otu_table, otu_table.cols());
+  if (opts.trace_fname || opts.trace_events_fname) {
+    trace_start(opts.perf_counters);
+  }
 
-  rsvd.compute(otu_table, otu_table.cols());
+  // Read input file
+  Counts counts;
+  {
+    TraceSpan span("Reading and normalizing counts");
 
-  const Eigen::MatrixXf sample_projection = rsvd.matrixV() * rsvd.singularValues().asDiagonal();
+    try {
+      if (is_binary_table(in_fname)) {
+        counts = read_binary_table(in_fname, !opts.pipeline.out_of_core);
+      }
+      else if (opts.pipeline.out_of_core) {
+        cerr << "ERROR -- --out-of-core needs a binary table (see `coda convert`)" << endl;
+        return EXIT_FAILURE;
+      }
+      else {
+        MappedFile in_file(in_fname);
+        // Only f32 has a sparse CLR table, and new samples go into a dense
+        // state.
+        counts = read_counts(in_file,
+                             opts.pipeline.precision == Precision::f32 && !opts.update_fname
+                             ? TableLayout::automatic
+                             : TableLayout::dense);
+      }
+    }
+    catch (const runtime_error& e) {
+      cerr << "ERROR -- " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
 
-  assert(sample_projection.cols() == sample_projection.rows());
+    // Out of core, the table is only mapped so far.
+    struct stat in_stat;
+    if (!opts.pipeline.out_of_core && stat(in_fname, &in_stat) == 0) {
+      span.add_bytes((double)in_stat.st_size);
+    }
+    span.add_rows((double)counts.otus.size());
+  }
 
-  // Write the SVD
-  log_msg("Writing sample projection");
+  fprintf(stderr,
+          "INFO -- Table %% zeros: %.3f\n",
+          counts.zero_counts / ((double)counts.otus.size() * counts.samples.size()) * 100);
+
+  fprintf(stderr, "INFO -- CLR kernel: %s\n", clr_kernel_isa());
 
-  ofstream sample_projection_out;
-  sample_projection_out.open("coda__projection.tsv");
+  if (opts.update_fname) {
+    const int status = update_state(counts, opts);
 
-  if (!sample_projection_out.is_open()) {
-    fprintf(stderr,
-            "ERROR -- Couldn't open clr_outfile for writing.");
+    return write_trace(opts) ? status : EXIT_FAILURE;
   }
 
-  sample_projection_out << "sample";
-  for (size_t i = 0; i < index_to_sample.size(); ++i) {
-    sample_projection_out << "\tPC" << (i + 1);
+  if (opts.pipeline.out_of_core) {
+    fprintf(stderr, "INFO -- Computing the CLR table out of core\n");
+  }
+  else if (counts.is_sparse) {
+    fprintf(stderr, "INFO -- Using the sparse CLR table\n");
   }
-  sample_projection_out << endl;
 
-  for (Eigen::Index i = 0; i < sample_projection.rows(); ++i) {
-    string sample = index_to_sample.at(i);
-    sample_projection_out << sample
-                          << "\t"
-                          << sample_projection.row(i).format(TSVFormat)
-                          << endl;
+  Pipeline pipeline(opts.pipeline);
+  {
+    // Out of core, each pass over the table computes its CLR again.
+    TraceSpan span("Calculating CLR transformation");
+
+    try {
+      pipeline.set_counts(std::move(counts));
+    }
+    catch (const runtime_error& e) {
+      cerr << "ERROR -- " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+
+    if (!opts.pipeline.out_of_core) {
+      span.add_rows((double)pipeline.otus());
+      span.add_bytes(pipeline.clr_bytes());
+    }
   }
 
-  return 0;
-}
\ No newline at end of file
+  const bool written = write_outputs(pipeline, opts);
+
+  return write_trace(opts) && written ? 0 : EXIT_FAILURE;
+}
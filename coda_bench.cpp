@@ -0,0 +1,538 @@
+#include <getopt.h> // getopt_long
+#include <stdlib.h> // mkdtemp, getenv
+#include <string.h> // strcmp
+#include <unistd.h> // unlink, rmdir
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "async_writer.h"
+#include "dense_clr.h"
+#include "ingest.h"
+#include "mapped_file.h"
+#include "mat.h"
+#include "rsvd.h"
+#include "sparse_clr.h"
+#include "synthetic.h"
+#include "tiled_distance.h"
+#include "utils.h"
+#include "version.h"
+
+/// Matrix products per randomized SVD with the default 2 subspace
+/// iterations: the range, 2 per iteration each way, and the projection.
+#define svd_products 6
+
+/// Directions the randomized SVD samples beyond the rank (see sample_pca()).
+#define svd_oversamples ((Eigen::Index)5)
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+typedef struct BenchOptions
+{
+  SyntheticSpec spec;
+
+  Eigen::Index rank;
+  int          repeats;
+  TableLayout  layout;
+
+  // Set to only write the generated table there.
+  const char* table_fname;
+} BenchOptions;
+
+/// The best time for a stage, and the work one run of it does.
+typedef struct StageResult
+{
+  const char* stage;
+  double      seconds;
+
+  // Input lines for parsing, rows (OTUs) of the CLR table otherwise.
+  double rows;
+
+  // Bytes of the input file or CLR table, each counted once.
+  double bytes;
+
+  // Nominal floating point operations for a dense table; 0 if the stage
+  // isn't arithmetic.
+  double flops;
+} StageResult;
+
+static void
+print_usage(const char* prog)
+{
+  fprintf(stderr,
+          "VERSION: %s"
+          "\n\n"
+          "Usage: %s [options] <seed>\n\n"
+          "Generates a synthetic counts table and times each stage of coda on\n"
+          "it, then all of them end to end.  Prints one tab separated line per\n"
+          "stage to stdout.\n\n"
+          "Options:\n"
+          "  -n, --otus <n>        OTUs (default: 20000)\n"
+          "  -m, --samples <n>     Samples (default: 500)\n"
+          "  -d, --density <f>     Fraction of filled cells (default: 0.1)\n"
+          "  -k, --rank <k>        Principal components (default: 10)\n"
+          "  -r, --repeats <n>     Runs per stage, the fastest is kept (default: 3)\n"
+          "  -l, --layout <auto|dense|sparse>\n"
+          "      Table layout to read into (default: auto, like coda).\n"
+          "  -w, --write <file>    Only write the generated table to <file>.\n\n",
+          VERSION,
+          prog);
+}
+
+/// Parses a positive integer option.  Returns false (after saying why) if it
+/// isn't one.
+static bool
+parse_count(const char* arg, const char* what, long& value)
+{
+  try {
+    value = stol(arg);
+  }
+  catch (const exception& e) {
+    value = 0;
+  }
+
+  if (value <= 0) {
+    cerr << "ERROR -- " << what << " must be a positive integer, not '" << arg << "'" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+/// Returns false (after saying why) if the command line is bad.
+static bool
+parse_options(int argc, char* argv[], BenchOptions& opts)
+{
+  static const struct option long_options[] = {
+    { "otus", required_argument, nullptr, 'n' },
+    { "samples", required_argument, nullptr, 'm' },
+    { "density", required_argument, nullptr, 'd' },
+    { "rank", required_argument, nullptr, 'k' },
+    { "repeats", required_argument, nullptr, 'r' },
+    { "layout", required_argument, nullptr, 'l' },
+    { "write", required_argument, nullptr, 'w' },
+    { nullptr, 0, nullptr, 0 },
+  };
+
+  opts.spec.otus    = 20000;
+  opts.spec.samples = 500;
+  opts.spec.density = 0.1;
+  opts.rank         = 10;
+  opts.repeats      = 3;
+  opts.layout       = TableLayout::automatic;
+  opts.table_fname  = nullptr;
+
+  long value;
+  int  opt;
+  while ((opt = getopt_long(argc, argv, "n:m:d:k:r:l:w:", long_options, nullptr)) != -1) {
+    switch (opt) {
+      case 'n':
+        if (!parse_count(optarg, "--otus", value)) {
+          return false;
+        }
+        opts.spec.otus = value;
+        break;
+      case 'm':
+        if (!parse_count(optarg, "--samples", value)) {
+          return false;
+        }
+        opts.spec.samples = value;
+        break;
+      case 'd':
+        try {
+          opts.spec.density = stod(optarg);
+        }
+        catch (const exception& e) {
+          opts.spec.density = 0;
+        }
+        if (!(opts.spec.density > 0 && opts.spec.density <= 1)) {
+          cerr << "ERROR -- --density must be in (0, 1], not '" << optarg << "'" << endl;
+          return false;
+        }
+        break;
+      case 'k':
+        if (!parse_count(optarg, "--rank", value)) {
+          return false;
+        }
+        opts.rank = value;
+        break;
+      case 'r':
+        if (!parse_count(optarg, "--repeats", value)) {
+          return false;
+        }
+        opts.repeats = (int)value;
+        break;
+      case 'l':
+        if (strcmp(optarg, "auto") == 0) {
+          opts.layout = TableLayout::automatic;
+        }
+        else if (strcmp(optarg, "dense") == 0) {
+          opts.layout = TableLayout::dense;
+        }
+        else if (strcmp(optarg, "sparse") == 0) {
+          opts.layout = TableLayout::sparse;
+        }
+        else {
+          cerr << "ERROR -- unknown layout '" << optarg << "'" << endl;
+          return false;
+        }
+        break;
+      case 'w':
+        opts.table_fname = optarg;
+        break;
+      default:
+        return false;
+    }
+  }
+
+  if (argc - optind != 1) {
+    return false;
+  }
+
+  try {
+    opts.spec.seed = stoull(argv[optind]);
+  }
+  catch (const exception& e) {
+    cerr << "ERROR -- could not convert the seed!" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+static double
+seconds_since(Clock::time_point start)
+{
+  return chrono::duration<double>(Clock::now() - start).count();
+}
+
+static int
+num_threads()
+{
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+static void
+print_header()
+{
+  printf("version\tstage\tlayout\totus\tsamples\tdensity\tthreads\trepeats\t"
+         "seconds\trows_per_s\tgb_per_s\tgflop_per_s\n");
+}
+
+static void
+print_result(const StageResult& result, const BenchOptions& opts, const Counts& counts)
+{
+  printf("%s\t%s\t%s\t%ld\t%ld\t%g\t%d\t%d\t%.6f\t%.6g\t%.6g\t%.6g\n",
+         VERSION,
+         result.stage,
+         counts.is_sparse ? "sparse" : "dense",
+         (long)counts.otus.size(),
+         (long)counts.samples.size(),
+         opts.spec.density,
+         num_threads(),
+         opts.repeats,
+         result.seconds,
+         result.rows / result.seconds,
+         result.bytes / result.seconds * 1e-9,
+         result.flops / result.seconds * 1e-9);
+  fflush(stdout);
+}
+
+/// Fastest of `repeats` calls to `run`, which times itself so it can leave
+/// its setup out.
+template <typename F>
+static double
+best_seconds(int repeats, F&& run)
+{
+  double best = run();
+
+  for (int r = 1; r < repeats; ++r) {
+    best = min(best, run());
+  }
+
+  return best;
+}
+
+static double
+svd_flops(Eigen::Index rows, Eigen::Index cols, Eigen::Index rank)
+{
+  const Eigen::Index dim = min(rank + svd_oversamples, min(rows, cols));
+
+  return (double)svd_products * 2 * rows * cols * dim;
+}
+
+/// The stages after the CLR, as coda runs them with `--gram never`.
+template <typename ClrTable>
+static void
+write_distances_and_pca(const ClrTable& clr,
+                        const Counts& counts,
+                        const BenchOptions& opts,
+                        const string& ait_fname)
+{
+  AsyncWriter writer;
+
+  write_distances(ait_fname,
+                  clr,
+                  counts.samples,
+                  DistanceLayout::square,
+                  distance_tile_cols,
+                  &writer);
+
+  Rsvd::PhiloxEngine random_engine{};
+  random_engine.seed(opts.spec.seed);
+
+  sample_pca(random_engine, clr, PcaTarget{ opts.rank, 0 });
+
+  writer.finish();
+}
+
+/// Times the stages that take the CLR table.
+template <typename ClrTable>
+static void
+bench_clr_stages(const ClrTable& clr,
+                 const Counts& counts,
+                 const BenchOptions& opts,
+                 const string& ait_fname)
+{
+  const double rows  = (double)clr.rows();
+  const double cols  = (double)clr.cols();
+  const double bytes = table_bytes(clr);
+
+  log_msg("Timing the Gram matrix");
+
+  const double gram_seconds = best_seconds(opts.repeats, [&] {
+    const auto start = Clock::now();
+
+    const Eigen::MatrixXd gram = gram_matrix(clr);
+
+    return seconds_since(start);
+  });
+
+  // The upper triangle, diagonal included.
+  print_result({ "gram", gram_seconds, rows, bytes, rows * cols * (cols + 1) }, opts, counts);
+
+  log_msg("Timing the Aitchison distances");
+
+  const double distance_seconds = best_seconds(opts.repeats, [&] {
+    const auto start = Clock::now();
+
+    AsyncWriter writer;
+    write_distances(ait_fname,
+                    clr,
+                    counts.samples,
+                    DistanceLayout::square,
+                    distance_tile_cols,
+                    &writer);
+    writer.finish();
+
+    return seconds_since(start);
+  });
+
+  // The square layout computes every tile.
+  print_result({ "distance", distance_seconds, rows, bytes, 2 * rows * cols * cols }, opts, counts);
+
+  log_msg("Timing the PCA");
+
+  const double pca_seconds = best_seconds(opts.repeats, [&] {
+    Rsvd::PhiloxEngine random_engine{};
+    random_engine.seed(opts.spec.seed);
+
+    const auto start = Clock::now();
+
+    sample_pca(random_engine, clr, PcaTarget{ opts.rank, 0 });
+
+    return seconds_since(start);
+  });
+
+  print_result({ "pca", pca_seconds, rows, bytes, svd_flops(clr.rows(), clr.cols(), opts.rank) },
+               opts,
+               counts);
+}
+
+/// Times each stage on the table in `counts_fname`, then all of them end to
+/// end.
+static void
+run_benchmarks(const string& counts_fname, const BenchOptions& opts, const string& ait_fname)
+{
+  const MappedFile in_file(counts_fname);
+
+  const double in_bytes = (double)in_file.size();
+  const double in_lines = (double)count(in_file.begin(), in_file.end(), '\n');
+
+  log_msg("Timing parsing");
+
+  Counts counts;
+
+  const double parse_seconds = best_seconds(opts.repeats, [&] {
+    const auto start = Clock::now();
+
+    counts = read_counts(MappedFile(counts_fname), opts.layout);
+
+    return seconds_since(start);
+  });
+
+  print_header();
+  print_result({ "parse", parse_seconds, in_lines, in_bytes, 0 }, opts, counts);
+
+  const double otus = (double)counts.otus.size();
+
+  log_msg("Timing the CLR transformation");
+
+  if (counts.is_sparse) {
+    unique_ptr<SparseClr> clr;
+
+    const double clr_seconds = best_seconds(opts.repeats, [&] {
+      // SparseClr takes the table over, so give it a copy.
+      Counts copy;
+      copy.is_sparse    = true;
+      copy.sparse_table = counts.sparse_table;
+      copy.col_log_sums = counts.col_log_sums;
+
+      const auto start = Clock::now();
+
+      clr = make_unique<SparseClr>(copy);
+
+      return seconds_since(start);
+    });
+
+    print_result({ "clr", clr_seconds, otus, table_bytes(*clr), 0 }, opts, counts);
+
+    bench_clr_stages(*clr, counts, opts, ait_fname);
+  }
+  else {
+    Eigen::MatrixXf clr;
+
+    const double clr_seconds = best_seconds(opts.repeats, [&] {
+      clr = counts_table(counts);
+
+      const auto start = Clock::now();
+
+      clr_in_place(clr, counts.col_log_sums);
+
+      return seconds_since(start);
+    });
+
+    const DenseClr<SinglePrecision> dense_clr(clr);
+
+    print_result({ "clr", clr_seconds, otus, table_bytes(dense_clr), 0 }, opts, counts);
+
+    bench_clr_stages(dense_clr, counts, opts, ait_fname);
+  }
+
+  log_msg("Timing end to end");
+
+  const double end_to_end_seconds = best_seconds(opts.repeats, [&] {
+    const auto start = Clock::now();
+
+    Counts run_counts = read_counts(MappedFile(counts_fname), opts.layout);
+
+    if (run_counts.is_sparse) {
+      const SparseClr clr(run_counts);
+
+      write_distances_and_pca(clr, run_counts, opts, ait_fname);
+    }
+    else {
+      Eigen::Map<Eigen::MatrixXf> table = counts_table(run_counts);
+
+      clr_in_place(table, run_counts.col_log_sums);
+
+      write_distances_and_pca(DenseClr<SinglePrecision>(table), run_counts, opts, ait_fname);
+    }
+
+    return seconds_since(start);
+  });
+
+  const double flops = 2 * otus * counts.samples.size() * counts.samples.size()
+                       + svd_flops(counts.otus.size(), counts.samples.size(), opts.rank);
+
+  print_result({ "end_to_end", end_to_end_seconds, in_lines, in_bytes, flops }, opts, counts);
+}
+
+static bool
+write_file(const string& fname, const string& text)
+{
+  ofstream out(fname, ios::binary);
+  out.write(text.data(), (streamsize)text.size());
+  out.close();
+
+  if (!out) {
+    cerr << "ERROR -- couldn't write '" << fname << "'" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  BenchOptions opts;
+  if (!parse_options(argc, argv, opts)) {
+    print_usage(argv[0]);
+
+    return 1;
+  }
+
+  // Same as coda: the OpenMP pieces are the only parallel work.
+  Eigen::setNbThreads(1);
+
+  log_msg("Generating counts");
+
+  string table = synthetic_counts(opts.spec);
+
+  if (opts.table_fname) {
+    return write_file(opts.table_fname, table) ? 0 : EXIT_FAILURE;
+  }
+
+  // The table is parsed from a file, like coda does, and the distances are
+  // written to one too.
+  const char* tmp_root = getenv("TMPDIR");
+  string      dir      = string(tmp_root ? tmp_root : "/tmp") + "/coda_bench.XXXXXX";
+
+  if (!mkdtemp(&dir[0])) {
+    cerr << "ERROR -- couldn't make a temporary directory in '" << dir << "'" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const string counts_fname = dir + "/counts.txt";
+  const string ait_fname    = dir + "/ait.tsv";
+
+  int status = 0;
+
+  const bool written = write_file(counts_fname, table);
+
+  string().swap(table);
+
+  if (!written) {
+    status = EXIT_FAILURE;
+  }
+  else {
+    try {
+      run_benchmarks(counts_fname, opts, ait_fname);
+    }
+    catch (const runtime_error& e) {
+      cerr << "ERROR -- " << e.what() << endl;
+      status = EXIT_FAILURE;
+    }
+  }
+
+  unlink(counts_fname.c_str());
+  unlink(ait_fname.c_str());
+  rmdir(dir.c_str());
+
+  return status;
+}
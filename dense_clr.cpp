@@ -0,0 +1,127 @@
+#include "dense_clr.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <type_traits>
+
+#include "clr_kernel.h"
+
+/// True if the storage type needs converting before products.
+template <typename Policy>
+constexpr bool needs_conversion = !std::is_same<typename Policy::Storage, typename Policy::Compute>::value;
+
+template <typename Policy>
+typename Policy::ComputeMatrix
+DenseClr<Policy>::row_block(Eigen::Index first, Eigen::Index count) const
+{
+  return m_.middleRows(first, count).template cast<typename Policy::Compute>();
+}
+
+template <typename Policy>
+typename Policy::ComputeMatrix
+DenseClr<Policy>::multiply(const Eigen::Ref<const ComputeMatrix>& x) const
+{
+  assert(x.rows() == cols());
+
+  ComputeMatrix result(rows(), x.cols());
+
+  const long num_pieces = (long)((rows() + dense_product_rows - 1) / dense_product_rows);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long p = 0; p < num_pieces; ++p) {
+    const Eigen::Index first = p * dense_product_rows;
+    const Eigen::Index count = std::min(dense_product_rows, rows() - first);
+
+    if constexpr (needs_conversion<Policy>) {
+      result.middleRows(first, count).noalias() = row_block(first, count) * x;
+    }
+    else {
+      result.middleRows(first, count).noalias() = m_.middleRows(first, count) * x;
+    }
+  }
+
+  return result;
+}
+
+template <typename Policy>
+typename Policy::ComputeMatrix
+DenseClr<Policy>::adjoint_multiply(const Eigen::Ref<const ComputeMatrix>& y) const
+{
+  assert(y.rows() == rows());
+
+  ComputeMatrix result(cols(), y.cols());
+
+  const long num_pieces = (long)((cols() + dense_product_cols - 1) / dense_product_cols);
+
+  // Each output row is one column of A, so this splits by column with no
+  // partial sums to combine.
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long p = 0; p < num_pieces; ++p) {
+    const Eigen::Index first = p * dense_product_cols;
+    const Eigen::Index count = std::min(dense_product_cols, cols() - first);
+
+    if constexpr (needs_conversion<Policy>) {
+      // Convert a panel of rows at a time, in a fixed order.
+      result.middleRows(first, count).setZero();
+
+      for (Eigen::Index first_row = 0; first_row < rows(); first_row += dense_product_rows) {
+        const Eigen::Index nrows = std::min(dense_product_rows, rows() - first_row);
+        const ComputeMatrix panel
+          = m_.block(first_row, first, nrows, count).template cast<typename Policy::Compute>();
+
+        result.middleRows(first, count).noalias() += panel.transpose() * y.middleRows(first_row, nrows);
+      }
+    }
+    else {
+      result.middleRows(first, count).noalias() = m_.middleCols(first, count).transpose() * y;
+    }
+  }
+
+  return result;
+}
+
+template <typename Policy>
+typename Policy::StorageMatrix
+clr_table(const Counts& counts)
+{
+  typedef typename Policy::Storage Storage;
+  typedef typename Policy::Compute Compute;
+
+  const Eigen::Index nrows = (Eigen::Index)counts.otus.size();
+  const Eigen::Index ncols = (Eigen::Index)counts.samples.size();
+
+  assert(!counts.is_sparse);
+
+  typename Policy::StorageMatrix clr(nrows, ncols);
+
+#pragma omp parallel for schedule(static)
+  for (Eigen::Index j = 0; j < ncols; ++j) {
+    const float* col = counts.table + j * nrows;
+
+    if constexpr (std::is_same<Compute, double>::value) {
+      Eigen::VectorXd log_col(nrows);
+
+      for (Eigen::Index i = 0; i < nrows; ++i) {
+        log_col(i) = std::log((double)col[i]);
+      }
+
+      clr.col(j) = (log_col.array() - log_col.mean()).template cast<Storage>();
+    }
+    else {
+      Eigen::VectorXf clr_col(nrows);
+
+      clr_column(col, clr_col.data(), nrows, (float)(counts.col_log_sums(j) / nrows));
+
+      clr.col(j) = clr_col.template cast<Storage>();
+    }
+  }
+
+  return clr;
+}
+
+#define INSTANTIATE_DENSE_CLR(Policy)  \
+  template class DenseClr<Policy>;     \
+  template typename Policy::StorageMatrix clr_table<Policy>(const Counts&);
+
+CODA_FOR_EACH_PRECISION(INSTANTIATE_DENSE_CLR)
@@ -0,0 +1,134 @@
+#ifndef CODA_DENSE_CLR_H
+#define CODA_DENSE_CLR_H
+
+#include <Eigen/Dense>
+
+#include "ingest.h"
+#include "precision.h"
+
+/// Rows of A per parallel piece of A * x, and per panel of A^T * y.
+#define dense_product_rows ((Eigen::Index)4096)
+
+/// Columns of A per parallel piece of A^T * y.
+#define dense_product_cols ((Eigen::Index)64)
+
+template <typename Policy>
+class DenseClrAdjoint;
+
+/// @brief Dense CLR table, stored as `Policy::Storage`, whose products with
+/// thin matrices run in parallel over fixed pieces, in `Policy::Compute`.
+///
+/// Eigen picks its GEMM blocking from the thread count, so its own threaded
+/// products round differently with OMP_NUM_THREADS.  Here each piece of the
+/// result is one single-threaded product, and the pieces don't depend on the
+/// thread count, so neither does the result.  When storage and compute types
+/// differ, A is converted a panel of dense_product_rows rows at a time.
+/// Products work like they do for SparseClr, so Rsvd::RandomizedSvd takes
+/// either.
+template <typename Policy>
+class DenseClr
+{
+public:
+  typedef typename Policy::StorageMatrix StorageMatrix;
+  typedef typename Policy::ComputeMatrix ComputeMatrix;
+
+  /// Keeps a reference to `m`, which must outlive this.
+  explicit DenseClr(const Eigen::Ref<const StorageMatrix>& m)
+    : m_(m)
+  {}
+
+  Eigen::Index
+  rows() const
+  { return m_.rows(); }
+
+  Eigen::Index
+  cols() const
+  { return m_.cols(); }
+
+  const Eigen::Ref<const StorageMatrix>&
+  storage() const
+  { return m_; }
+
+  /// Rows [first, first + count), in the compute type.
+  ComputeMatrix
+  row_block(Eigen::Index first, Eigen::Index count) const;
+
+  /// A * x
+  ComputeMatrix
+  multiply(const Eigen::Ref<const ComputeMatrix>& x) const;
+
+  /// A^T * y
+  ComputeMatrix
+  adjoint_multiply(const Eigen::Ref<const ComputeMatrix>& y) const;
+
+  DenseClrAdjoint<Policy>
+  adjoint() const;
+
+private:
+  const Eigen::Ref<const StorageMatrix> m_;
+};
+
+/// A^T, only good for multiplying.
+template <typename Policy>
+class DenseClrAdjoint
+{
+public:
+  explicit DenseClrAdjoint(const DenseClr<Policy>& m)
+    : m_(m)
+  {}
+
+  Eigen::Index
+  rows() const
+  { return m_.cols(); }
+
+  Eigen::Index
+  cols() const
+  { return m_.rows(); }
+
+  const DenseClr<Policy>&
+  nested() const
+  { return m_; }
+
+private:
+  const DenseClr<Policy>& m_;
+};
+
+template <typename Policy>
+inline DenseClrAdjoint<Policy>
+DenseClr<Policy>::adjoint() const
+{
+  return DenseClrAdjoint<Policy>(*this);
+}
+
+template <typename Policy, typename Derived>
+typename Policy::ComputeMatrix
+operator*(const DenseClr<Policy>& a, const Eigen::MatrixBase<Derived>& x)
+{
+  return a.multiply(x);
+}
+
+template <typename Policy, typename Derived>
+typename Policy::ComputeMatrix
+operator*(const DenseClrAdjoint<Policy>& a, const Eigen::MatrixBase<Derived>& y)
+{
+  return a.nested().adjoint_multiply(y);
+}
+
+/// y^T * A = (A^T * y)^T
+template <typename Policy, typename Derived>
+typename Policy::ComputeMatrix
+operator*(const Eigen::MatrixBase<Derived>& y, const DenseClr<Policy>& a)
+{
+  return a.adjoint_multiply(y.adjoint()).adjoint();
+}
+
+/// @brief The CLR table of the dense `counts` in `Policy::Storage`.
+///
+/// Logs are taken in `Policy::Compute`: with clr_log_column() for float, so
+/// the values match clr_in_place() before rounding to the storage type, and
+/// with std::log and fresh double column means for double.
+template <typename Policy>
+typename Policy::StorageMatrix
+clr_table(const Counts& counts);
+
+#endif //CODA_DENSE_CLR_H
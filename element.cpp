@@ -1,34 +1,76 @@
 #include "element.h"
 
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
 using namespace std;
 
 void
 element_print(const Element& element)
 {
   fprintf(stdout,
-          "sample: %s, sample_index: %lu, otu: %s, otu_index: %lu, otu_len: %f, count: %f\n",
-          element.sample.c_str(),
+          "sample_index: %lu, otu_index: %lu, otu_len: %f, count: %f\n",
           element.sample_index,
-          element.otu.c_str(),
           element.otu_index,
           element.otu_len,
           element.count);
 }
 
-// TODO does this copy the strings or just refs?
+/// Like stof/stoi, leading whitespace and a leading '+' are skipped, and
+/// trailing junk after the number is ignored.
+template <typename T>
+static T
+parse_number(string_view token, const char* what)
+{
+  T value;
+
+  const char* begin = token.data();
+  const char* end   = token.data() + token.size();
+
+  while (begin < end && isspace((unsigned char)*begin)) {
+    ++begin;
+  }
+
+  // from_chars takes '-' but not '+'; "+-1" still fails below.
+  if (begin < end && *begin == '+' && !(begin + 1 < end && begin[1] == '-')) {
+    ++begin;
+  }
+
+  auto result = from_chars(begin, end, value);
+
+  if (result.ec == errc::invalid_argument) {
+    throw invalid_argument(string("couldn't parse ") + what + " '" + string(token) + "'");
+  }
+  if (result.ec == errc::result_out_of_range) {
+    throw out_of_range(string(what) + " '" + string(token) + "' is out of range");
+  }
+
+  return value;
+}
+
 Element
-parse_data_line(const std::array<string, 4>& tokens, bool replace_zeros)
+parse_data_line(const std::array<string_view, 4>& tokens, bool replace_zeros)
 {
   Element element;
 
-  element.sample       = tokens[0];
-  element.otu          = tokens[1];
   element.sample_index = 0;
   element.otu_index    = 0;
-  element.otu_len      = stof(tokens[2]);
+  element.otu_len      = parse_number<float>(tokens[2], "otu length");
   element.count        = 0.0f;
 
-  int count = stoi(tokens[3]);
+  if (!(element.otu_len > 0) || !isfinite(element.otu_len)) {
+    throw invalid_argument("otu length '" + string(tokens[2]) + "' isn't a positive number");
+  }
+
+  int count = parse_number<int>(tokens[3], "count");
+
+  if (count < 0) {
+    throw invalid_argument("count '" + string(tokens[3]) + "' is negative");
+  }
 
   // Replace zero counts with a small non-zero number.
   if (replace_zeros && count == 0) {
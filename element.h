@@ -1,15 +1,15 @@
 #ifndef CODA_ELEMENT_H
 #define CODA_ELEMENT_H
 
-#include <string>
+#include <string_view>
 #include <array>
 
 #define zero_replacement 0.05f
 
+/// Names aren't kept here; `sample_index` and `otu_index` refer to the
+/// interned names (see NameTable).
 typedef struct Element
 {
-  std::string sample;
-  std::string otu;
   size_t sample_index;
   size_t otu_index;
   float  otu_len;
@@ -19,8 +19,14 @@ typedef struct Element
 void
 element_print(const Element& element);
 
+/// Fills in the numeric fields; the caller resolves the names in tokens[0]
+/// and tokens[1] to indices.
+///
+/// Throws std::invalid_argument or std::out_of_range if the numeric fields
+/// don't parse, like stof/stoi would, and std::invalid_argument for a
+/// negative count or an OTU length that isn't a positive, finite number.
 Element
-parse_data_line(const std::array<std::string, 4>& tokens, bool replace_zeros);
+parse_data_line(const std::array<std::string_view, 4>& tokens, bool replace_zeros);
 
 /// Counts/hits per 100 AAs/bases
 float
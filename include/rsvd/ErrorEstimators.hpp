@@ -2,6 +2,9 @@
 #define RSVD_ERROR_ESTIMATORS_HPP_
 
 #include <Eigen/Dense>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 
 namespace Rsvd {
 
@@ -31,6 +34,25 @@ relativeFrobeniusNormError(const MatrixType &reference, const MatrixType &approx
   return differenceNorm / referenceNorm;
 }
 
+/// \brief Compute the relative Frobenius error of a projection from norms alone.
+///
+/// \long If \f$ Q \f$ has orthonormal columns and \f$ B = Q^* A \f$, then
+/// \f[ \| A - Q B \|_{\mathrm{F}}^2 = \| A \|_{\mathrm{F}}^2 - \| B \|_{\mathrm{F}}^2, \f]
+/// so the error of the approximation \f$ Q B \f$ can be tracked as \f$ Q \f$ grows without ever
+/// forming it.
+///
+/// \param referenceSquaredNorm \f$ \| A \|_{\mathrm{F}}^2 \f$. It is assumed to be positive.
+/// \param projectionSquaredNorm \f$ \| B \|_{\mathrm{F}}^2 \f$.
+///
+/// \return Relative Frobenius error \f$ \| A - Q B \|_{\mathrm{F}} / \| A \|_{\mathrm{F}} \f$.
+inline double relativeProjectionError(const double referenceSquaredNorm,
+                                      const double projectionSquaredNorm) {
+  assert(referenceSquaredNorm > 0);
+
+  return std::sqrt(std::max(0.0, referenceSquaredNorm - projectionSquaredNorm) /
+                   referenceSquaredNorm);
+}
+
 } // namespace Rsvd
 
 #endif
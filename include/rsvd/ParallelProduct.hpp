@@ -0,0 +1,48 @@
+#ifndef RSVD_PARALLEL_PRODUCT_HPP_
+#define RSVD_PARALLEL_PRODUCT_HPP_
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cassert>
+
+namespace Rsvd {
+
+namespace Internal {
+
+/// Rows or columns of the result per parallel piece in #addProduct.
+constexpr Eigen::Index productPieceSize{256};
+
+/// \brief Compute \f$ D \mathrel{+}= L R \f$ in parallel, with a result that doesn't depend on
+/// the number of threads.
+///
+/// \long Eigen's own threaded products pick their blocking from the number of threads, so they
+/// round differently as it changes. Here \f$ D \f$ is split into pieces of #productPieceSize rows
+/// (or columns, if it is wider than tall) that depend only on its shape, and each piece is one
+/// single-threaded product over the full inner dimension. Meant to be called with Eigen itself
+/// limited to one thread (\c Eigen::setNbThreads(1)).
+template <typename DstType, typename LhsType, typename RhsType>
+void addProduct(DstType &&dst, const LhsType &lhs, const RhsType &rhs) {
+  assert(dst.rows() == lhs.rows() && dst.cols() == rhs.cols() && lhs.cols() == rhs.rows());
+
+  const bool byRows{dst.rows() >= dst.cols()};
+  const Eigen::Index size{byRows ? dst.rows() : dst.cols()};
+  const Eigen::Index numPieces{(size + productPieceSize - 1) / productPieceSize};
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (Eigen::Index p = 0; p < numPieces; ++p) {
+    const Eigen::Index first{p * productPieceSize};
+    const Eigen::Index count{std::min(productPieceSize, size - first)};
+
+    if (byRows) {
+      dst.middleRows(first, count).noalias() += lhs.middleRows(first, count) * rhs;
+    } else {
+      dst.middleCols(first, count).noalias() += lhs * rhs.middleCols(first, count);
+    }
+  }
+}
+
+} // namespace Internal
+
+} // namespace Rsvd
+
+#endif
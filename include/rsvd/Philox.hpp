@@ -0,0 +1,146 @@
+#ifndef RSVD_PHILOX_HPP_
+#define RSVD_PHILOX_HPP_
+
+#include <Eigen/Dense>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+
+namespace Rsvd {
+
+/// \brief Counter-based random engine (Philox4x32-10) for test matrices.
+///
+/// \long Philox (Salmon, Moraes, Dror and Shaw, "Parallel random numbers: as easy as 1, 2, 3",
+/// 2011) maps a 128-bit counter and a 64-bit key to 128 random bits with no state in between.
+/// Here the key is the seed and the counter is (row pair, column, stream), so element \f$ (i, j)
+/// \f$ of a test matrix is a pure function of the seed, the stream and \f$ (i, j) \f$. Any block
+/// of the matrix can be generated on its own, in parallel, or again later, and the result never
+/// depends on the number of threads or the order of the work.
+///
+/// The only state is the stream counter: each matrix drawn through #Internal::standardNormalRandom
+/// takes the next stream, so a fixed sequence of draws gives a fixed sequence of matrices, just
+/// like a sequential engine would.
+class PhiloxEngine {
+public:
+  explicit PhiloxEngine(const std::uint64_t seed = 0) : m_seed{seed}, m_nextStream{0} {}
+
+  /// \brief Restart from stream 0 with a new seed.
+  void seed(const std::uint64_t seed) {
+    m_seed = seed;
+    m_nextStream = 0;
+  }
+
+  /// \brief Reserve a stream for one matrix.
+  std::uint64_t nextStream() { return m_nextStream++; }
+
+  /// \brief Return the Philox4x32-10 output for a counter.
+  std::array<std::uint32_t, 4> bits(const std::array<std::uint32_t, 4> &counter) const {
+    std::array<std::uint32_t, 4> ctr{counter};
+    std::uint32_t key0{static_cast<std::uint32_t>(m_seed)};
+    std::uint32_t key1{static_cast<std::uint32_t>(m_seed >> 32)};
+
+    for (int round{0}; round < 10; ++round) {
+      const std::uint64_t product0{static_cast<std::uint64_t>(0xD2511F53u) * ctr[0]};
+      const std::uint64_t product1{static_cast<std::uint64_t>(0xCD9E8D57u) * ctr[2]};
+
+      ctr = {static_cast<std::uint32_t>(product1 >> 32) ^ ctr[1] ^ key0,
+             static_cast<std::uint32_t>(product1),
+             static_cast<std::uint32_t>(product0 >> 32) ^ ctr[3] ^ key1,
+             static_cast<std::uint32_t>(product0)};
+
+      key0 += 0x9E3779B9u;
+      key1 += 0xBB67AE85u;
+    }
+
+    return ctr;
+  }
+
+  /// \brief Return two independent standard normal numbers for a counter (Box--Muller).
+  std::array<double, 2> normalPair(const std::array<std::uint32_t, 4> &counter) const {
+    const std::array<std::uint32_t, 4> x{bits(counter)};
+
+    // 53-bit uniforms in (0, 1), so the log is finite.
+    const double u1{(static_cast<double>(((static_cast<std::uint64_t>(x[0]) << 32) | x[1]) >> 11) +
+                     0.5) *
+                    0x1.0p-53};
+    const double u2{(static_cast<double>(((static_cast<std::uint64_t>(x[2]) << 32) | x[3]) >> 11) +
+                     0.5) *
+                    0x1.0p-53};
+
+    const double radius{std::sqrt(-2.0 * std::log(u1))};
+    const double angle{6.283185307179586 * u2};
+
+    return {radius * std::cos(angle), radius * std::sin(angle)};
+  }
+
+  /// \brief Generate rows \f$ [firstRow, firstRow + numRows) \f$ and columns \f$ [firstCol,
+  /// firstCol + numCols) \f$ of the standard normal matrix for \p stream.
+  ///
+  /// \long Rows \f$ 2p \f$ and \f$ 2p + 1 \f$ of a column share one Philox call, one normal
+  /// each. Complex elements take both normals of their own call, scaled to variance 1/2 each.
+  template <typename MatrixType>
+  MatrixType normalBlock(const std::uint64_t stream, const Eigen::Index firstRow,
+                         const Eigen::Index firstCol, const Eigen::Index numRows,
+                         const Eigen::Index numCols) const {
+    MatrixType result(numRows, numCols);
+    fill(result, stream, firstRow, firstCol, typename MatrixType::Scalar{});
+
+    return result;
+  }
+
+private:
+  static std::array<std::uint32_t, 4> counter(const std::uint64_t row, const std::uint64_t col,
+                                              const std::uint64_t stream) {
+    return {static_cast<std::uint32_t>(row), static_cast<std::uint32_t>(row >> 32),
+            static_cast<std::uint32_t>(col), static_cast<std::uint32_t>(stream)};
+  }
+
+  template <typename MatrixType, typename RealType>
+  void fill(MatrixType &result, const std::uint64_t stream, const Eigen::Index firstRow,
+            const Eigen::Index firstCol, RealType) const {
+    const Eigen::Index firstPair{firstRow / 2};
+    const Eigen::Index lastPair{(firstRow + result.rows() + 1) / 2};
+    const Eigen::Index numPairs{lastPair - firstPair};
+    const Eigen::Index numCols{result.cols()};
+
+#pragma omp parallel for collapse(2) schedule(static)
+    for (Eigen::Index j = 0; j < numCols; ++j) {
+      for (Eigen::Index p = 0; p < numPairs; ++p) {
+        const std::array<double, 2> z{normalPair(counter(firstPair + p, firstCol + j, stream))};
+
+        for (Eigen::Index k{0}; k < 2; ++k) {
+          const Eigen::Index i{2 * (firstPair + p) + k - firstRow};
+          if (i >= 0 && i < result.rows()) {
+            result(i, j) = static_cast<RealType>(z[k]);
+          }
+        }
+      }
+    }
+  }
+
+  template <typename MatrixType, typename RealType>
+  void fill(MatrixType &result, const std::uint64_t stream, const Eigen::Index firstRow,
+            const Eigen::Index firstCol, std::complex<RealType>) const {
+    constexpr double stdDev{0.707106781186547};
+    const Eigen::Index numRows{result.rows()};
+    const Eigen::Index numCols{result.cols()};
+
+#pragma omp parallel for collapse(2) schedule(static)
+    for (Eigen::Index j = 0; j < numCols; ++j) {
+      for (Eigen::Index i = 0; i < numRows; ++i) {
+        const std::array<double, 2> z{normalPair(counter(firstRow + i, firstCol + j, stream))};
+
+        result(i, j) = std::complex<RealType>(static_cast<RealType>(stdDev * z[0]),
+                                              static_cast<RealType>(stdDev * z[1]));
+      }
+    }
+  }
+
+  std::uint64_t m_seed;
+  std::uint64_t m_nextStream;
+};
+
+} // namespace Rsvd
+
+#endif
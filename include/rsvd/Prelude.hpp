@@ -3,6 +3,7 @@
 
 #include <rsvd/Constants.hpp>
 #include <rsvd/ErrorEstimators.hpp>
+#include <rsvd/Philox.hpp>
 #include <rsvd/RandomizedSvd.hpp>
 
 #endif
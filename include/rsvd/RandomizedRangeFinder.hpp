@@ -2,8 +2,10 @@
 #define RSVD_RANDOMIZED_RANGE_FINDER_HPP_
 
 #include <Eigen/Dense>
+#include <algorithm>
 #include <rsvd/Constants.hpp>
 #include <rsvd/GramSchmidt.hpp>
+#include <rsvd/ParallelProduct.hpp>
 #include <rsvd/StandardNormalRandom.hpp>
 
 namespace Rsvd {
@@ -18,6 +20,8 @@ namespace Internal {
 /// \tparam MatrixType Eigen matrix type.
 /// \tparam RandomEngineType Type of the random engine, e.g. \c std::default_random_engine or \c
 /// std::mt19937_64.
+/// \tparam InputType Type of \f$ A \f$. Anything whose products with \c MatrixType evaluate to
+/// \c MatrixType works, e.g. \c MatrixType itself or an \c Eigen::Map of it.
 ///
 /// \param a Matrix \f$A \in \mathbb{F}^{m \times n}\f$ whose range should be approximated.
 /// \param dim Dimension \f$r\f$ (number of columns) of the range approximation.
@@ -25,8 +29,8 @@ namespace Internal {
 ///
 /// \return Matrix \f$ Q \in \mathbb{F}^{m \times r} \f$ whose columns build an orthonormal basis
 /// of the approximate range of \f$ A \f$.
-template <typename MatrixType, typename RandomEngineType>
-MatrixType singleShot(const MatrixType &a, const Eigen::Index dim, RandomEngineType &engine) {
+template <typename MatrixType, typename RandomEngineType, typename InputType>
+MatrixType singleShot(const InputType &a, const Eigen::Index dim, RandomEngineType &engine) {
 
   const auto numRows{a.rows()};
   const auto numCols{a.cols()};
@@ -39,6 +43,24 @@ MatrixType singleShot(const MatrixType &a, const Eigen::Index dim, RandomEngineT
   return result;
 }
 
+/// \brief Replace the columns of \f$ Y \f$ by an orthonormal basis of their span.
+template <typename MatrixType> void orthonormalize(MatrixType &y) {
+  Eigen::ColPivHouseholderQR<Eigen::Ref<MatrixType>> qr(y);
+  y.noalias() = qr.householderQ() * MatrixType::Identity(y.rows(), y.cols());
+}
+
+/// \brief Orthonormalize the columns of \f$ Y \f$ against an orthonormal \f$ Q \f$ and
+/// against each other.
+///
+/// \long Projects out \f$ Q \f$ twice ("twice is enough"), since one pass loses orthogonality
+/// when \f$ Y \f$ is nearly in the span of \f$ Q \f$.
+template <typename MatrixType> void orthonormalizeAgainst(const MatrixType &q, MatrixType &y) {
+  for (int pass{0}; pass < 2; ++pass) {
+    y -= q * (q.adjoint() * y);
+    orthonormalize(y);
+  }
+}
+
 /// \brief Helper struct for randomized subspace iterations.
 ///
 /// \tparam MatrixType Eigen matrix type.
@@ -59,7 +81,10 @@ struct RandomizedSubspaceIterations {
   ///
   /// \return Matrix \f$ Q \in \mathbb{F}^{m \times r} \f$ whose columns are an orthonormal basis
   /// of the approximate range of \f$ A \f$.
-  static MatrixType compute(const MatrixType &a, Eigen::Index dim, unsigned int numIter,
+  ///
+  /// \tparam InputType Type of \f$ A \f$, see #singleShot.
+  template <typename InputType>
+  static MatrixType compute(const InputType &a, Eigen::Index dim, unsigned int numIter,
                             RandomEngineType &engine);
 };
 
@@ -67,7 +92,8 @@ struct RandomizedSubspaceIterations {
 template <typename MatrixType, typename RandomEngineType>
 struct RandomizedSubspaceIterations<MatrixType, RandomEngineType,
                                     SubspaceIterationConditioner::None> {
-  static MatrixType compute(const MatrixType &a, const Eigen::Index dim,
+  template <typename InputType>
+  static MatrixType compute(const InputType &a, const Eigen::Index dim,
                             const unsigned int numIter, RandomEngineType &engine) {
     assert(numIter > 0);
 
@@ -101,7 +127,8 @@ struct RandomizedSubspaceIterations<MatrixType, RandomEngineType,
 template <typename MatrixType, typename RandomEngineType>
 struct RandomizedSubspaceIterations<MatrixType, RandomEngineType,
                                     SubspaceIterationConditioner::Lu> {
-  static MatrixType compute(const MatrixType &a, const Eigen::Index dim,
+  template <typename InputType>
+  static MatrixType compute(const InputType &a, const Eigen::Index dim,
                             const unsigned int numIter, RandomEngineType &engine) {
     assert(numIter > 0);
 
@@ -117,7 +144,8 @@ struct RandomizedSubspaceIterations<MatrixType, RandomEngineType,
       tmpRows.diagonal().setOnes();
       tmpRows.template triangularView<Eigen::StrictlyUpper>().setZero();
 
-      tmpCols.noalias() = a.adjoint() * luRows.permutationP().inverse() * tmpRows;
+      // Permute the thin factor rather than \f$A^*\f$, which would copy all of \f$A\f$.
+      tmpCols.noalias() = a.adjoint() * (luRows.permutationP().inverse() * tmpRows);
       Eigen::FullPivLU<Eigen::Ref<MatrixType>> luCols(tmpCols);
       tmpCols.diagonal().setOnes();
       tmpCols.template triangularView<Eigen::StrictlyUpper>().setZero();
@@ -139,7 +167,8 @@ struct RandomizedSubspaceIterations<MatrixType, RandomEngineType,
 template <typename MatrixType, typename RandomEngineType>
 struct RandomizedSubspaceIterations<MatrixType, RandomEngineType,
                                     SubspaceIterationConditioner::Mgs> {
-  static MatrixType compute(const MatrixType &a, const Eigen::Index dim,
+  template <typename InputType>
+  static MatrixType compute(const InputType &a, const Eigen::Index dim,
                             const unsigned int numIter, RandomEngineType &engine) {
     assert(numIter > 0);
 
@@ -170,7 +199,8 @@ struct RandomizedSubspaceIterations<MatrixType, RandomEngineType,
 template <typename MatrixType, typename RandomEngineType>
 struct RandomizedSubspaceIterations<MatrixType, RandomEngineType,
                                     SubspaceIterationConditioner::Qr> {
-  static MatrixType compute(const MatrixType &a, const Eigen::Index dim,
+  template <typename InputType>
+  static MatrixType compute(const InputType &a, const Eigen::Index dim,
                             const unsigned int numIter, RandomEngineType &engine) {
     assert(numIter > 0);
 
@@ -199,6 +229,112 @@ struct RandomizedSubspaceIterations<MatrixType, RandomEngineType,
 
 } // namespace Internal
 
+/// \brief Two-sided randomized sketch of a matrix that streams in, for single-pass range
+/// approximation.
+///
+/// \long This implements the sketch of Tropp, Yurtsever, Udell and Cevher, "Practical sketching
+/// algorithms for low-rank matrix approximation" (2017). With random test matrices \f$ \Omega
+/// \in \mathbb{F}^{n \times k} \f$ and \f$ \Psi \in \mathbb{F}^{l \times m} \f$, it keeps
+/// \f[ Y = A \Omega, \qquad W = \Psi A. \f]
+/// Both are linear in \f$ A \f$, so they can be built up as columns or rows of \f$ A \f$
+/// arrive, in any order, and \f$ A \f$ itself never has to be stored or read twice.
+/// Afterwards, \f$ Q = \mathrm{orth}(Y) \f$ approximates the range of \f$ A \f$ (like
+/// #Internal::singleShot, but from one pass), and \f$ X = (\Psi Q)^{+} W \f$ gives \f$ A
+/// \approx Q X \f$.
+///
+/// Tropp et al. suggest \f$ k = 2r + 1 \f$ and \f$ l = 2k + 1 \f$ for a rank \f$ r \f$
+/// approximation. The sketch takes \f$ (m + n)(k + l) \f$ scalars including the test matrices,
+/// or \f$ m k + n (k + l) \f$ with #Rsvd::PhiloxEngine, which regenerates \f$ \Psi \f$ as it
+/// goes.
+///
+/// \tparam MatrixType Eigen matrix type.
+/// \tparam RandomEngineType Type of the random engine, e.g. \c std::mt19937_64.
+template <typename MatrixType, typename RandomEngineType> class TwoSidedSketch {
+public:
+  /// \brief Draw the test matrices for an \p numRows by \p numCols matrix.
+  ///
+  /// \param rangeDim Range sketch size \f$ k \f$.
+  /// \param coRangeDim Co-range sketch size \f$ l \ge k \f$.
+  /// \param engine Random engine to use for sampling from standard normal distribution.
+  TwoSidedSketch(const Eigen::Index numRows, const Eigen::Index numCols,
+                 const Eigen::Index rangeDim, const Eigen::Index coRangeDim,
+                 RandomEngineType &engine)
+      : m_omega{Internal::standardNormalRandom<MatrixType, RandomEngineType>(numCols, rangeDim,
+                                                                             engine)},
+        m_psi{coRangeDim, numRows, engine},
+        m_y{MatrixType::Zero(numRows, rangeDim)}, m_w{MatrixType::Zero(coRangeDim, numCols)} {
+    assert(coRangeDim >= rangeDim);
+  }
+
+  Eigen::Index rows() const { return m_y.rows(); }
+  Eigen::Index cols() const { return m_w.cols(); }
+
+  /// \brief Add columns \f$ [first, first + c) \f$ of \f$ A \f$.
+  ///
+  /// \note Each call reads all of \f$ \Psi \f$, which with #Rsvd::PhiloxEngine means
+  /// regenerating it, so add columns in big blocks.
+  template <typename BlockType> void addColumns(const Eigen::Index first, const BlockType &block) {
+    Internal::addProduct(m_y, block, m_omega.middleRows(first, block.cols()));
+    m_w.middleCols(first, block.cols()) += psiTimes(0, block);
+  }
+
+  /// \brief Add rows \f$ [first, first + c) \f$ of \f$ A \f$.
+  template <typename BlockType> void addRows(const Eigen::Index first, const BlockType &block) {
+    Internal::addProduct(m_y.middleRows(first, block.rows()), block, m_omega);
+    m_w += psiTimes(first, block);
+  }
+
+  /// \brief Return \f$ Q \f$, an orthonormal basis of the approximate range of \f$ A \f$.
+  MatrixType rangeBasis() const {
+    MatrixType q{m_y};
+    Internal::orthonormalize(q);
+
+    return q;
+  }
+
+  /// \brief Return \f$ X = (\Psi Q)^{+} W \f$, so that \f$ A \approx Q X \f$.
+  MatrixType coefficients(const MatrixType &q) const {
+    const MatrixType psiQ{psiTimes(0, q)};
+
+    return psiQ.colPivHouseholderQr().solve(m_w);
+  }
+
+  /// \brief Return an estimate of \f$ \| A - Q Q^* A \|_F^2 \f$, the energy the range basis
+  /// misses, from the co-range residual \f$ W - \Psi Q X \f$.
+  ///
+  /// \long \f$ \Psi \f$ is Gaussian, so \f$ \| \Psi M \|_F^2 \approx l \| M \|_F^2 \f$, and the least
+  /// squares fit of \f$ X \f$ takes up \f$ k \f$ of the \f$ l \f$ dimensions of the residual.
+  double tailSquaredNorm(const MatrixType &q, const MatrixType &x) const {
+    const MatrixType residual{m_w - psiTimes(0, q) * x};
+
+    return residual.template cast<double>().squaredNorm() / (double)(m_w.rows() - q.cols());
+  }
+
+private:
+  /// Columns of \f$ \Psi \f$ read at a time.
+  static constexpr Eigen::Index psiBlockCols{16384};
+
+  /// \brief Return \f$ \Psi_{:, [first, first + r)} X \f$ for \f$ X \f$ with \f$ r \f$ rows.
+  template <typename BlockType>
+  MatrixType psiTimes(const Eigen::Index first, const BlockType &x) const {
+    MatrixType result{MatrixType::Zero(m_w.rows(), x.cols())};
+
+    for (Eigen::Index offset{0}; offset < x.rows(); offset += psiBlockCols) {
+      const Eigen::Index count{std::min(psiBlockCols, x.rows() - offset)};
+
+      const MatrixType psi{m_psi.block(0, first + offset, m_w.rows(), count)};
+      Internal::addProduct(result, psi, x.middleRows(offset, count));
+    }
+
+    return result;
+  }
+
+  MatrixType m_omega;
+  Internal::TestMatrix<MatrixType, RandomEngineType> m_psi;
+  MatrixType m_y;
+  MatrixType m_w;
+};
+
 } // namespace Rsvd
 
 #endif
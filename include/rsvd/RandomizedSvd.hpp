@@ -34,7 +34,9 @@
 #include <Eigen/Dense>
 #include <algorithm>
 #include <rsvd/Constants.hpp>
+#include <rsvd/ErrorEstimators.hpp>
 #include <rsvd/RandomizedRangeFinder.hpp>
+#include <rsvd/RowBlocks.hpp>
 
 namespace Rsvd {
 
@@ -104,13 +106,17 @@ public:
 
   /// \brief Compute the randomized singular value decomposition.
   ///
+  /// \tparam InputType Type of \f$A\f$. Besides \c MatrixType itself, any expression that
+  /// multiplies like it works without a copy, e.g. an \c Eigen::Map over memory-mapped data.
+  ///
   /// \param a Matrix \f$A\f$ to be decomposed, \f$A = U \Sigma V^*\f$.
   /// \param rank Rank of the decomposition.
   /// \param oversamples Number of additionally sampled range directions. Increase it to improve
   /// the approximation. Default value: 5.
   /// \param numIter Number of randomized subspace iterations. Increase it to improve
   /// the approximation. Default value: 2.
-  void compute(const MatrixType &a, const Eigen::Index rank, const Eigen::Index oversamples = 5,
+  template <typename InputType>
+  void compute(const InputType &a, const Eigen::Index rank, const Eigen::Index oversamples = 5,
                const unsigned int numIter = 2U) {
     /// \todo Handle matrices with m < n correctly.
 
@@ -122,22 +128,171 @@ public:
             ? Internal::singleShot<MatrixType, RandomEngineType>(a, rangeApproximationDim,
                                                                  m_randomEngine)
             : Internal::RandomizedSubspaceIterations<
-                  MatrixType, RandomEngineType, Conditioner>::compute(a, rangeApproximationDim,
-                                                                      numIter, m_randomEngine)};
+                  MatrixType, RandomEngineType,
+                  Conditioner>::template compute<InputType>(a, rangeApproximationDim, numIter,
+                                                            m_randomEngine)};
+
+    const MatrixType b{q.adjoint() * a};
+    Eigen::JacobiSVD<MatrixType> svd(b, Eigen::ComputeThinU | Eigen::ComputeThinV);
+
+    m_leftSingularVectors.noalias() = q * svd.matrixU().leftCols(rank);
+    m_singularValues = svd.singularValues().head(rank);
+    m_rightSingularVectors = svd.matrixV().leftCols(rank);
+  }
+
+  /// \brief Compute the randomized singular value decomposition to a given accuracy.
+  ///
+  /// \long The range approximation \f$ Q \f$ is grown in blocks of \p blockSize columns (the
+  /// blocked QB algorithm) until \f$ \| A - Q Q^* A \|_{\mathrm{F}} \le \varepsilon \| A
+  /// \|_{\mathrm{F}} \f$ or \f$ Q \f$ has \p maxRank columns. The error is tracked with
+  /// #relativeProjectionError, so checking it costs nothing beyond the products that build
+  /// \f$ B = Q^* A \f$.
+  ///
+  /// Each block is sampled from the part of \f$ A \f$ that \f$ Q \f$ doesn't capture yet,
+  /// and refined by \p numIter subspace iterations. Those are always conditioned with the QR
+  /// decomposition, whatever \p Conditioner is, since each block has to stay orthogonal to the
+  /// ones before it.
+  ///
+  /// All computed components are kept, so the rank of the result is a multiple of
+  /// \p blockSize (or \p maxRank). Callers that want fewer take the leading ones.
+  ///
+  /// \tparam InputType Type of \f$A\f$, see #compute.
+  ///
+  /// \param a Matrix \f$A\f$ to be decomposed, \f$A = U \Sigma V^*\f$.
+  /// \param squaredNorm \f$ \| A \|_{\mathrm{F}}^2 \f$.
+  /// \param tolerance Relative Frobenius error \f$ \varepsilon \f$ to stop at.
+  /// \param blockSize Number of range directions added per step.
+  /// \param maxRank Largest rank to grow to.
+  /// \param numIter Number of randomized subspace iterations per block. Default value: 2.
+  template <typename InputType>
+  void computeToTolerance(const InputType &a, const double squaredNorm, const double tolerance,
+                          const Eigen::Index blockSize, const Eigen::Index maxRank,
+                          const unsigned int numIter = 2U) {
+    assert(blockSize > 0);
+
+    const auto numRows{a.rows()};
+    const auto numCols{a.cols()};
+    const Eigen::Index maxDim{std::min({numRows, numCols, maxRank})};
+
+    MatrixType q(numRows, 0);
+    MatrixType b(0, numCols);
+    double projectionSquaredNorm{0.0};
+
+    while (q.cols() < maxDim && squaredNorm > 0 &&
+           relativeProjectionError(squaredNorm, projectionSquaredNorm) > tolerance) {
+      const Eigen::Index dim{std::min(blockSize, maxDim - q.cols())};
+
+      MatrixType block{a * Internal::standardNormalRandom<MatrixType, RandomEngineType>(
+                               numCols, dim, m_randomEngine)};
+      Internal::orthonormalizeAgainst(q, block);
+
+      for (unsigned int j{0U}; j < numIter; ++j) {
+        MatrixType tmpCols{a.adjoint() * block};
+        Internal::orthonormalize(tmpCols);
+
+        block.noalias() = a * tmpCols;
+        Internal::orthonormalizeAgainst(q, block);
+      }
+
+      const MatrixType blockB{block.adjoint() * a};
+      projectionSquaredNorm += blockB.template cast<double>().squaredNorm();
+
+      q.conservativeResize(Eigen::NoChange, q.cols() + dim);
+      q.rightCols(dim) = block;
+      b.conservativeResize(b.rows() + dim, Eigen::NoChange);
+      b.bottomRows(dim) = blockB;
+    }
 
-    const auto b{q.adjoint() * a};
     Eigen::JacobiSVD<MatrixType> svd(b, Eigen::ComputeThinU | Eigen::ComputeThinV);
 
+    m_leftSingularVectors.noalias() = q * svd.matrixU();
+    m_singularValues = svd.singularValues();
+    m_rightSingularVectors = svd.matrixV();
+  }
+
+  /// \brief Compute the randomized singular value decomposition of a matrix that is only
+  /// available a block of rows at a time (e.g. bigger than memory).
+  ///
+  /// \long The range finder only needs \f$ A X \f$ and \f$ A^* Y \f$, and both work one row
+  /// block at a time: \f$ (A X)_k = A_k X \f$ and \f$ A^* Y = \sum_k A_k^* Y_k \f$. Each of
+  /// those is one pass over the blocks, in order, so \p numIter iterations take \f$ 2
+  /// \cdot \mathit{numIter} + 2 \f$ passes. The tall range approximation \f$ Q \f$ (rows of
+  /// \f$ A \f$ times rank plus oversamples) is held in memory and orthonormalized with
+  /// Internal::tallSkinnyQr over the same blocks. Subspace iterations are always conditioned
+  /// that way, whatever \p Conditioner is.
+  ///
+  /// \tparam ProviderType Anything with
+  ///   - \c rows() and \c cols(): the size of \f$ A \f$,
+  ///   - \c blockRows(): rows per block (the last block may be shorter),
+  ///   - \c rowBlock(first, count): rows \f$ [first, first + count) \f$ of \f$ A \f$ as a
+  ///     \c MatrixType. It is called with \c first a multiple of \c blockRows().
+  ///
+  /// \param a Row block provider for \f$A\f$.
+  /// \param rank Rank of the decomposition.
+  /// \param oversamples Number of additionally sampled range directions. Default value: 5.
+  /// \param numIter Number of randomized subspace iterations. Default value: 2.
+  template <typename ProviderType>
+  void computeFromRowBlocks(const ProviderType &a, const Eigen::Index rank,
+                            const Eigen::Index oversamples = 5,
+                            const unsigned int numIter = 2U) {
+    const auto numCols{a.cols()};
+    const Eigen::Index matrixShortSize{std::min(a.rows(), numCols)};
+    const Eigen::Index rangeApproximationDim{std::min(matrixShortSize, rank + oversamples)};
+
+    MatrixType tmpCols{Internal::standardNormalRandom<MatrixType, RandomEngineType>(
+        numCols, rangeApproximationDim, m_randomEngine)};
+    MatrixType tmpRows{Internal::rowBlocksTimes(a, tmpCols)};
+
+    for (unsigned int j{0U}; j < numIter; ++j) {
+      Internal::tallSkinnyQr(tmpRows, a.blockRows());
+
+      tmpCols = Internal::rowBlocksAdjointTimes(a, tmpRows);
+      Internal::orthonormalize(tmpCols);
+
+      tmpRows = Internal::rowBlocksTimes(a, tmpCols);
+    }
+
+    Internal::tallSkinnyQr(tmpRows, a.blockRows());
+
+    const MatrixType b{Internal::rowBlocksAdjointTimes(a, tmpRows).adjoint()};
+    Eigen::JacobiSVD<MatrixType> svd(b, Eigen::ComputeThinU | Eigen::ComputeThinV);
+
+    m_leftSingularVectors.noalias() = tmpRows * svd.matrixU().leftCols(rank);
+    m_singularValues = svd.singularValues().head(rank);
+    m_rightSingularVectors = svd.matrixV().leftCols(rank);
+  }
+
+  /// \brief Compute the randomized singular value decomposition from a finished two-sided
+  /// sketch, without touching \f$ A \f$ again.
+  ///
+  /// \long With \f$ A \approx Q X \f$ from the sketch and the SVD \f$ X = \tilde{U} \Sigma
+  /// V^* \f$, \f$ U = Q \tilde{U} \f$. The sketch's own random draws are used, not this
+  /// object's engine.
+  ///
+  /// \param sketch Sketch of \f$ A \f$ with every row (or column) added.
+  /// \param rank Rank of the decomposition, at most the sketch's range dimension.
+  void computeFromSketch(const TwoSidedSketch<MatrixType, RandomEngineType> &sketch,
+                         const Eigen::Index rank) {
+    const MatrixType q{sketch.rangeBasis()};
+    const MatrixType x{sketch.coefficients(q)};
+    Eigen::JacobiSVD<MatrixType> svd(x, Eigen::ComputeThinU | Eigen::ComputeThinV);
+
     m_leftSingularVectors.noalias() = q * svd.matrixU().leftCols(rank);
     m_singularValues = svd.singularValues().head(rank);
     m_rightSingularVectors = svd.matrixV().leftCols(rank);
+    m_sketchTailSquaredNorm = sketch.tailSquaredNorm(q, x);
   }
 
+  /// \brief After computeFromSketch(), the estimate of \f$ \| A - Q Q^* A \|_F^2 \f$ from
+  /// TwoSidedSketch::tailSquaredNorm().
+  double sketchTailSquaredNorm() const { return m_sketchTailSquaredNorm; }
+
 private:
   RandomEngineType &m_randomEngine;
   MatrixType m_leftSingularVectors{};
   MatrixType m_singularValues{};
   MatrixType m_rightSingularVectors{};
+  double m_sketchTailSquaredNorm{0.0};
 };
 
 } // namespace Rsvd
@@ -0,0 +1,108 @@
+#ifndef RSVD_ROW_BLOCKS_HPP_
+#define RSVD_ROW_BLOCKS_HPP_
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cassert>
+#include <rsvd/ParallelProduct.hpp>
+
+namespace Rsvd {
+
+namespace Internal {
+
+/// \brief Compute \f$ A X \f$ one row block of \f$ A \f$ at a time.
+///
+/// \tparam ProviderType Row block provider, see RandomizedSvd::computeFromRowBlocks.
+template <typename MatrixType, typename ProviderType>
+MatrixType rowBlocksTimes(const ProviderType &a, const MatrixType &x) {
+  MatrixType result{MatrixType::Zero(a.rows(), x.cols())};
+
+  for (Eigen::Index first{0}; first < a.rows(); first += a.blockRows()) {
+    const Eigen::Index count{std::min(a.blockRows(), a.rows() - first)};
+    const MatrixType block{a.rowBlock(first, count)};
+
+    addProduct(result.middleRows(first, count), block, x);
+  }
+
+  return result;
+}
+
+/// \brief Compute \f$ A^* Y \f$ one row block of \f$ A \f$ at a time.
+///
+/// \long \f$ A^* Y = \sum_k A_k^* Y_k \f$, where \f$ A_k \f$ and \f$ Y_k \f$ are matching row
+/// blocks, so only the (small) result is accumulated.
+template <typename MatrixType, typename ProviderType>
+MatrixType rowBlocksAdjointTimes(const ProviderType &a, const MatrixType &y) {
+  MatrixType result{MatrixType::Zero(a.cols(), y.cols())};
+
+  for (Eigen::Index first{0}; first < a.rows(); first += a.blockRows()) {
+    const Eigen::Index count{std::min(a.blockRows(), a.rows() - first)};
+    const MatrixType block{a.rowBlock(first, count)};
+
+    addProduct(result, block.adjoint(), y.middleRows(first, count));
+  }
+
+  return result;
+}
+
+/// \brief Orthonormalize the columns of a tall, skinny matrix with the TSQR algorithm.
+///
+/// \long Each block of \p blockRows rows is factored on its own, \f$ Y_k = Q_k R_k \f$. The
+/// stacked \f$ R_k \f$ are small, and their QR factorization \f$ [R_1; R_2; \ldots] = \tilde{Q}
+/// R \f$ gives \f$ Y = Q R \f$ with \f$ Q_k = Q_k \tilde{Q}_k \f$. Only one block is factored
+/// at a time, so the workspace is a block plus the stacked factors, and the result is as
+/// stable as a Householder QR of the whole matrix.
+///
+/// \param y Matrix with at least as many rows as columns. Replaced by \f$ Q \f$.
+/// \param blockRows Rows per block.
+template <typename MatrixType> void tallSkinnyQr(MatrixType &y, const Eigen::Index blockRows) {
+  assert(y.rows() >= y.cols());
+  assert(blockRows > 0);
+
+  const auto numRows{y.rows()};
+  const auto numCols{y.cols()};
+
+  Eigen::Index numStacked{0};
+  for (Eigen::Index first{0}; first < numRows; first += blockRows) {
+    numStacked += std::min({blockRows, numRows - first, numCols});
+  }
+
+  // Factor each block, keeping its thin Q in place and stacking its R.
+  MatrixType stacked(numStacked, numCols);
+  Eigen::Index offset{0};
+
+  for (Eigen::Index first{0}; first < numRows; first += blockRows) {
+    const Eigen::Index count{std::min(blockRows, numRows - first)};
+    const Eigen::Index height{std::min(count, numCols)};
+
+    Eigen::HouseholderQR<MatrixType> qr(y.middleRows(first, count));
+
+    stacked.middleRows(offset, height) =
+        qr.matrixQR().topRows(height).template triangularView<Eigen::Upper>();
+    y.middleRows(first, count).leftCols(height) =
+        qr.householderQ() * MatrixType::Identity(count, height);
+
+    offset += height;
+  }
+
+  Eigen::HouseholderQR<MatrixType> qr(stacked);
+  const MatrixType stackedQ{qr.householderQ() * MatrixType::Identity(numStacked, numCols)};
+
+  // Q_k = Q_k * (rows of stackedQ that belong to block k)
+  offset = 0;
+  for (Eigen::Index first{0}; first < numRows; first += blockRows) {
+    const Eigen::Index count{std::min(blockRows, numRows - first)};
+    const Eigen::Index height{std::min(count, numCols)};
+
+    const MatrixType blockQ{y.middleRows(first, count).leftCols(height)};
+    y.middleRows(first, count).noalias() = blockQ * stackedQ.middleRows(offset, height);
+
+    offset += height;
+  }
+}
+
+} // namespace Internal
+
+} // namespace Rsvd
+
+#endif
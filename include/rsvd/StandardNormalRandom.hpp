@@ -5,6 +5,8 @@
 #include <cmath>
 #include <complex>
 #include <random>
+#include <rsvd/Philox.hpp>
+#include <type_traits>
 
 namespace Rsvd {
 
@@ -81,13 +83,58 @@ struct StandardNormalRandomHelper<MatrixType, std::complex<RealType<MatrixType>>
 ///
 /// \return Matrix \f$ \Omega \in \mathbb{F}^{m \times n} \f$ with \f$\mathbb{F} \in \{ \mathbb{R},
 /// \mathbb{C} \} \f$ with normally distributed elements.
+///
+/// With #Rsvd::PhiloxEngine, the matrix takes the engine's next stream and is generated in
+/// parallel; it is the same for any number of threads.
 template <typename MatrixType, typename RandomEngineType>
 inline MatrixType standardNormalRandom(const Eigen::Index numRows, const Eigen::Index numCols,
                                        RandomEngineType &engine) {
-  return StandardNormalRandomHelper<MatrixType, typename MatrixType::Scalar,
-                                    RandomEngineType>::generate(numRows, numCols, engine);
+  if constexpr (std::is_same_v<RandomEngineType, PhiloxEngine>) {
+    const auto stream{engine.nextStream()};
+    return engine.template normalBlock<MatrixType>(stream, 0, 0, numRows, numCols);
+  } else {
+    return StandardNormalRandomHelper<MatrixType, typename MatrixType::Scalar,
+                                      RandomEngineType>::generate(numRows, numCols, engine);
+  }
 }
 
+/// \brief Standard normal test matrix that is read a block at a time.
+///
+/// \long With a sequential engine, the matrix is drawn up front and stored. With
+/// #Rsvd::PhiloxEngine, only its stream is kept and blocks are regenerated when asked for, so a
+/// big test matrix takes no memory. Either way, the elements are those #standardNormalRandom
+/// would give for the same engine state.
+template <typename MatrixType, typename RandomEngineType> class TestMatrix {
+public:
+  TestMatrix(const Eigen::Index numRows, const Eigen::Index numCols, RandomEngineType &engine)
+      : m_matrix{standardNormalRandom<MatrixType, RandomEngineType>(numRows, numCols, engine)} {}
+
+  MatrixType block(const Eigen::Index firstRow, const Eigen::Index firstCol,
+                   const Eigen::Index numRows, const Eigen::Index numCols) const {
+    return m_matrix.block(firstRow, firstCol, numRows, numCols);
+  }
+
+private:
+  MatrixType m_matrix;
+};
+
+/// \brief Partial specialization that regenerates blocks instead of storing the matrix.
+template <typename MatrixType> class TestMatrix<MatrixType, PhiloxEngine> {
+public:
+  TestMatrix(const Eigen::Index, const Eigen::Index, PhiloxEngine &engine)
+      : m_engine{engine}, m_stream{engine.nextStream()} {}
+
+  MatrixType block(const Eigen::Index firstRow, const Eigen::Index firstCol,
+                   const Eigen::Index numRows, const Eigen::Index numCols) const {
+    return m_engine.template normalBlock<MatrixType>(m_stream, firstRow, firstCol, numRows,
+                                                     numCols);
+  }
+
+private:
+  PhiloxEngine m_engine;
+  std::uint64_t m_stream;
+};
+
 } // namespace Internal
 
 } // namespace Rsvd
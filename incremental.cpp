@@ -0,0 +1,342 @@
+#include "incremental.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "binary_table.h"
+#include "dense_clr.h"
+#include "mat.h"
+#include "mapped_file.h"
+#include "tsv_writer.h"
+
+#define state_alignment 64
+
+/// Components whose variance is below this fraction of the first one's get
+/// a zero axis, rather than one blown up from rounding noise.
+#define axis_min_variance_ratio 1e-10
+
+using namespace std;
+
+static size_t
+align_up(size_t n, size_t alignment)
+{
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+static void
+copy_names(const NameTable& from, NameTable& to)
+{
+  for (size_t i = 0; i < from.size(); ++i) {
+    to.intern(from.name(i));
+  }
+}
+
+/// Takes `projection` (V * Sigma) as the state's PCA, and recovers the axes
+/// from it: U = C V Sigma^-1 = C P Sigma^-2, where Sigma^2 holds the squared
+/// norms of P's columns.
+static void
+set_pca(CodaState& state, const Eigen::MatrixXf& projection)
+{
+  const Eigen::VectorXd sq_sigma = projection.cast<double>().colwise().squaredNorm().transpose();
+  const double          min_sq   = sq_sigma.size() > 0 ? sq_sigma.maxCoeff() * axis_min_variance_ratio : 0;
+
+  // In parallel over fixed pieces, see DenseClr.
+  Eigen::MatrixXf axes = DenseClr<SinglePrecision>(state.clr) * projection;
+
+  for (Eigen::Index j = 0; j < axes.cols(); ++j) {
+    axes.col(j) *= sq_sigma(j) > min_sq ? (float)(1 / sq_sigma(j)) : 0.0f;
+  }
+
+  state.projection        = projection;
+  state.axes              = std::move(axes);
+  state.singular_values   = sq_sigma.cwiseSqrt();
+  state.refreshed_samples = state.clr.cols();
+}
+
+CodaState
+make_state(const Pipeline& pipeline, const SamplePca& pca, Eigen::MatrixXf&& distances)
+{
+  assert(distances.rows() == pipeline.samples() && distances.cols() == pipeline.samples());
+
+  CodaState state;
+
+  copy_names(pipeline.counts().samples, state.samples);
+  copy_names(pipeline.counts().otus, state.otus);
+
+  state.clr       = pipeline.clr();
+  state.distances = std::move(distances);
+
+  set_pca(state, pca.projection);
+
+  return state;
+}
+
+void
+write_state(const string& fname, const CodaState& state)
+{
+  const uint64_t m = state.clr.rows();
+  const uint64_t n = state.clr.cols();
+  const uint64_t k = state.projection.cols();
+
+  StateHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, state_magic, sizeof(header.magic));
+
+  header.version                = state_version;
+  header.byte_order             = binary_table_byte_order;
+  header.nrows                  = m;
+  header.ncols                  = n;
+  header.components             = k;
+  header.refreshed_samples      = state.refreshed_samples;
+  header.samples_offset         = sizeof(header);
+  header.otus_offset            = header.samples_offset + name_block_bytes(state.samples);
+  header.singular_values_offset = header.otus_offset + name_block_bytes(state.otus);
+  header.clr_offset             = align_up(header.singular_values_offset + k * sizeof(double),
+                                           state_alignment);
+  header.distances_offset       = header.clr_offset + m * n * sizeof(float);
+  header.axes_offset            = header.distances_offset + n * n * sizeof(float);
+  header.projection_offset      = header.axes_offset + m * k * sizeof(float);
+
+  // Written next to the old state and renamed over it, so a failed write
+  // leaves the old one alone.
+  const string tmp_fname = fname + ".tmp";
+
+  FILE* file = fopen(tmp_fname.c_str(), "wb");
+  if (file == nullptr) {
+    throw runtime_error("couldn't open '" + tmp_fname + "' for writing: " + strerror(errno));
+  }
+
+  {
+    // Make sure the file gets closed if a write throws.
+    unique_ptr<FILE, int (*)(FILE*)> closer(file, fclose);
+
+    write_bytes(file, &header, sizeof(header), tmp_fname);
+    write_name_block(file, state.samples, tmp_fname);
+    write_name_block(file, state.otus, tmp_fname);
+    write_bytes(file, state.singular_values.data(), k * sizeof(double), tmp_fname);
+    write_padding(file,
+                  header.clr_offset - header.singular_values_offset - k * sizeof(double),
+                  tmp_fname);
+    write_bytes(file, state.clr.data(), m * n * sizeof(float), tmp_fname);
+    write_bytes(file, state.distances.data(), n * n * sizeof(float), tmp_fname);
+    write_bytes(file, state.axes.data(), m * k * sizeof(float), tmp_fname);
+    write_bytes(file, state.projection.data(), n * k * sizeof(float), tmp_fname);
+
+    if (fclose(closer.release()) != 0) {
+      throw runtime_error("couldn't write '" + tmp_fname + "': " + strerror(errno));
+    }
+  }
+
+  if (rename(tmp_fname.c_str(), fname.c_str()) != 0) {
+    throw runtime_error("couldn't rename '" + tmp_fname + "' to '" + fname + "': " + strerror(errno));
+  }
+}
+
+/// Copies `rows` x `cols` floats at `offset` into `out`.
+static void
+read_floats(const MappedFile& file, uint64_t offset, uint64_t rows, uint64_t cols, Eigen::MatrixXf& out)
+{
+  out.resize(rows, cols);
+  memcpy(out.data(), file.data() + offset, rows * cols * sizeof(float));
+}
+
+CodaState
+read_state(const string& fname)
+{
+  MappedFile file(fname);
+
+  StateHeader header;
+
+  if (file.size() < sizeof(header)) {
+    throw runtime_error("'" + fname + "' is too short to be a saved state");
+  }
+  memcpy(&header, file.data(), sizeof(header));
+
+  if (memcmp(header.magic, state_magic, sizeof(header.magic)) != 0) {
+    throw runtime_error("'" + fname + "' is not a saved state");
+  }
+  if (header.byte_order != binary_table_byte_order) {
+    throw runtime_error("'" + fname + "' was written on a machine with a different byte order");
+  }
+  if (header.version != state_version) {
+    throw runtime_error("'" + fname + "' is state version " + to_string(header.version)
+                        + ", but this coda reads version " + to_string(state_version));
+  }
+
+  CodaState state;
+
+  try {
+    uint64_t stop = read_name_block(file, header.samples_offset, state.samples);
+    if (stop > header.otus_offset) {
+      throw runtime_error("overlapping sections");
+    }
+
+    stop = read_name_block(file, header.otus_offset, state.otus);
+    if (stop > header.singular_values_offset) {
+      throw runtime_error("overlapping sections");
+    }
+  }
+  catch (const runtime_error& e) {
+    throw runtime_error("'" + fname + "' is corrupt (" + e.what() + ")");
+  }
+
+  const uint64_t m = header.nrows;
+  const uint64_t n = header.ncols;
+  const uint64_t k = header.components;
+
+  if (state.samples.size() != n || state.otus.size() != m || k > n
+      || header.refreshed_samples > n
+      || !section_fits(header.singular_values_offset, k, 1, sizeof(double), header.clr_offset)
+      // Once a section fits in the file, the offset just past it can't
+      // overflow.
+      || !section_fits(header.clr_offset, m, n, sizeof(float), file.size())
+      || header.distances_offset != header.clr_offset + m * n * sizeof(float)
+      || !section_fits(header.distances_offset, n, n, sizeof(float), file.size())
+      || header.axes_offset != header.distances_offset + n * n * sizeof(float)
+      || !section_fits(header.axes_offset, m, k, sizeof(float), file.size())
+      || header.projection_offset != header.axes_offset + m * k * sizeof(float)
+      || !section_fits(header.projection_offset, n, k, sizeof(float), file.size())) {
+    throw runtime_error("'" + fname + "' is corrupt (bad dimensions or offsets)");
+  }
+
+  state.singular_values.resize(k);
+  memcpy(state.singular_values.data(), file.data() + header.singular_values_offset, k * sizeof(double));
+
+  read_floats(file, header.clr_offset, m, n, state.clr);
+  read_floats(file, header.distances_offset, n, n, state.distances);
+  read_floats(file, header.axes_offset, m, k, state.axes);
+  read_floats(file, header.projection_offset, n, k, state.projection);
+
+  state.refreshed_samples = header.refreshed_samples;
+
+  return state;
+}
+
+void
+add_samples(CodaState& state, Counts& counts, Eigen::Index tile_cols)
+{
+  assert(!counts.is_sparse);
+
+  const Eigen::Index m     = state.clr.rows();
+  const Eigen::Index n     = state.clr.cols();
+  const Eigen::Index added = (Eigen::Index)counts.samples.size();
+
+  // Check everything before changing anything.
+  vector<Eigen::Index> state_rows(counts.otus.size());
+  for (size_t i = 0; i < counts.otus.size(); ++i) {
+    const size_t row = state.otus.find(counts.otus.name(i));
+
+    if (row == NameTable::npos) {
+      throw runtime_error("OTU '" + string(counts.otus.name(i))
+                          + "' isn't in the state, and adding OTUs needs a full run");
+    }
+
+    state_rows[i] = (Eigen::Index)row;
+  }
+
+  for (size_t j = 0; j < counts.samples.size(); ++j) {
+    if (state.samples.find(counts.samples.name(j)) != NameTable::npos) {
+      throw runtime_error("sample '" + string(counts.samples.name(j)) + "' is already in the state");
+    }
+  }
+
+  // The new columns in the state's OTU order; OTUs the new samples don't
+  // have are missing cells.
+  const Eigen::Map<Eigen::MatrixXf> table = counts_table(counts);
+
+  Eigen::MatrixXf clr = Eigen::MatrixXf::Constant(m, added, zero_replacement);
+
+#pragma omp parallel for schedule(static)
+  for (Eigen::Index j = 0; j < added; ++j) {
+    for (Eigen::Index i = 0; i < table.rows(); ++i) {
+      clr(state_rows[i], j) = table(i, j);
+    }
+  }
+
+  clr_in_place(clr);
+
+  state.clr.conservativeResize(Eigen::NoChange, n + added);
+  state.clr.rightCols(added) = clr;
+
+  for (size_t j = 0; j < counts.samples.size(); ++j) {
+    state.samples.intern(counts.samples.name(j));
+  }
+
+  // Only the new rows of the distance matrix, mirrored into the new columns.
+  Eigen::MatrixXf rows(added, n + added);
+  distance_rows(state.clr, n, rows, tile_cols);
+
+  state.distances.conservativeResize(n + added, n + added);
+  state.distances.bottomRows(added)         = rows;
+  state.distances.topRightCorner(n, added) = rows.leftCols(n).transpose();
+
+  // Fold in: a new column c has V * Sigma row U^T c.
+  state.projection.conservativeResize(n + added, Eigen::NoChange);
+  state.projection.bottomRows(added) = clr.transpose() * state.axes;
+}
+
+double
+folded_fraction(const CodaState& state)
+{
+  const Eigen::Index n = state.clr.cols();
+
+  return n > 0 ? (double)(n - (Eigen::Index)state.refreshed_samples) / n : 0;
+}
+
+void
+refresh_pca(CodaState& state, const PipelineOptions& options)
+{
+  const Eigen::Index n      = state.clr.cols();
+  const PcaTarget    target = pca_target(options, n);
+
+  SamplePca pca;
+
+  if (uses_gram(options, n)) {
+    pca = gram_pca(gram_matrix(state.clr), target);
+  }
+  else {
+    Rsvd::PhiloxEngine random_engine{};
+    random_engine.seed(options.seed);
+
+    pca = sample_pca(random_engine, state.clr, target, options.pca_method);
+  }
+
+  set_pca(state, pca.projection);
+}
+
+SamplePca
+state_pca(const CodaState& state)
+{
+  const double total = col_squared_norms(state.clr).sum();
+
+  SamplePca pca;
+  pca.projection = state.projection;
+  pca.explained  = state.projection.cast<double>().colwise().squaredNorm().transpose();
+
+  if (total > 0) {
+    pca.explained /= total;
+  }
+
+  return pca;
+}
+
+void
+write_state_clr(const string& fname, const CodaState& state, AsyncWriter* async)
+{
+  TsvWriter out(fname, async);
+
+  out.write_header("otu", state.samples);
+
+  for (Eigen::Index first = 0; first < state.clr.rows(); first += output_block_rows) {
+    const Eigen::Index count = min(output_block_rows, state.clr.rows() - first);
+
+    out.write_rows(state.otus, first, state.clr.middleRows(first, count));
+  }
+
+  out.close();
+}
@@ -0,0 +1,126 @@
+#ifndef CODA_INCREMENTAL_H
+#define CODA_INCREMENTAL_H
+
+#include <cstdint>
+#include <string>
+
+#include <Eigen/Dense>
+
+#include "async_writer.h"
+#include "ingest.h"
+#include "name_table.h"
+#include "pipeline.h"
+#include "rsvd.h"
+#include "tiled_distance.h"
+
+/// Saved state of a run, for adding samples to it later.
+///
+/// Everything is in native byte order, like a binary table.  Offsets are
+/// from the start of the file.
+///
+///   header           StateHeader
+///   samples          name block (see binary_table.h)
+///   otus             name block
+///   singular values  components doubles
+///   clr              nrows * ncols floats, column-major, 64-byte aligned
+///   distances        ncols * ncols floats
+///   axes             nrows * components floats
+///   projection       ncols * components floats
+#define state_magic "CODASTA"
+#define state_version 1
+
+typedef struct StateHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t nrows;
+  uint64_t ncols;
+  uint64_t components;
+  uint64_t refreshed_samples;
+  uint64_t samples_offset;
+  uint64_t otus_offset;
+  uint64_t singular_values_offset;
+  uint64_t clr_offset;
+  uint64_t distances_offset;
+  uint64_t axes_offset;
+  uint64_t projection_offset;
+} StateHeader;
+
+/// @brief Everything needed to add samples to a run without redoing it.
+///
+/// The CLR is per sample, so the old columns stay as they are, and only
+/// the distances to the new samples are new.  Only the PCA is not exact
+/// after an update: new samples are folded into the old principal axes (U
+/// of the SVD), which don't move until refresh_pca() recomputes them.
+typedef struct CodaState
+{
+  NameTable samples;
+  NameTable otus;
+
+  // OTUs x samples, f32.
+  Eigen::MatrixXf clr;
+
+  // Samples x samples.
+  Eigen::MatrixXf distances;
+
+  // OTUs x components: the left singular vectors of `clr`.
+  Eigen::MatrixXf axes;
+  Eigen::VectorXd singular_values;
+
+  // Samples x components, V * Sigma, with folded in rows for the samples
+  // added since the last refresh.
+  Eigen::MatrixXf projection;
+
+  // Samples in the last full PCA; the ones after are folded in.
+  uint64_t refreshed_samples;
+} CodaState;
+
+/// @brief The state of a finished run: its CLR table (in f32), distances and
+/// PCA.  The principal axes are recovered from the projection in one pass
+/// over the table.
+CodaState
+make_state(const Pipeline& pipeline, const SamplePca& pca, Eigen::MatrixXf&& distances);
+
+/// Throws std::runtime_error if the file can't be written.
+void
+write_state(const std::string& fname, const CodaState& state);
+
+/// Throws std::runtime_error if the file is not a usable state.
+CodaState
+read_state(const std::string& fname);
+
+/// @brief Appends the samples in dense `counts` to `state`.
+///
+/// Only their CLR columns, their rows of the distance matrix and their
+/// projections onto the existing axes (U^T c for CLR column c) are
+/// computed.  The CLR columns and distances are what a run over all the
+/// samples would give, up to rounding.
+///
+/// Throws std::runtime_error, leaving `state` as it was, if a sample is
+/// already in the state or an OTU isn't: a new OTU would change the CLR of
+/// every old sample, so that needs a full run.
+void
+add_samples(CodaState& state, Counts& counts, Eigen::Index tile_cols = distance_tile_cols);
+
+/// Fraction of the samples whose projections are folded in.
+double
+folded_fraction(const CodaState& state);
+
+/// @brief Recomputes the PCA of all of the state's samples, the way a full run
+/// with `options` would, and its axes.
+void
+refresh_pca(CodaState& state, const PipelineOptions& options);
+
+/// The state's projection, with the fraction of the variance each component
+/// explains.
+SamplePca
+state_pca(const CodaState& state);
+
+/// The CLR table as TSV, like Pipeline::write_clr().
+///
+/// Throws std::runtime_error if the file can't be written.
+void
+write_state_clr(const std::string& fname, const CodaState& state, AsyncWriter* async = nullptr);
+
+#endif //CODA_INCREMENTAL_H
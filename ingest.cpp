@@ -0,0 +1,757 @@
+#include "ingest.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "clr_kernel.h"
+#include "utils.h"
+
+using namespace std;
+
+/// Partial column sums from one chunk.
+typedef struct ColumnSum
+{
+  size_t col;
+  double log_sum;
+  size_t num_cells;
+} ColumnSum;
+
+/// One chunk of the input and what each pass pulls out of it.
+typedef struct Chunk
+{
+  const char* begin;
+  const char* end;
+
+  // Pass 1: local indices, in order of first appearance within the chunk,
+  // and the number of lines for each local sample.
+  NameTable samples;
+  NameTable otus;
+  size_t    num_lines;
+  std::vector<size_t> sample_lines;
+
+  // Pass 2: column sums in order of first appearance within the chunk.
+  std::vector<ColumnSum> col_sums;
+  unsigned long zero_counts;
+
+  // Set if the chunk had a bad line, along with its line number within the
+  // chunk.
+  std::string error;
+  size_t      error_line;
+} Chunk;
+
+/// Chunk boundaries only depend on the file contents.
+static vector<Chunk>
+make_chunks(const MappedFile& in_file)
+{
+  vector<Chunk> chunks;
+
+  const char* begin = in_file.begin();
+  const char* end   = in_file.end();
+
+  while (begin < end) {
+    const char* stop = end;
+
+    if ((size_t)(end - begin) > ingest_chunk_bytes) {
+      const char* newline = (const char*)memchr(begin + ingest_chunk_bytes,
+                                                '\n',
+                                                end - begin - ingest_chunk_bytes);
+
+      stop = newline == nullptr ? end : newline + 1;
+    }
+
+    Chunk chunk;
+    chunk.begin       = begin;
+    chunk.end         = stop;
+    chunk.num_lines   = 0;
+    chunk.zero_counts = 0;
+    chunk.error_line  = 0;
+    chunks.push_back(move(chunk));
+
+    begin = stop;
+  }
+
+  return chunks;
+}
+
+/// Throws if the line doesn't have exactly 4 fields.
+static void
+split_line(array<string_view, 4>& tokens, string_view line)
+{
+  if (split(tokens, line, '\t') != tokens.size()) {
+    throw runtime_error("Too few tokens!");
+  }
+}
+
+/// Pass 1: names only.
+static void
+scan_names(Chunk& chunk)
+{
+  array<string_view, 4> tokens;
+
+  const char* cursor = chunk.begin;
+  string_view line;
+
+  while (next_line(cursor, chunk.end, line)) {
+    ++chunk.num_lines;
+
+    if (line.empty()) {
+      continue;
+    }
+
+    try {
+      split_line(tokens, line);
+    }
+    catch (const exception& e) {
+      chunk.error      = e.what();
+      chunk.error_line = chunk.num_lines;
+      return;
+    }
+
+    size_t sample = chunk.samples.intern(tokens[0]);
+    if (sample == chunk.sample_lines.size()) {
+      chunk.sample_lines.push_back(0);
+    }
+    chunk.sample_lines[sample]++;
+
+    chunk.otus.intern(tokens[1]);
+  }
+}
+
+/// Fold a chunk's local names into the global table.  Returns local index ->
+/// global index.
+static vector<size_t>
+merge_names(NameTable& names, const NameTable& local)
+{
+  vector<size_t> remap(local.size());
+
+  for (size_t i = 0; i < local.size(); ++i) {
+    remap[i] = names.intern(local.name(i));
+  }
+
+  return remap;
+}
+
+/// Throws for the first chunk (in file order) with an error.  All chunks
+/// before it were read in full, so their line counts give the absolute line
+/// number.
+static void
+check_errors(const vector<Chunk>& chunks)
+{
+  size_t lines_before = 0;
+
+  for (const auto& chunk : chunks) {
+    if (!chunk.error.empty()) {
+      throw runtime_error("bad input on line "
+                          + to_string(lines_before + chunk.error_line)
+                          + " (" + chunk.error + ")");
+    }
+
+    lines_before += chunk.num_lines;
+  }
+}
+
+/// Pass 2: parse the numbers and hand each cell to `store`.
+template <typename Store>
+static void
+fill_chunk(Chunk& chunk, const Counts& counts, Store store)
+{
+  array<string_view, 4> tokens;
+
+  // Column -> position in chunk.col_sums.  Input is usually grouped by
+  // sample, so check the last column first.
+  unordered_map<size_t, size_t> col_pos;
+  size_t last_col = NameTable::npos;
+  size_t last_pos = 0;
+
+  const char* cursor   = chunk.begin;
+  string_view line;
+  size_t      line_num = 0;
+
+  while (next_line(cursor, chunk.end, line)) {
+    ++line_num;
+
+    if (line.empty()) {
+      continue;
+    }
+
+    Element element;
+    try {
+      split_line(tokens, line);
+      element = parse_data_line(tokens, true);
+    }
+    catch (const exception& e) {
+      chunk.error      = e.what();
+      chunk.error_line = line_num;
+      return;
+    }
+
+    // Every name is in the global tables after pass 1.
+    element.sample_index = counts.samples.find(tokens[0]);
+    element.otu_index    = counts.otus.find(tokens[1]);
+
+    float norm_count = element_normalize_count(element);
+
+    store(element, norm_count);
+
+    // Track "zero" counts
+    if (element.count < 1) {
+      chunk.zero_counts++;
+    }
+
+    if (element.sample_index != last_col) {
+      auto result = col_pos.try_emplace(element.sample_index, chunk.col_sums.size());
+      if (result.second) {
+        chunk.col_sums.push_back(ColumnSum{ element.sample_index, 0.0, 0 });
+      }
+
+      last_col = element.sample_index;
+      last_pos = result.first->second;
+    }
+
+    chunk.col_sums[last_pos].log_sum += clr_log(norm_count);
+    chunk.col_sums[last_pos].num_cells++;
+  }
+}
+
+/// Hands every line's sample, OTU and normalized count to `visit`, in file
+/// order, on this thread.  Only for input with a sample/OTU pair that shows
+/// up twice, where the parallel pass can't tell which line comes later.
+/// The chunks were all read without error, so every line parses.
+template <typename Visit>
+static void
+for_each_line(const vector<Chunk>& chunks, const Counts& counts, Visit visit)
+{
+  array<string_view, 4> tokens;
+
+  for (const auto& chunk : chunks) {
+    const char* cursor = chunk.begin;
+    string_view line;
+
+    while (next_line(cursor, chunk.end, line)) {
+      if (line.empty()) {
+        continue;
+      }
+
+      split_line(tokens, line);
+
+      const Element element = parse_data_line(tokens, true);
+
+      visit(counts.samples.find(tokens[0]), counts.otus.find(tokens[1]), element_normalize_count(element));
+    }
+  }
+}
+
+/// Sum of the logs down column `j` of a filled in dense or sparse table, with
+/// the cells a sparse table doesn't store at zero_replacement.  `logs` is
+/// scratch space for a dense column.
+static double
+col_log_sum(Counts& counts, Eigen::Index j, Eigen::VectorXf& logs)
+{
+  const Eigen::Index nrows = counts.otus.size();
+
+  if (counts.is_sparse) {
+    double       sum   = 0;
+    Eigen::Index cells = 0;
+
+    for (SparseTable::InnerIterator it(counts.sparse_table, j); it; ++it) {
+      sum += clr_log(it.value());
+      ++cells;
+    }
+
+    return sum + (nrows - cells) * (double)clr_log_zero_replacement();
+  }
+
+  logs.resize(nrows);
+
+  return clr_log_column(counts_table(counts).col(j).data(), logs.data(), nrows);
+}
+
+/// Write straight into the dense table.  `seen` has one bit per cell, to
+/// notice a sample/OTU pair that shows up twice.  The later line in the file
+/// wins, as in a single pass; but which thread writes a cell last depends on
+/// timing, so then a serial pass writes every line again in file order.
+/// Returns the columns with such a pair, in order.
+static vector<Eigen::Index>
+fill_dense(vector<Chunk>& chunks, Counts& counts)
+{
+  // nrows = nOTUs, ncols = nsamples
+  counts.storage = Eigen::MatrixXf::Constant(counts.otus.size(),
+                                             counts.samples.size(),
+                                             zero_replacement);
+  counts.table   = counts.storage.data();
+
+  Eigen::Map<Eigen::MatrixXf> table = counts_table(counts);
+
+  const size_t nrows = table.rows();
+
+  vector<atomic<uint64_t>> seen((table.size() + 63) / 64);
+  atomic<bool>             duplicate(false);
+
+  auto store = [&](const Element& element, float norm_count) {
+    const size_t   cell = element.sample_index * nrows + element.otu_index;
+    const uint64_t bit  = (uint64_t)1 << (cell % 64);
+
+    if (seen[cell / 64].fetch_or(bit, memory_order_relaxed) & bit) {
+      duplicate.store(true, memory_order_relaxed);
+    }
+
+    table(element.otu_index, element.sample_index) = norm_count;
+  };
+
+  const long num_chunks = (long)chunks.size();
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long i = 0; i < num_chunks; ++i) {
+    fill_chunk(chunks[i], counts, store);
+  }
+
+  check_errors(chunks);
+
+  vector<Eigen::Index> duplicate_cols;
+
+  if (!duplicate) {
+    return duplicate_cols;
+  }
+
+  vector<bool> written(table.size(), false);
+  vector<bool> has_duplicate(table.cols(), false);
+
+  for_each_line(chunks, counts, [&](size_t sample, size_t otu, float norm_count) {
+    const size_t cell = sample * nrows + otu;
+
+    if (written[cell]) {
+      has_duplicate[sample] = true;
+    }
+    written[cell] = true;
+
+    table(otu, sample) = norm_count;
+  });
+
+  for (Eigen::Index j = 0; j < table.cols(); ++j) {
+    if (has_duplicate[j]) {
+      duplicate_cols.push_back(j);
+    }
+  }
+
+  return duplicate_cols;
+}
+
+/// Write into a compressed sparse column table.  `col_lines` (from pass 1)
+/// sizes each column exactly; threads claim slots in a column with an atomic
+/// cursor.  Duplicates are found after each column is sorted by row; as in
+/// fill_dense(), the later line in the file wins, which takes a serial pass,
+/// and the extra slots are squeezed out.  Returns the columns with a
+/// duplicate, in order.
+static vector<Eigen::Index>
+fill_sparse(vector<Chunk>& chunks, Counts& counts, const vector<size_t>& col_lines)
+{
+  const Eigen::Index nrows = counts.otus.size();
+  const Eigen::Index ncols = counts.samples.size();
+
+  SparseTable& table = counts.sparse_table;
+  table.resize(nrows, ncols);
+
+  Eigen::Index* outer = table.outerIndexPtr();
+  outer[0] = 0;
+  for (Eigen::Index j = 0; j < ncols; ++j) {
+    outer[j + 1] = outer[j] + col_lines[j];
+  }
+  table.resizeNonZeros(outer[ncols]);
+
+  Eigen::Index* inner  = table.innerIndexPtr();
+  float*        values = table.valuePtr();
+
+  vector<atomic<Eigen::Index>> cursors(ncols);
+
+  auto store = [&](const Element& element, float norm_count) {
+    Eigen::Index pos = outer[element.sample_index]
+                       + cursors[element.sample_index].fetch_add(1, memory_order_relaxed);
+
+    inner[pos]  = element.otu_index;
+    values[pos] = norm_count;
+  };
+
+  const long num_chunks = (long)chunks.size();
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long i = 0; i < num_chunks; ++i) {
+    fill_chunk(chunks[i], counts, store);
+  }
+
+  check_errors(chunks);
+
+  // Slot order within a column depends on thread timing; row order doesn't.
+  vector<char> has_duplicate(ncols, 0);
+
+#pragma omp parallel
+  {
+    vector<pair<Eigen::Index, float>> entries;
+
+#pragma omp for schedule(dynamic, 64)
+    for (Eigen::Index j = 0; j < ncols; ++j) {
+      entries.clear();
+      for (Eigen::Index pos = outer[j]; pos < outer[j + 1]; ++pos) {
+        entries.emplace_back(inner[pos], values[pos]);
+      }
+
+      sort(entries.begin(), entries.end());
+
+      for (size_t k = 0; k < entries.size(); ++k) {
+        inner[outer[j] + k]  = entries[k].first;
+        values[outer[j] + k] = entries[k].second;
+
+        if (k > 0 && entries[k].first == entries[k - 1].first) {
+          has_duplicate[j] = 1;
+        }
+      }
+    }
+  }
+
+  vector<Eigen::Index> duplicate_cols;
+  for (Eigen::Index j = 0; j < ncols; ++j) {
+    if (has_duplicate[j]) {
+      duplicate_cols.push_back(j);
+    }
+  }
+
+  if (duplicate_cols.empty()) {
+    return duplicate_cols;
+  }
+
+  // Cell (sample * nrows + OTU) -> the count on its last line.
+  unordered_map<size_t, float> last;
+
+  for (Eigen::Index j : duplicate_cols) {
+    for (Eigen::Index pos = outer[j] + 1; pos < outer[j + 1]; ++pos) {
+      if (inner[pos] == inner[pos - 1]) {
+        last.emplace((size_t)j * nrows + inner[pos], 0.0f);
+      }
+    }
+  }
+
+  for_each_line(chunks, counts, [&](size_t sample, size_t otu, float norm_count) {
+    auto it = last.find(sample * nrows + otu);
+    if (it != last.end()) {
+      it->second = norm_count;
+    }
+  });
+
+  Eigen::Index kept = 0;
+
+  for (Eigen::Index j = 0; j < ncols; ++j) {
+    const Eigen::Index begin = outer[j];
+    const Eigen::Index end   = outer[j + 1];
+
+    outer[j] = kept;
+
+    for (Eigen::Index pos = begin; pos < end; ++pos) {
+      if (kept > outer[j] && inner[kept - 1] == inner[pos]) {
+        continue;
+      }
+
+      inner[kept]  = inner[pos];
+      values[kept] = values[pos];
+
+      if (has_duplicate[j]) {
+        auto it = last.find((size_t)j * nrows + inner[pos]);
+        if (it != last.end()) {
+          values[kept] = it->second;
+        }
+      }
+
+      ++kept;
+    }
+  }
+
+  outer[ncols] = kept;
+  table.resizeNonZeros(kept);
+
+  return duplicate_cols;
+}
+
+Eigen::Map<Eigen::MatrixXf>
+counts_table(Counts& counts)
+{
+  return Eigen::Map<Eigen::MatrixXf>(counts.table, counts.otus.size(), counts.samples.size());
+}
+
+Counts
+read_counts(const MappedFile& in_file, TableLayout layout)
+{
+  vector<Chunk> chunks = make_chunks(in_file);
+
+  const long num_chunks = (long)chunks.size();
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long i = 0; i < num_chunks; ++i) {
+    scan_names(chunks[i]);
+  }
+
+  check_errors(chunks);
+
+  Counts counts;
+  counts.table       = nullptr;
+  counts.is_sparse   = false;
+  counts.zero_counts = 0;
+
+  // Merging in file order numbers every name by its first appearance in the
+  // file, exactly like a single pass would.
+  vector<size_t> col_lines;
+  size_t         num_lines = 0;
+
+  for (auto& chunk : chunks) {
+    vector<size_t> sample_remap = merge_names(counts.samples, chunk.samples);
+    merge_names(counts.otus, chunk.otus);
+
+    col_lines.resize(counts.samples.size(), 0);
+    for (size_t i = 0; i < sample_remap.size(); ++i) {
+      col_lines[sample_remap[i]] += chunk.sample_lines[i];
+      num_lines += chunk.sample_lines[i];
+    }
+
+    chunk.samples = NameTable();
+    chunk.otus    = NameTable();
+    vector<size_t>().swap(chunk.sample_lines);
+  }
+
+  const double num_cells = (double)counts.otus.size() * counts.samples.size();
+
+  if (layout == TableLayout::automatic) {
+    layout = num_lines <= sparse_max_density * num_cells ? TableLayout::sparse
+                                                         : TableLayout::dense;
+  }
+
+  vector<Eigen::Index> duplicate_cols;
+
+  if (layout == TableLayout::sparse) {
+    counts.is_sparse = true;
+    duplicate_cols   = fill_sparse(chunks, counts, col_lines);
+  }
+  else {
+    duplicate_cols = fill_dense(chunks, counts);
+  }
+
+  // Reduce in chunk order so the sums don't depend on the thread count.
+  const Eigen::Index nrows = counts.otus.size();
+  const Eigen::Index ncols = counts.samples.size();
+
+  Eigen::VectorXd log_sums  = Eigen::VectorXd::Zero(ncols);
+  vector<size_t>  col_cells(ncols, 0);
+
+  for (const auto& chunk : chunks) {
+    for (const auto& col_sum : chunk.col_sums) {
+      log_sums(col_sum.col) += col_sum.log_sum;
+      col_cells[col_sum.col] += col_sum.num_cells;
+    }
+
+    counts.zero_counts += chunk.zero_counts;
+  }
+
+  // Cells without a line all hold zero_replacement.
+  const double log_zero_replacement = clr_log_zero_replacement();
+  for (Eigen::Index j = 0; j < ncols; ++j) {
+    log_sums(j) += (nrows - col_cells[j]) * log_zero_replacement;
+  }
+
+  counts.col_log_sums = log_sums;
+
+  // The line sums of these count both lines of a duplicate; only the later
+  // one is in the table.
+  Eigen::VectorXf logs;
+  for (Eigen::Index j : duplicate_cols) {
+    counts.col_log_sums(j) = col_log_sum(counts, j, logs);
+  }
+
+  return counts;
+}
+
+/// Names "<prefix>1", "<prefix>2", ... for tables that come without any.
+static NameTable
+numbered_names(const char* prefix, size_t n)
+{
+  NameTable names;
+
+  for (size_t i = 0; i < n; ++i) {
+    names.intern(prefix + to_string(i + 1));
+  }
+
+  return names;
+}
+
+/// Counts with numbered names, and nothing else filled in yet.
+static Counts
+empty_counts(size_t num_otus, size_t num_samples)
+{
+  Counts counts;
+  counts.samples     = numbered_names("sample", num_samples);
+  counts.otus        = numbered_names("otu", num_otus);
+  counts.is_sparse   = false;
+  counts.table       = nullptr;
+  counts.zero_counts = 0;
+
+  return counts;
+}
+
+/// Column log sums of a filled in dense or sparse table, with the cells a
+/// sparse table doesn't store at zero_replacement.
+static void
+set_col_log_sums(Counts& counts)
+{
+  const Eigen::Index ncols = counts.samples.size();
+
+  counts.col_log_sums.resize(ncols);
+
+#pragma omp parallel
+  {
+    Eigen::VectorXf logs;
+
+#pragma omp for schedule(static)
+    for (Eigen::Index j = 0; j < ncols; ++j) {
+      counts.col_log_sums(j) = col_log_sum(counts, j, logs);
+    }
+  }
+}
+
+/// Zero replacement for tables given as numbers rather than lines.
+static void
+replace_zeros(float* values, size_t n, unsigned long& zero_counts)
+{
+  for (size_t i = 0; i < n; ++i) {
+    if (!(values[i] > 0)) {
+      values[i] = zero_replacement;
+      ++zero_counts;
+    }
+  }
+}
+
+Counts
+counts_from_elements(const vector<Element>& elements,
+                     size_t num_otus,
+                     size_t num_samples,
+                     TableLayout layout)
+{
+  Counts counts = empty_counts(num_otus, num_samples);
+
+  if (layout == TableLayout::automatic) {
+    layout = elements.size() <= sparse_max_density * ((double)num_otus * num_samples)
+             ? TableLayout::sparse
+             : TableLayout::dense;
+  }
+
+  // (column, row, value), sorted so duplicates are next to each other and
+  // the sparse table can be filled in order.
+  typedef tuple<size_t, size_t, float> Cell;
+
+  vector<Cell> cells;
+  cells.reserve(elements.size());
+
+  for (size_t k = 0; k < elements.size(); ++k) {
+    Element element = elements[k];
+
+    if (element.sample_index >= num_samples || element.otu_index >= num_otus) {
+      throw runtime_error("element " + to_string(k) + " is outside the "
+                          + to_string(num_otus) + " x " + to_string(num_samples) + " table");
+    }
+
+    // Same as parse_data_line() and fill_chunk().
+    if (element.count == 0) {
+      element.count = zero_replacement;
+    }
+    if (element.count < 1) {
+      counts.zero_counts++;
+    }
+
+    cells.emplace_back(element.sample_index, element.otu_index, element_normalize_count(element));
+  }
+
+  sort(cells.begin(), cells.end());
+
+  for (size_t k = 1; k < cells.size(); ++k) {
+    if (get<0>(cells[k]) == get<0>(cells[k - 1]) && get<1>(cells[k]) == get<1>(cells[k - 1])) {
+      throw runtime_error("duplicate entry for sample " + to_string(get<0>(cells[k]))
+                          + " and OTU " + to_string(get<1>(cells[k])));
+    }
+  }
+
+  if (layout == TableLayout::sparse) {
+    counts.is_sparse = true;
+
+    SparseTable& table = counts.sparse_table;
+    table.resize(num_otus, num_samples);
+    table.reserve(cells.size());
+
+    size_t k = 0;
+    for (size_t j = 0; j < num_samples; ++j) {
+      table.startVec(j);
+
+      for (; k < cells.size() && get<0>(cells[k]) == j; ++k) {
+        table.insertBack(get<1>(cells[k]), j) = get<2>(cells[k]);
+      }
+    }
+    table.finalize();
+  }
+  else {
+    counts.storage = Eigen::MatrixXf::Constant(num_otus, num_samples, zero_replacement);
+    counts.table   = counts.storage.data();
+
+    for (const Cell& cell : cells) {
+      counts.storage(get<1>(cell), get<0>(cell)) = get<2>(cell);
+    }
+  }
+
+  set_col_log_sums(counts);
+
+  return counts;
+}
+
+Counts
+counts_from_table(const Eigen::Ref<const Eigen::MatrixXf>& table)
+{
+  Counts counts = empty_counts(table.rows(), table.cols());
+
+  counts.storage = table;
+  counts.table   = counts.storage.data();
+
+  replace_zeros(counts.table, counts.storage.size(), counts.zero_counts);
+  set_col_log_sums(counts);
+
+  return counts;
+}
+
+Counts
+counts_from_table_in_place(Eigen::Map<Eigen::MatrixXf> table)
+{
+  Counts counts = empty_counts(table.rows(), table.cols());
+
+  counts.table = table.data();
+
+  replace_zeros(counts.table, table.size(), counts.zero_counts);
+  set_col_log_sums(counts);
+
+  return counts;
+}
+
+Counts
+counts_from_sparse(const SparseTable& table)
+{
+  Counts counts = empty_counts(table.rows(), table.cols());
+
+  counts.is_sparse    = true;
+  counts.sparse_table = table;
+  counts.sparse_table.makeCompressed();
+
+  replace_zeros(counts.sparse_table.valuePtr(), counts.sparse_table.nonZeros(), counts.zero_counts);
+  set_col_log_sums(counts);
+
+  return counts;
+}
@@ -0,0 +1,128 @@
+#ifndef CODA_INGEST_H
+#define CODA_INGEST_H
+
+#include <memory>
+#include <vector>
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+#include "element.h"
+#include "mapped_file.h"
+#include "name_table.h"
+
+/// Input is cut into chunks of about this many bytes (moved up to the next
+/// line break).  The chunk size must not depend on the number of threads, or
+/// the parse would not be reproducible across thread counts.
+#define ingest_chunk_bytes ((size_t)32 << 20)
+
+/// At or below this fraction of filled cells, `TableLayout::automatic` picks
+/// the sparse layout.  A sparse cell costs 12 bytes against 4 for a dense one,
+/// so a quarter full leaves some headroom for the index arrays.
+#define sparse_max_density 0.25
+
+enum class TableLayout
+{
+  dense,
+  sparse,
+  automatic,
+};
+
+/// Normalized counts with the cells that have an input line, column-major.
+typedef Eigen::SparseMatrix<float, Eigen::ColMajor, Eigen::Index> SparseTable;
+
+typedef struct Counts
+{
+  // Samples are columns.
+  NameTable samples;
+
+  // OTUs are rows.
+  NameTable otus;
+
+  // Set if the counts are in `sparse_table` rather than `table`.
+  bool is_sparse;
+
+  // Normalized counts (see element_normalize_count()), zero_replacement
+  // where a sample has no line for an OTU.  nOTUs x nsamples, column-major.
+  // Points into `storage` or `mapping` (or a caller's table, see
+  // counts_from_table_in_place()); use counts_table() to get at it.
+  float* table;
+
+  // Owns the table when it was parsed from text...
+  Eigen::MatrixXf storage;
+
+  // ...or when it was mapped from a binary table.
+  std::unique_ptr<MappedFile> mapping;
+
+  // Sparse layout: only the cells with an input line, the rest are
+  // implicitly zero_replacement.  Rows sorted within each column.
+  SparseTable sparse_table;
+
+  // Sum of log(table) down each column, for clr_in_place().
+  Eigen::VectorXd col_log_sums;
+
+  unsigned long zero_counts;
+} Counts;
+
+/// The dense count table, wherever it lives.
+Eigen::Map<Eigen::MatrixXf>
+counts_table(Counts& counts);
+
+/// @brief Parse a long format counts file straight into the count table.
+///
+/// This takes two passes over the input, both parallel over chunks.  The
+/// first only collects names.  Each chunk has its own name tables, and these
+/// are merged in file order afterwards, so samples and OTUs are numbered by
+/// first appearance in the file no matter how many threads did the work.
+///
+/// With the dimensions known, the table is allocated once and the second pass
+/// parses the numbers and writes them into it directly, adding up the column
+/// log sums as it goes.  No per-line records are kept.
+///
+/// The table is dense, or sparse (only the cells with a line are stored), as
+/// `layout` says.  `TableLayout::automatic` goes by the fraction of filled
+/// cells, see `sparse_max_density`.
+///
+/// Names are copied into the tables, so the result doesn't depend on
+/// `in_file` staying mapped.
+///
+/// If a sample/OTU pair shows up on more than one line, the last of them in
+/// the file counts, whatever the layout or number of threads.
+///
+/// Throws std::runtime_error naming the first bad line in the file.
+Counts
+read_counts(const MappedFile& in_file, TableLayout layout = TableLayout::automatic);
+
+/// @brief Counts from cells already in memory, one Element per cell, with
+/// `sample_index` and `otu_index` below `num_samples` and `num_otus`.
+///
+/// Same as parsing the lines they stand for: zero counts are replaced,
+/// counts are normalized by OTU length, and cells without an element hold
+/// zero_replacement.  Samples and OTUs are named "sample1", "otu1", ...
+///
+/// Throws std::runtime_error for an index out of range or a duplicate cell.
+Counts
+counts_from_elements(const std::vector<Element>& elements,
+                     size_t num_otus,
+                     size_t num_samples,
+                     TableLayout layout = TableLayout::automatic);
+
+/// @brief Counts from a dense OTUs x samples table of normalized counts,
+/// which is copied.  Cells at or below zero hold zero_replacement, like
+/// cells without a line.  Names as above.
+Counts
+counts_from_table(const Eigen::Ref<const Eigen::MatrixXf>& table);
+
+/// Same as above without the copy: `table` becomes the count table (zeros
+/// replaced in place), so it must outlive the result.  clr_in_place() then
+/// turns it into the CLR table.
+Counts
+counts_from_table_in_place(Eigen::Map<Eigen::MatrixXf> table);
+
+/// @brief Counts from a sparse table of normalized counts, which is copied.
+/// Cells not stored hold zero_replacement, as do stored ones at or below
+/// zero.  Names as above.
+Counts
+counts_from_sparse(const SparseTable& table);
+
+#endif //CODA_INGEST_H
@@ -0,0 +1,204 @@
+#include "jl_sketch.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+
+#include <rsvd/Philox.hpp>
+
+#include "mat.h"
+
+/// Philox counter words that keep the sketch's random numbers apart from
+/// the PCA's, which count streams up from 0.
+#define sketch_matrix_stream 0x4a4c0000u
+#define sketch_pairs_stream  0x4a4c0001u
+
+/// Sketch columns per parallel piece of a block product.
+#define sketch_piece_cols ((Eigen::Index)64)
+
+using namespace std;
+
+Eigen::Index
+jl_dimension(Eigen::Index samples, double eps)
+{
+  if (!(eps > 0 && eps < 1)) {
+    throw runtime_error("the sketch distortion must be between 0 and 1");
+  }
+
+  const double bound = 4 * log((double)max(samples, (Eigen::Index)2)) / (eps * eps / 2 - eps * eps * eps / 3);
+
+  return (Eigen::Index)ceil(bound);
+}
+
+/// +1 or -1 with probability 1/6 each, 0 otherwise, from 32 random bits.
+static inline float
+achlioptas_sign(uint32_t bits)
+{
+  return bits < 0x2aaaaaabu ? 1.0f : bits < 0x55555555u ? -1.0f : 0.0f;
+}
+
+/// Columns [first, first + count) of R, scaled.  Entry (i, j) only depends
+/// on the seed, i and j.
+static Eigen::MatrixXf
+sketch_matrix_block(const Rsvd::PhiloxEngine& engine, Eigen::Index dim, Eigen::Index first, Eigen::Index count)
+{
+  const float scale = sqrtf(3.0f / (float)dim);
+
+  Eigen::MatrixXf r(dim, count);
+
+#pragma omp parallel for schedule(static)
+  for (Eigen::Index j = 0; j < count; ++j) {
+    const uint64_t otu = (uint64_t)(first + j);
+
+    for (Eigen::Index i = 0; i < dim; i += 4) {
+      const array<uint32_t, 4> bits
+        = engine.bits({ (uint32_t)otu, (uint32_t)(otu >> 32), (uint32_t)(i / 4), sketch_matrix_stream });
+
+      for (Eigen::Index l = 0; l < 4 && i + l < dim; ++l) {
+        r(i + l, j) = achlioptas_sign(bits[l]) * scale;
+      }
+    }
+  }
+
+  return r;
+}
+
+/// Every pair of the n samples if there are at most `check_pairs`, else
+/// `check_pairs` random ones.
+static Eigen::Matrix<Eigen::Index, 2, Eigen::Dynamic>
+check_pairs_for(const Rsvd::PhiloxEngine& engine, Eigen::Index n, Eigen::Index check_pairs)
+{
+  Eigen::Matrix<Eigen::Index, 2, Eigen::Dynamic> pairs;
+
+  if (n < 2 || check_pairs <= 0) {
+    pairs.resize(2, 0);
+    return pairs;
+  }
+
+  if (n * (n - 1) / 2 <= check_pairs) {
+    pairs.resize(2, n * (n - 1) / 2);
+
+    Eigen::Index q = 0;
+    for (Eigen::Index b = 1; b < n; ++b) {
+      for (Eigen::Index a = 0; a < b; ++a, ++q) {
+        pairs(0, q) = a;
+        pairs(1, q) = b;
+      }
+    }
+
+    return pairs;
+  }
+
+  pairs.resize(2, check_pairs);
+
+  for (Eigen::Index q = 0; q < check_pairs; ++q) {
+    const array<uint32_t, 4> bits = engine.bits({ (uint32_t)q, (uint32_t)((uint64_t)q >> 32), 0, sketch_pairs_stream });
+
+    // Two different samples; the modulo bias is negligible at 64 bits.
+    const uint64_t     a_bits = (uint64_t)bits[0] << 32 | bits[1];
+    const uint64_t     b_bits = (uint64_t)bits[2] << 32 | bits[3];
+    const Eigen::Index a      = (Eigen::Index)(a_bits % (uint64_t)n);
+    Eigen::Index       b      = (Eigen::Index)(b_bits % (uint64_t)(n - 1));
+
+    if (b >= a) {
+      ++b;
+    }
+
+    pairs(0, q) = a;
+    pairs(1, q) = b;
+  }
+
+  return pairs;
+}
+
+template <typename Matrix>
+static JlSketch
+sketch_blocks(const Matrix& clr, Eigen::Index dim, uint64_t seed, Eigen::Index check_pairs)
+{
+  if (dim < 1) {
+    throw runtime_error("the sketch needs at least one dimension");
+  }
+
+  const Eigen::Index m = clr.rows();
+  const Eigen::Index n = clr.cols();
+
+  // Enough rows for about sketch_block_bytes of floats, as row_block() gives
+  // them, and as many columns of R.
+  const Eigen::Index block_rows
+    = max((Eigen::Index)1, (Eigen::Index)(sketch_block_bytes / sizeof(float) / max(n, dim)));
+
+  Rsvd::PhiloxEngine engine{};
+  engine.seed(seed);
+
+  JlSketch out;
+  out.sketch = Eigen::MatrixXf::Zero(dim, n);
+  out.pairs  = check_pairs_for(engine, n, check_pairs);
+
+  const Eigen::Index num_pairs = out.pairs.cols();
+  Eigen::VectorXd    exact_sq  = Eigen::VectorXd::Zero(num_pairs);
+
+  for (Eigen::Index first = 0; first < m; first += block_rows) {
+    const Eigen::Index count = min(block_rows, m - first);
+
+    const Eigen::MatrixXf block = row_block(clr, first, count);
+    const Eigen::MatrixXf r     = sketch_matrix_block(engine, dim, first, count);
+
+    // R is a third full, too dense for a sparse product to beat a dense one.
+    // In parallel over fixed pieces, so each column's sum is in the same
+    // order however many threads there are.
+#pragma omp parallel for schedule(static)
+    for (Eigen::Index j = 0; j < n; j += sketch_piece_cols) {
+      const Eigen::Index cols = min(sketch_piece_cols, n - j);
+
+      out.sketch.middleCols(j, cols).noalias() += r * block.middleCols(j, cols);
+    }
+
+#pragma omp parallel for schedule(static)
+    for (Eigen::Index q = 0; q < num_pairs; ++q) {
+      exact_sq(q) += (block.col(out.pairs(0, q)) - block.col(out.pairs(1, q))).template cast<double>().squaredNorm();
+    }
+  }
+
+  out.distortion.resize(num_pairs);
+
+  for (Eigen::Index q = 0; q < num_pairs; ++q) {
+    const double exact    = sqrt(exact_sq(q));
+    const double sketched = distance(out.sketch.col(out.pairs(0, q)), out.sketch.col(out.pairs(1, q)));
+
+    // Identical samples stay identical in the sketch.
+    out.distortion(q) = exact > 0 ? sketched / exact - 1 : 0;
+  }
+
+  return out;
+}
+
+JlSketch
+jl_sketch(const Eigen::Ref<const Eigen::MatrixXf>& clr, Eigen::Index dim, uint64_t seed, Eigen::Index check_pairs)
+{
+  return sketch_blocks(clr, dim, seed, check_pairs);
+}
+
+template <typename Policy>
+JlSketch
+jl_sketch(const DenseClr<Policy>& clr, Eigen::Index dim, uint64_t seed, Eigen::Index check_pairs)
+{
+  return sketch_blocks(clr, dim, seed, check_pairs);
+}
+
+JlSketch
+jl_sketch(const SparseClr& clr, Eigen::Index dim, uint64_t seed, Eigen::Index check_pairs)
+{
+  return sketch_blocks(clr, dim, seed, check_pairs);
+}
+
+JlSketch
+jl_sketch(const ClrRowBlocks& clr, Eigen::Index dim, uint64_t seed, Eigen::Index check_pairs)
+{
+  return sketch_blocks(clr, dim, seed, check_pairs);
+}
+
+#define INSTANTIATE_JL_SKETCH(Policy) \
+  template JlSketch jl_sketch(const DenseClr<Policy>&, Eigen::Index, uint64_t, Eigen::Index);
+
+CODA_FOR_EACH_PRECISION(INSTANTIATE_JL_SKETCH)
@@ -0,0 +1,81 @@
+#ifndef CODA_JL_SKETCH_H
+#define CODA_JL_SKETCH_H
+
+#include <cstdint>
+
+#include <Eigen/Dense>
+
+#include "clr_blocks.h"
+#include "dense_clr.h"
+#include "sparse_clr.h"
+
+/// Bytes of CLR rows multiplied into the sketch at a time.
+#define sketch_block_bytes ((size_t)64 << 20)
+
+/// Pairs of samples whose sketched distances are checked against the exact
+/// ones, if there are that many.
+#define sketch_check_pairs ((Eigen::Index)1000)
+
+/// A Johnson-Lindenstrauss sketch of a CLR table, for approximate distances.
+typedef struct JlSketch
+{
+  // dim x samples: R C for a random dim x OTUs matrix R.  The distances
+  // between its columns approximate those between the CLR columns.
+  Eigen::MatrixXf sketch;
+
+  // Pairs of samples checked, and for each, sketched distance / exact
+  // distance - 1.
+  Eigen::Matrix<Eigen::Index, 2, Eigen::Dynamic> pairs;
+  Eigen::VectorXd                                 distortion;
+} JlSketch;
+
+/// @brief Sketch dimensions the Johnson-Lindenstrauss lemma asks for to keep
+/// every distance among `samples` points within a factor of 1 +- `eps`
+/// (with probability at least 1 - 1 / samples):
+/// 4 ln(samples) / (eps^2 / 2 - eps^3 / 3).
+///
+/// The bound is loose; in practice fewer dimensions do about as well, which
+/// the self-check in jl_sketch() shows.
+Eigen::Index
+jl_dimension(Eigen::Index samples, double eps);
+
+/// @brief Sketches the CLR table down to `dim` rows with Achlioptas' sparse
+/// sign matrix: each entry of R is sqrt(3 / dim) times +1 or -1 with
+/// probability 1/6 each, and 0 otherwise.
+///
+/// R comes from Philox under `seed` (on its own counters, apart from the
+/// PCA's), a block of columns at a time, as the table is read a block of
+/// rows at a time, so it is never stored and the sketch doesn't depend on
+/// the number of threads.  That is one pass over the table and dim x OTUs x
+/// samples multiply-adds; then distances on the sketch cost dim per pair
+/// instead of OTUs.
+///
+/// In the same pass, the exact squared distances of up to `check_pairs`
+/// random pairs of samples (all of them, if there are fewer) are summed
+/// up, for `distortion`.
+JlSketch
+jl_sketch(const Eigen::Ref<const Eigen::MatrixXf>& clr,
+          Eigen::Index dim,
+          uint64_t seed,
+          Eigen::Index check_pairs = sketch_check_pairs);
+
+template <typename Policy>
+JlSketch
+jl_sketch(const DenseClr<Policy>& clr,
+          Eigen::Index dim,
+          uint64_t seed,
+          Eigen::Index check_pairs = sketch_check_pairs);
+
+JlSketch
+jl_sketch(const SparseClr& clr,
+          Eigen::Index dim,
+          uint64_t seed,
+          Eigen::Index check_pairs = sketch_check_pairs);
+
+JlSketch
+jl_sketch(const ClrRowBlocks& clr,
+          Eigen::Index dim,
+          uint64_t seed,
+          Eigen::Index check_pairs = sketch_check_pairs);
+
+#endif //CODA_JL_SKETCH_H
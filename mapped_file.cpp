@@ -0,0 +1,56 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap, madvise, munmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+MappedFile::MappedFile(const string& fname, bool writable)
+  : data_(nullptr), size_(0), writable_(writable)
+{
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw runtime_error("couldn't open '" + fname + "': " + strerror(errno));
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    int err = errno;
+    close(fd);
+    throw runtime_error("couldn't stat '" + fname + "': " + strerror(err));
+  }
+
+  size_ = (size_t)st.st_size;
+
+  // mmap refuses zero length mappings, but an empty file is just no data.
+  if (size_ > 0) {
+    int   prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* addr = mmap(nullptr, size_, prot, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      int err = errno;
+      close(fd);
+      throw runtime_error("couldn't mmap '" + fname + "': " + strerror(err));
+    }
+
+    // We scan front to back, so let the kernel read ahead aggressively.
+    madvise(addr, size_, MADV_SEQUENTIAL);
+
+    data_ = (const char*)addr;
+  }
+
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+  if (data_ != nullptr) {
+    munmap((void*)data_, size_);
+  }
+}
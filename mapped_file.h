@@ -0,0 +1,51 @@
+#ifndef CODA_MAPPED_FILE_H
+#define CODA_MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+/// Memory mapping of a whole file.
+///
+/// The mapping lives as long as the object, so any string_view handed out
+/// from `data()` must not outlive it.
+class MappedFile
+{
+public:
+  /// With `writable`, the mapping is private copy-on-write: writes go to
+  /// anonymous pages and never reach the file.
+  ///
+  /// Throws std::runtime_error if the file can't be opened or mapped.
+  explicit MappedFile(const std::string& fname, bool writable = false);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char*
+  data() const
+  { return data_; }
+
+  size_t
+  size() const
+  { return size_; }
+
+  /// Only for mappings opened `writable`.
+  char*
+  writable_data() const
+  { return writable_ ? (char*)data_ : nullptr; }
+
+  const char*
+  begin() const
+  { return data_; }
+
+  const char*
+  end() const
+  { return data_ + size_; }
+
+private:
+  const char* data_;
+  size_t size_;
+  bool writable_;
+};
+
+#endif //CODA_MAPPED_FILE_H
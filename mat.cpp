@@ -1,5 +1,12 @@
 #include "mat.h"
 
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "clr_kernel.h"
+
 /// Gives a 1D column major index given the row index and column index.
 size_t
 col_major_index(const size_t nrows, const size_t ridx, const size_t cidx)
@@ -7,46 +14,654 @@ col_major_index(const size_t nrows, const size_t ridx, const size_t cidx)
   return cidx * nrows + ridx;
 }
 
-/// In-place CLR transformation
+/// In-place CLR transformation: one log per cell, with the column means
+/// summed in double on the way.
 void
-clr_in_place(Eigen::MatrixXf& otu_table)
+clr_in_place(Eigen::Ref<Eigen::MatrixXf> otu_table)
 {
-  for (int j = 0; j < otu_table.cols(); ++j) {
-    Eigen::ArrayXf log_col      = otu_table.col(j).array().log();
-    float   mean_log_col = log_col.sum() / log_col.size();
+  const Eigen::Index nrows = otu_table.rows();
 
-    for (int i = 0; i < otu_table.rows(); ++i) {
-      otu_table(i, j) = logf(otu_table(i, j)) - mean_log_col;
-    }
+#pragma omp parallel for schedule(static)
+  for (Eigen::Index j = 0; j < otu_table.cols(); ++j) {
+    float* col = otu_table.col(j).data();
+
+    const float mean_log_col = (float)(clr_log_column(col, col, nrows) / nrows);
+
+    otu_table.col(j).array() -= mean_log_col;
   }
 }
 
+/// In-place CLR transformation with precomputed column log sums, in one pass.
+void
+clr_in_place(Eigen::Ref<Eigen::MatrixXf> otu_table, const Eigen::VectorXd& col_log_sums)
+{
+  assert(col_log_sums.size() == otu_table.cols());
+
+  const Eigen::Index nrows = otu_table.rows();
+
+#pragma omp parallel for schedule(static)
+  for (Eigen::Index j = 0; j < otu_table.cols(); ++j) {
+    float* col = otu_table.col(j).data();
+
+    clr_column(col, col, nrows, (float)(col_log_sums(j) / nrows));
+  }
+}
+
+Eigen::MatrixXf
+row_block(const Eigen::Ref<const Eigen::MatrixXf>& clr, Eigen::Index first, Eigen::Index count)
+{
+  return clr.middleRows(first, count);
+}
+
+Eigen::MatrixXf
+row_block(const SparseClr& clr, Eigen::Index first, Eigen::Index count)
+{
+  return clr.row_block(first, count);
+}
+
+Eigen::MatrixXf
+row_block(const ClrRowBlocks& clr, Eigen::Index first, Eigen::Index count)
+{
+  return clr.row_block(first, count);
+}
+
+template <typename Policy>
+Eigen::MatrixXf
+row_block(const DenseClr<Policy>& clr, Eigen::Index first, Eigen::Index count)
+{
+  return clr.storage().middleRows(first, count).template cast<float>();
+}
+
+double
+table_bytes(const SparseClr& clr)
+{
+  const double nnz = (double)clr.sparse().nonZeros();
+
+  return sizeof(float) * (nnz + clr.cols()) + sizeof(Eigen::Index) * (nnz + clr.cols() + 1);
+}
+
+double
+table_bytes(const ClrRowBlocks& clr)
+{
+  return (double)sizeof(float) * clr.rows() * clr.cols();
+}
+
 /// Euclidean distance between 2 vectors
 float
-distance(const Eigen::VectorXf& v1, const Eigen::VectorXf& v2)
+distance(const Eigen::Ref<const Eigen::VectorXf>& v1, const Eigen::Ref<const Eigen::VectorXf>& v2)
+{
+  return sqrtf((v1 - v2).squaredNorm());
+}
+
+template <typename Policy>
+Eigen::VectorXd
+col_squared_norms(const DenseClr<Policy>& m)
+{
+  Eigen::VectorXd norms(m.cols());
+
+#pragma omp parallel for schedule(static)
+  for (Eigen::Index j = 0; j < m.cols(); ++j) {
+    norms(j) = m.storage().col(j).template cast<double>().squaredNorm();
+  }
+
+  return norms;
+}
+
+Eigen::VectorXd
+col_squared_norms(const Eigen::Ref<const Eigen::MatrixXf>& m)
+{
+  return col_squared_norms(DenseClr<SinglePrecision>(m));
+}
+
+/// Turns a block of the Gram matrix into distances.  `sq_dist_direct(i, j)`
+/// recomputes one squared distance without the Gram matrix, for pairs that
+/// lost too much to cancellation.
+template <typename Direct>
+static void
+gram_to_distance(const Eigen::Ref<const Eigen::MatrixXd>& gram,
+                 const Eigen::VectorXd& sq_norms,
+                 Eigen::Index first_i,
+                 Eigen::Index first_j,
+                 Direct sq_dist_direct,
+                 Eigen::Ref<Eigen::MatrixXf> out)
+{
+  const bool diagonal = first_i == first_j;
+
+  for (Eigen::Index j = 0; j < out.cols(); ++j) {
+    for (Eigen::Index i = 0; i < (diagonal ? j : out.rows()); ++i) {
+      const double norms   = sq_norms(first_i + i) + sq_norms(first_j + j);
+      double       sq_dist = norms - 2 * gram(i, j);
+
+      // Near-identical columns: most of the digits cancelled, so redo it
+      // the direct way.
+      if (sq_dist < distance_recompute_ratio * norms) {
+        sq_dist = sq_dist_direct(i, j);
+      }
+
+      out(i, j) = (float)std::sqrt(std::max(sq_dist, 0.0));
+    }
+  }
+
+  if (diagonal) {
+    out.diagonal().setZero();
+    out.triangularView<Eigen::StrictlyLower>() = out.transpose();
+  }
+}
+
+/// m_I^T m_J for columns I = [first_i, first_i + ni) and J = [first_j,
+/// first_j + nj).  On the diagonal (I == J), only the upper triangle.
+template <typename Policy>
+static Eigen::MatrixXd
+gram_tile(const DenseClr<Policy>& clr,
+          Eigen::Index first_i,
+          Eigen::Index first_j,
+          Eigen::Index ni,
+          Eigen::Index nj)
+{
+  const Eigen::Ref<const typename Policy::StorageMatrix>& m = clr.storage();
+
+  const bool diagonal = first_i == first_j;
+  assert(!diagonal || ni == nj);
+
+  // Accumulate m_I^T m_J over row panels, each cast to double on the way in.
+  Eigen::MatrixXd gram = Eigen::MatrixXd::Zero(ni, nj);
+  Eigen::MatrixXd panel_i(distance_panel_rows, ni);
+  Eigen::MatrixXd panel_j(diagonal ? 0 : distance_panel_rows, nj);
+
+  for (Eigen::Index first_row = 0; first_row < m.rows(); first_row += distance_panel_rows) {
+    const Eigen::Index nrows = std::min(distance_panel_rows, m.rows() - first_row);
+
+    panel_i.topRows(nrows) = m.block(first_row, first_i, nrows, ni).template cast<double>();
+
+    if (diagonal) {
+      // SYRK: only the upper triangle is computed.
+      gram.selfadjointView<Eigen::Upper>().rankUpdate(panel_i.topRows(nrows).transpose());
+    }
+    else {
+      panel_j.topRows(nrows) = m.block(first_row, first_j, nrows, nj).template cast<double>();
+      gram.noalias() += panel_i.topRows(nrows).transpose() * panel_j.topRows(nrows);
+    }
+  }
+
+  return gram;
+}
+
+/// ||A_a - A_b||^2 of a dense CLR table, without the Gram matrix.
+template <typename Policy>
+static double
+sq_dist_direct(const DenseClr<Policy>& m, Eigen::Index a, Eigen::Index b)
+{
+  return (m.storage().col(a).template cast<double>() - m.storage().col(b).template cast<double>())
+    .squaredNorm();
+}
+
+template <typename Policy>
+void
+distance_tile(const DenseClr<Policy>& m,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out)
+{
+  const Eigen::MatrixXd gram = gram_tile(m, first_i, first_j, out.rows(), out.cols());
+
+  auto direct = [&](Eigen::Index i, Eigen::Index j) {
+    return sq_dist_direct(m, first_i + i, first_j + j);
+  };
+
+  gram_to_distance(gram, sq_norms, first_i, first_j, direct, out);
+}
+
+template <typename Policy>
+void
+distance_tile(const DenseClr<Policy>& m,
+              const Eigen::MatrixXd& gram,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out)
+{
+  auto direct = [&](Eigen::Index i, Eigen::Index j) {
+    return sq_dist_direct(m, first_i + i, first_j + j);
+  };
+
+  gram_to_distance(gram.block(first_i, first_j, out.rows(), out.cols()),
+                   sq_norms,
+                   first_i,
+                   first_j,
+                   direct,
+                   out);
+}
+
+void
+distance_tile(const Eigen::Ref<const Eigen::MatrixXf>& m,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out)
+{
+  distance_tile(DenseClr<SinglePrecision>(m), sq_norms, first_i, first_j, out);
+}
+
+void
+distance_tile(const Eigen::Ref<const Eigen::MatrixXf>& m,
+              const Eigen::MatrixXd& gram,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out)
+{
+  distance_tile(DenseClr<SinglePrecision>(m), gram, sq_norms, first_i, first_j, out);
+}
+
+typedef Eigen::SparseMatrix<double, Eigen::ColMajor, Eigen::Index> SparseTableD;
+
+/// Column sums of a sparse matrix.
+static Eigen::VectorXd
+col_sums(const SparseTableD& s)
+{
+  Eigen::VectorXd sums(s.cols());
+
+  for (Eigen::Index j = 0; j < s.cols(); ++j) {
+    sums(j) = s.col(j).sum();
+  }
+
+  return sums;
+}
+
+Eigen::VectorXd
+col_squared_norms(const SparseClr& m)
+{
+  const double nrows = (double)m.rows();
+
+  Eigen::VectorXd norms(m.cols());
+
+  // ||s + c 1||^2 = ||s||^2 + 2 c 1^T s + nrows c^2
+#pragma omp parallel for schedule(static)
+  for (Eigen::Index j = 0; j < m.cols(); ++j) {
+    const SparseTableD s = m.sparse().col(j).cast<double>();
+    const double       c = m.offsets()(j);
+
+    norms(j) = s.squaredNorm() + 2 * c * s.sum() + nrows * c * c;
+  }
+
+  return norms;
+}
+
+/// A_I^T A_J for columns I = [first_i, first_i + ni) and J = [first_j,
+/// first_j + nj) of a sparse CLR table, in full.
+static Eigen::MatrixXd
+gram_tile(const SparseClr& m,
+          Eigen::Index first_i,
+          Eigen::Index first_j,
+          Eigen::Index ni,
+          Eigen::Index nj)
+{
+  const double nrows = (double)m.rows();
+
+  const bool diagonal = first_i == first_j;
+  assert(!diagonal || ni == nj);
+
+  const SparseTableD s_i = m.sparse().middleCols(first_i, ni).cast<double>();
+
+  SparseTableD s_j_copy;
+  if (!diagonal) {
+    s_j_copy = m.sparse().middleCols(first_j, nj).cast<double>();
+  }
+  const SparseTableD& s_j = diagonal ? s_i : s_j_copy;
+
+  const Eigen::VectorXd u_i = col_sums(s_i);
+  const Eigen::VectorXd u_j = col_sums(s_j);
+  const Eigen::VectorXd c_i = m.offsets().segment(first_i, ni).cast<double>();
+  const Eigen::VectorXd c_j = m.offsets().segment(first_j, nj).cast<double>();
+
+  // A = S + 1 c^T, so
+  //   A_I^T A_J = S_I^T S_J + c_I u_J^T + u_I c_J^T + nrows c_I c_J^T
+  // with u = S^T 1 (the column sums of S).
+  Eigen::MatrixXd gram = Eigen::MatrixXd(s_i.transpose() * s_j);
+
+  gram += c_i * u_j.transpose() + u_i * c_j.transpose() + nrows * c_i * c_j.transpose();
+
+  return gram;
+}
+
+/// ||A_a - A_b||^2 of a sparse CLR table, without the Gram matrix.
+static double
+sq_dist_direct(const SparseClr& m, Eigen::Index a, Eigen::Index b)
+{
+  const double       nrows = (double)m.rows();
+  const SparseTableD s_a   = m.sparse().col(a).cast<double>();
+  const SparseTableD s_b   = m.sparse().col(b).cast<double>();
+  const double       dc    = (double)m.offsets()(a) - m.offsets()(b);
+
+  return (s_a - s_b).squaredNorm() + 2 * dc * (s_a.sum() - s_b.sum()) + nrows * dc * dc;
+}
+
+void
+distance_tile(const SparseClr& m,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out)
+{
+  const Eigen::MatrixXd gram = gram_tile(m, first_i, first_j, out.rows(), out.cols());
+
+  auto direct = [&](Eigen::Index i, Eigen::Index j) {
+    return sq_dist_direct(m, first_i + i, first_j + j);
+  };
+
+  gram_to_distance(gram, sq_norms, first_i, first_j, direct, out);
+}
+
+void
+distance_tile(const SparseClr& m,
+              const Eigen::MatrixXd& gram,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out)
+{
+  auto direct = [&](Eigen::Index i, Eigen::Index j) {
+    return sq_dist_direct(m, first_i + i, first_j + j);
+  };
+
+  gram_to_distance(gram.block(first_i, first_j, out.rows(), out.cols()),
+                   sq_norms,
+                   first_i,
+                   first_j,
+                   direct,
+                   out);
+}
+
+Eigen::VectorXd
+col_squared_norms(const ClrRowBlocks& m)
+{
+  Eigen::VectorXd norms = Eigen::VectorXd::Zero(m.cols());
+
+  for (Eigen::Index first = 0; first < m.rows(); first += m.block_rows()) {
+    const Eigen::Index    count = std::min(m.block_rows(), m.rows() - first);
+    const Eigen::MatrixXf block = m.row_block(first, count);
+
+#pragma omp parallel for schedule(static)
+    for (Eigen::Index j = 0; j < m.cols(); ++j) {
+      norms(j) += block.col(j).cast<double>().squaredNorm();
+    }
+  }
+
+  return norms;
+}
+
+/// Turns a band of the Gram matrix of a CLR table read in row blocks into
+/// distances.  Pairs that need a direct recompute get one more pass over
+/// the blocks, between them, only if there are any.
+static void
+band_to_distance(const ClrRowBlocks& m,
+                 const Eigen::Ref<const Eigen::MatrixXd>& gram,
+                 const Eigen::VectorXd& sq_norms,
+                 Eigen::Index first_i,
+                 Eigen::Index first_j,
+                 Eigen::Ref<Eigen::MatrixXf> out)
+{
+  const Eigen::Index ni = out.rows();
+  const Eigen::Index nj = out.cols();
+
+  // Columns [first_col, last_col) cover both ranges.
+  const Eigen::Index first_col = std::min(first_i, first_j);
+  const Eigen::Index last_col  = std::max(first_i + ni, first_j + nj);
+
+  // (i, j) pairs, relative to `out`, that lost too much to cancellation.
+  std::vector<std::pair<Eigen::Index, Eigen::Index>> recompute;
+
+  for (Eigen::Index j = 0; j < nj; ++j) {
+    for (Eigen::Index i = 0; i < ni; ++i) {
+      if (first_i + i == first_j + j) {
+        out(i, j) = 0;
+        continue;
+      }
+
+      const double norms   = sq_norms(first_i + i) + sq_norms(first_j + j);
+      const double sq_dist = norms - 2 * gram(i, j);
+
+      if (sq_dist < distance_recompute_ratio * norms) {
+        recompute.emplace_back(i, j);
+      }
+
+      out(i, j) = (float)std::sqrt(std::max(sq_dist, 0.0));
+    }
+  }
+
+  if (recompute.empty()) {
+    return;
+  }
+
+  std::vector<double> sq_dists(recompute.size(), 0.0);
+
+  for (Eigen::Index first = 0; first < m.rows(); first += m.block_rows()) {
+    const Eigen::Index    count = std::min(m.block_rows(), m.rows() - first);
+    const Eigen::MatrixXf block = m.block(first, count, first_col, last_col - first_col);
+
+    for (size_t k = 0; k < recompute.size(); ++k) {
+      const Eigen::Index i = first_i - first_col + recompute[k].first;
+      const Eigen::Index j = first_j - first_col + recompute[k].second;
+
+      sq_dists[k] += (block.col(i).cast<double>() - block.col(j).cast<double>()).squaredNorm();
+    }
+  }
+
+  for (size_t k = 0; k < recompute.size(); ++k) {
+    out(recompute[k].first, recompute[k].second) = (float)std::sqrt(sq_dists[k]);
+  }
+}
+
+void
+distance_band(const ClrRowBlocks& m,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out)
 {
-  return sqrtf((v1 - v2).array().pow(2).sum());
+  const Eigen::Index ni = out.rows();
+  const Eigen::Index nj = out.cols();
+
+  // Columns [first_col, last_col) cover both ranges.
+  const Eigen::Index first_col = std::min(first_i, first_j);
+  const Eigen::Index last_col  = std::max(first_i + ni, first_j + nj);
+
+  Eigen::MatrixXd gram = Eigen::MatrixXd::Zero(ni, nj);
+
+  for (Eigen::Index first = 0; first < m.rows(); first += m.block_rows()) {
+    const Eigen::Index    count = std::min(m.block_rows(), m.rows() - first);
+    const Eigen::MatrixXd block = m.block(first, count, first_col, last_col - first_col).cast<double>();
+
+    // Split by fixed column pieces, so the sums don't depend on the number
+    // of threads.
+    const Eigen::Index num_pieces = (nj + distance_band_piece_cols - 1) / distance_band_piece_cols;
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (Eigen::Index p = 0; p < num_pieces; ++p) {
+      const Eigen::Index first_piece = p * distance_band_piece_cols;
+      const Eigen::Index piece_cols  = std::min(distance_band_piece_cols, nj - first_piece);
+
+      gram.middleCols(first_piece, piece_cols).noalias()
+        += block.middleCols(first_i - first_col, ni).transpose()
+           * block.middleCols(first_j - first_col + first_piece, piece_cols);
+    }
+  }
+
+  band_to_distance(m, gram, sq_norms, first_i, first_j, out);
+}
+
+void
+distance_band(const ClrRowBlocks& m,
+              const Eigen::MatrixXd& gram,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out)
+{
+  band_to_distance(m,
+                   gram.block(first_i, first_j, out.rows(), out.cols()),
+                   sq_norms,
+                   first_i,
+                   first_j,
+                   out);
+}
+
+/// (first_i, first_j) of each distance_tile_cols tile on or above the
+/// diagonal of an n x n matrix.
+static std::vector<std::pair<Eigen::Index, Eigen::Index>>
+upper_tiles(Eigen::Index n)
+{
+  std::vector<std::pair<Eigen::Index, Eigen::Index>> tiles;
+  for (Eigen::Index j = 0; j < n; j += distance_tile_cols) {
+    for (Eigen::Index i = 0; i <= j; i += distance_tile_cols) {
+      tiles.emplace_back(i, j);
+    }
+  }
+
+  return tiles;
+}
+
+/// Upper triangle tiles only; each is mirrored into the lower triangle.
+template <typename Matrix>
+static Eigen::MatrixXf
+tiled_colwise_distance(const Matrix& m)
+{
+  const Eigen::Index n = m.cols();
+
+  Eigen::MatrixXf d(n, n);
+
+  const Eigen::VectorXd sq_norms = col_squared_norms(m);
+
+  const std::vector<std::pair<Eigen::Index, Eigen::Index>> tiles = upper_tiles(n);
+
+  const long num_tiles = (long)tiles.size();
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long t = 0; t < num_tiles; ++t) {
+    const Eigen::Index i  = tiles[t].first;
+    const Eigen::Index j  = tiles[t].second;
+    const Eigen::Index ni = std::min(distance_tile_cols, n - i);
+    const Eigen::Index nj = std::min(distance_tile_cols, n - j);
+
+    distance_tile(m, sq_norms, i, j, d.block(i, j, ni, nj));
+
+    if (i != j) {
+      d.block(j, i, nj, ni) = d.block(i, j, ni, nj).transpose();
+    }
+  }
+
+  return d;
 }
 
 /// @brief All v. all symmetric distance by columns
 /// @param m matrix
 /// @return a m.cols() by m.cols() matrix with distances
 Eigen::MatrixXf
-colwise_distance(const Eigen::MatrixXf& m)
+colwise_distance(const Eigen::Ref<const Eigen::MatrixXf>& m)
 {
-  Eigen::MatrixXf d(m.cols(), m.cols());
+  return tiled_colwise_distance(DenseClr<SinglePrecision>(m));
+}
 
-  // All distances default to zero.
-  d.setZero();
+Eigen::MatrixXf
+colwise_distance(const SparseClr& m)
+{
+  return tiled_colwise_distance(m);
+}
+
+/// Upper triangle tiles, each a separate task, so the sums don't depend on
+/// the number of threads; then mirrored.
+template <typename Matrix>
+static Eigen::MatrixXd
+tiled_gram_matrix(const Matrix& m)
+{
+  const Eigen::Index n = m.cols();
 
-  for (int i = 0; i < m.cols() - 1; ++i) {
-    for (int j = i + 1; j < m.cols(); ++j) {
-      float dist = distance(m.col(i), m.col(j));
+  Eigen::MatrixXd gram = Eigen::MatrixXd::Zero(n, n);
 
-      d(i, j) = dist;
-      d(j, i) = dist;
+  const std::vector<std::pair<Eigen::Index, Eigen::Index>> tiles = upper_tiles(n);
+
+  const long num_tiles = (long)tiles.size();
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long t = 0; t < num_tiles; ++t) {
+    const Eigen::Index i  = tiles[t].first;
+    const Eigen::Index j  = tiles[t].second;
+    const Eigen::Index ni = std::min(distance_tile_cols, n - i);
+    const Eigen::Index nj = std::min(distance_tile_cols, n - j);
+
+    gram.block(i, j, ni, nj) = gram_tile(m, i, j, ni, nj);
+  }
+
+  gram.triangularView<Eigen::StrictlyLower>() = gram.transpose();
+
+  return gram;
+}
+
+Eigen::MatrixXd
+gram_matrix(const Eigen::Ref<const Eigen::MatrixXf>& m)
+{
+  return tiled_gram_matrix(DenseClr<SinglePrecision>(m));
+}
+
+template <typename Policy>
+Eigen::MatrixXd
+gram_matrix(const DenseClr<Policy>& m)
+{
+  return tiled_gram_matrix(m);
+}
+
+Eigen::MatrixXd
+gram_matrix(const SparseClr& m)
+{
+  return tiled_gram_matrix(m);
+}
+
+Eigen::MatrixXd
+gram_matrix(const ClrRowBlocks& m)
+{
+  const Eigen::Index n = m.cols();
+
+  Eigen::MatrixXd gram = Eigen::MatrixXd::Zero(n, n);
+
+  const std::vector<std::pair<Eigen::Index, Eigen::Index>> tiles = upper_tiles(n);
+
+  const long num_tiles = (long)tiles.size();
+
+  for (Eigen::Index first = 0; first < m.rows(); first += m.block_rows()) {
+    const Eigen::Index    count = std::min(m.block_rows(), m.rows() - first);
+    const Eigen::MatrixXf block = m.row_block(first, count);
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (long t = 0; t < num_tiles; ++t) {
+      const Eigen::Index i  = tiles[t].first;
+      const Eigen::Index j  = tiles[t].second;
+      const Eigen::Index ni = std::min(distance_tile_cols, n - i);
+      const Eigen::Index nj = std::min(distance_tile_cols, n - j);
+
+      gram.block(i, j, ni, nj) += gram_tile(DenseClr<SinglePrecision>(block), i, j, ni, nj);
     }
   }
 
-  return d;
+  gram.triangularView<Eigen::StrictlyLower>() = gram.transpose();
+
+  return gram;
 }
+
+#define INSTANTIATE_MAT(Policy)                                                                   \
+  template Eigen::MatrixXf row_block(const DenseClr<Policy>&, Eigen::Index, Eigen::Index);       \
+  template Eigen::VectorXd col_squared_norms(const DenseClr<Policy>&);                           \
+  template void distance_tile(const DenseClr<Policy>&,                                           \
+                              const Eigen::VectorXd&,                                            \
+                              Eigen::Index,                                                      \
+                              Eigen::Index,                                                      \
+                              Eigen::Ref<Eigen::MatrixXf>);                                      \
+  template void distance_tile(const DenseClr<Policy>&,                                           \
+                              const Eigen::MatrixXd&,                                            \
+                              const Eigen::VectorXd&,                                            \
+                              Eigen::Index,                                                      \
+                              Eigen::Index,                                                      \
+                              Eigen::Ref<Eigen::MatrixXf>);                                      \
+  template Eigen::MatrixXd gram_matrix(const DenseClr<Policy>&);
+
+CODA_FOR_EACH_PRECISION(INSTANTIATE_MAT)
@@ -3,27 +3,204 @@
 
 #include <Eigen/Dense>
 
-/// Output format for vector
-#define coeff_separator "\t"
-#define row_separator "\n"
-
-const Eigen::IOFormat TSVFormat(Eigen::StreamPrecision,
-                                Eigen::DontAlignCols,
-                                coeff_separator,
-                                row_separator);
+#include "clr_blocks.h"
+#include "dense_clr.h"
+#include "sparse_clr.h"
 
+void
+clr_in_place(Eigen::Ref<Eigen::MatrixXf> otu_table);
 
+/// Same as above, but with the sum of logs down each column already known
+/// (e.g. accumulated while reading the table).
 void
-clr_in_place(Eigen::MatrixXf& otu_table);
+clr_in_place(Eigen::Ref<Eigen::MatrixXf> otu_table, const Eigen::VectorXd& col_log_sums);
+
+/// Rows [first, first + count) of a CLR table, whichever kind it is.
+Eigen::MatrixXf
+row_block(const Eigen::Ref<const Eigen::MatrixXf>& clr, Eigen::Index first, Eigen::Index count);
+
+Eigen::MatrixXf
+row_block(const SparseClr& clr, Eigen::Index first, Eigen::Index count);
+
+Eigen::MatrixXf
+row_block(const ClrRowBlocks& clr, Eigen::Index first, Eigen::Index count);
+
+/// Converted to float for output.
+template <typename Policy>
+Eigen::MatrixXf
+row_block(const DenseClr<Policy>& clr, Eigen::Index first, Eigen::Index count);
+
+/// Bytes one pass over the CLR table reads: the table itself, or out of core,
+/// the counts on disk.
+template <typename Policy>
+double
+table_bytes(const DenseClr<Policy>& clr)
+{
+  return (double)sizeof(typename Policy::Storage) * clr.rows() * clr.cols();
+}
+
+double
+table_bytes(const SparseClr& clr);
+
+double
+table_bytes(const ClrRowBlocks& clr);
+
+/// Columns per side of a distance tile.
+#define distance_tile_cols ((Eigen::Index)256)
+
+/// Rows cast to double at a time while accumulating a distance tile.
+#define distance_panel_rows ((Eigen::Index)4096)
+
+/// Gram columns per parallel piece of an out-of-core distance band.
+#define distance_band_piece_cols ((Eigen::Index)64)
+
+/// A squared distance from the Gram matrix below this fraction of the two
+/// squared norms has lost too much to cancellation and is recomputed
+/// directly.
+#define distance_recompute_ratio 1e-6
 
 float
-distance(const Eigen::VectorXf& v1, const Eigen::VectorXf& v2);
+distance(const Eigen::Ref<const Eigen::VectorXf>& v1, const Eigen::Ref<const Eigen::VectorXf>& v2);
+
+/// Squared norm of each column, in double.
+Eigen::VectorXd
+col_squared_norms(const Eigen::Ref<const Eigen::MatrixXf>& m);
+
+/// @brief Distances between columns [first_i, first_i + out.rows()) and
+/// [first_j, first_j + out.cols()) of m.
+///
+/// Uses ||a - b||^2 = ||a||^2 + ||b||^2 - 2 a^T b, with the a^T b block
+/// from a GEMM (or a SYRK when the two ranges are the same) accumulated in
+/// double over row panels.  Pairs that are nearly identical are recomputed
+/// directly, see `distance_recompute_ratio`.
+///
+/// @param sq_norms col_squared_norms(m)
+void
+distance_tile(const Eigen::Ref<const Eigen::MatrixXf>& m,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out);
+
+/// Same as the two above for a dense CLR table in any precision.  The Ref
+/// versions are these with SinglePrecision.
+template <typename Policy>
+Eigen::VectorXd
+col_squared_norms(const DenseClr<Policy>& m);
+
+template <typename Policy>
+void
+distance_tile(const DenseClr<Policy>& m,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out);
 
 /// Gives a 1D column major index given the row index and column index.
 size_t
 col_major_index(const size_t nrows, const size_t ridx, const size_t cidx);
 
+/// Squared norm of each column of a sparse CLR table, in double.
+Eigen::VectorXd
+col_squared_norms(const SparseClr& m);
+
+/// @brief Same as above, for a sparse CLR table, without densifying it.
+///
+/// The Gram block comes from S_I^T S_J and the column offsets, all in
+/// double.
+void
+distance_tile(const SparseClr& m,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out);
+
+/// Squared norm of each column of a CLR table read in row blocks, in double.
+/// One pass over the blocks.
+Eigen::VectorXd
+col_squared_norms(const ClrRowBlocks& m);
+
+/// @brief Distances between columns [first_i, first_i + out.rows()) and
+/// [first_j, first_j + out.cols()) of a CLR table read in row blocks.
+///
+/// Where distance_tile() is for small tiles, this is for whole bands: the
+/// Gram block is accumulated in double over one pass of the blocks, so the
+/// bigger `out` is, the fewer passes it takes to get every distance.  Pairs
+/// that need a direct recompute (see `distance_recompute_ratio`) get one
+/// more pass between them, only if there are any.
+void
+distance_band(const ClrRowBlocks& m,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out);
+
+/// @brief The n x n Gram matrix C^T C of a CLR table, in double.
+///
+/// Accumulated like distance_tile() does, in tiles on or above the
+/// diagonal, in parallel, then mirrored.  Out of core, that takes one pass
+/// over the row blocks.  The Gram matrix is all the distances and the
+/// sample PCA (gram_pca()) need, so with it neither has to read the table
+/// again, apart from the rare direct recompute.
+Eigen::MatrixXd
+gram_matrix(const Eigen::Ref<const Eigen::MatrixXf>& m);
+
+template <typename Policy>
+Eigen::MatrixXd
+gram_matrix(const DenseClr<Policy>& m);
+
+Eigen::MatrixXd
+gram_matrix(const SparseClr& m);
+
+Eigen::MatrixXd
+gram_matrix(const ClrRowBlocks& m);
+
+/// Same as distance_tile() above, with the Gram block taken from `gram`
+/// (gram_matrix(m)) instead of computed, and `sq_norms` its diagonal.
+void
+distance_tile(const Eigen::Ref<const Eigen::MatrixXf>& m,
+              const Eigen::MatrixXd& gram,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out);
+
+template <typename Policy>
+void
+distance_tile(const DenseClr<Policy>& m,
+              const Eigen::MatrixXd& gram,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out);
+
+void
+distance_tile(const SparseClr& m,
+              const Eigen::MatrixXd& gram,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out);
+
+/// Same as distance_band() above, with the Gram band taken from `gram`.  It
+/// only reads the table if a pair needs a direct recompute.
+void
+distance_band(const ClrRowBlocks& m,
+              const Eigen::MatrixXd& gram,
+              const Eigen::VectorXd& sq_norms,
+              Eigen::Index first_i,
+              Eigen::Index first_j,
+              Eigen::Ref<Eigen::MatrixXf> out);
+
+/// @brief All v. all symmetric distance by columns
+///
+/// Works through the upper triangle in distance_tile() sized tiles, in
+/// parallel, and mirrors each into the lower triangle.  This holds the full
+/// n x n result; see write_distances() for output that doesn't.
+Eigen::MatrixXf
+colwise_distance(const Eigen::Ref<const Eigen::MatrixXf>& m);
+
 Eigen::MatrixXf
-colwise_distance(const Eigen::MatrixXf& m);
+colwise_distance(const SparseClr& m);
 
 #endif //CODA_MAT_H
@@ -0,0 +1,121 @@
+#include "name_table.h"
+
+#include <cstring>
+#include <functional>
+
+using namespace std;
+
+/// Arena block size.  Names longer than this get a block to themselves.
+#define arena_block_bytes ((size_t)1 << 20)
+
+#define initial_slots 1024
+
+static uint64_t
+hash_name(string_view name)
+{
+  return hash<string_view>{}(name);
+}
+
+NameTable::NameTable()
+  : block_size_(0),
+    block_used_(0),
+    arena_bytes_(0),
+    slots_(initial_slots, Slot{ 0, npos })
+{}
+
+size_t
+NameTable::intern(string_view name)
+{
+  const uint64_t hash = hash_name(name);
+  const size_t   mask = slots_.size() - 1;
+
+  size_t i = hash & mask;
+  while (slots_[i].index != npos) {
+    if (slots_[i].hash == hash && names_[slots_[i].index] == name) {
+      return slots_[i].index;
+    }
+
+    i = (i + 1) & mask;
+  }
+
+  const size_t index = names_.size();
+
+  names_.push_back(store(name));
+  slots_[i] = Slot{ hash, index };
+
+  if (names_.size() * 2 > slots_.size()) {
+    grow();
+  }
+
+  return index;
+}
+
+size_t
+NameTable::find(string_view name) const
+{
+  const uint64_t hash = hash_name(name);
+  const size_t   mask = slots_.size() - 1;
+
+  size_t i = hash & mask;
+  while (slots_[i].index != npos) {
+    if (slots_[i].hash == hash && names_[slots_[i].index] == name) {
+      return slots_[i].index;
+    }
+
+    i = (i + 1) & mask;
+  }
+
+  return npos;
+}
+
+size_t
+NameTable::memory_usage() const
+{
+  return arena_bytes_
+         + names_.capacity() * sizeof(string_view)
+         + slots_.capacity() * sizeof(Slot);
+}
+
+string_view
+NameTable::store(string_view name)
+{
+  if (name.empty()) {
+    return string_view();
+  }
+
+  if (block_used_ + name.size() > block_size_) {
+    size_t size = name.size() > arena_block_bytes ? name.size() : arena_block_bytes;
+
+    blocks_.push_back(make_unique<char[]>(size));
+    block_size_  = size;
+    block_used_  = 0;
+    arena_bytes_ += size;
+  }
+
+  char* dst = blocks_.back().get() + block_used_;
+  memcpy(dst, name.data(), name.size());
+  block_used_ += name.size();
+
+  return string_view(dst, name.size());
+}
+
+void
+NameTable::grow()
+{
+  vector<Slot> slots(slots_.size() * 2, Slot{ 0, npos });
+  const size_t mask = slots.size() - 1;
+
+  for (const auto& slot : slots_) {
+    if (slot.index == npos) {
+      continue;
+    }
+
+    size_t i = slot.hash & mask;
+    while (slots[i].index != npos) {
+      i = (i + 1) & mask;
+    }
+    slots[i] = slot;
+  }
+
+  slots_.swap(slots);
+}
@@ -0,0 +1,74 @@
+#ifndef CODA_NAME_TABLE_H
+#define CODA_NAME_TABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/// Interned sample or OTU names.
+///
+/// Each distinct name is copied once into an arena and numbered in order of
+/// first appearance.  Lookups go through an open addressing (linear probing)
+/// hash table keyed on string_view, so checking a name never builds a
+/// std::string.  Views returned by `name()` stay valid for the life of the
+/// table.
+class NameTable
+{
+public:
+  static constexpr size_t npos = SIZE_MAX;
+
+  NameTable();
+
+  NameTable(NameTable&&) = default;
+  NameTable& operator=(NameTable&&) = default;
+
+  /// Index of `name`, adding it as the next index if it is new.
+  size_t
+  intern(std::string_view name);
+
+  /// Index of `name`, or `npos` if it isn't in the table.
+  size_t
+  find(std::string_view name) const;
+
+  /// Name for the given index.
+  std::string_view
+  name(size_t index) const
+  { return names_[index]; }
+
+  size_t
+  size() const
+  { return names_.size(); }
+
+  /// Bytes held by the arena, the index and the hash slots.
+  size_t
+  memory_usage() const;
+
+private:
+  typedef struct Slot
+  {
+    uint64_t hash;
+    // npos marks an empty slot.
+    size_t   index;
+  } Slot;
+
+  std::string_view
+  store(std::string_view name);
+
+  void
+  grow();
+
+  // Arena of name bytes.  Blocks never move, so views into them are stable.
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  size_t block_size_;
+  size_t block_used_;
+  size_t arena_bytes_;
+
+  // index -> name
+  std::vector<std::string_view> names_;
+
+  // Power of two sized, kept at most half full.
+  std::vector<Slot> slots_;
+};
+
+#endif //CODA_NAME_TABLE_H
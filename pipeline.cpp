@@ -0,0 +1,372 @@
+#include "pipeline.h"
+
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "dense_clr.h"
+#include "mat.h"
+#include "tsv_writer.h"
+
+using namespace std;
+
+Pipeline::Pipeline(const PipelineOptions& options)
+  : options_(options),
+    have_gram_(false)
+{
+  counts_.is_sparse   = false;
+  counts_.table       = nullptr;
+  counts_.zero_counts = 0;
+}
+
+Pipeline::~Pipeline() = default;
+
+template <typename F>
+void
+Pipeline::visit_clr(F&& f) const
+{
+  if (blocks_) {
+    f(*blocks_);
+  }
+  else if (sparse_) {
+    f(*sparse_);
+  }
+  else {
+    switch (options_.precision) {
+      case Precision::f64:
+        f(DenseClr<DoublePrecision>(clr_f64_));
+        break;
+      case Precision::bf16:
+        f(DenseClr<Bf16Storage>(clr_bf16_));
+        break;
+      case Precision::f16:
+        f(DenseClr<Fp16Storage>(clr_f16_));
+        break;
+      case Precision::f32:
+      default:
+        f(DenseClr<SinglePrecision>(Eigen::Map<const Eigen::MatrixXf>(counts_.table, otus(), samples())));
+        break;
+    }
+  }
+}
+
+void
+Pipeline::make_clr()
+{
+  sparse_.reset();
+  blocks_.reset();
+  clr_f64_.resize(0, 0);
+  clr_bf16_.resize(0, 0);
+  clr_f16_.resize(0, 0);
+  have_gram_ = false;
+  gram_.resize(0, 0);
+  sketch_.reset();
+
+  const bool f32 = options_.precision == Precision::f32;
+
+  if (counts_.is_sparse && (!f32 || options_.out_of_core)) {
+    throw runtime_error("a sparse table only works in f32 and in memory");
+  }
+  if (options_.out_of_core && !f32) {
+    throw runtime_error("out of core only works in f32");
+  }
+
+  if (options_.out_of_core) {
+    blocks_ = make_unique<ClrRowBlocks>(counts_);
+  }
+  else if (counts_.is_sparse) {
+    sparse_ = make_unique<SparseClr>(counts_);
+  }
+  else if (f32) {
+    clr_in_place(counts_table(counts_), counts_.col_log_sums);
+  }
+  else {
+    switch (options_.precision) {
+      case Precision::f64:
+        clr_f64_ = clr_table<DoublePrecision>(counts_);
+        break;
+      case Precision::bf16:
+        clr_bf16_ = clr_table<Bf16Storage>(counts_);
+        break;
+      case Precision::f16:
+      default:
+        clr_f16_ = clr_table<Fp16Storage>(counts_);
+        break;
+    }
+
+    // The counts aren't needed any more.
+    if (counts_.table == counts_.storage.data()) {
+      counts_.table = nullptr;
+    }
+    counts_.storage = Eigen::MatrixXf();
+  }
+}
+
+void
+Pipeline::set_counts(Counts&& counts)
+{
+  counts_ = std::move(counts);
+
+  make_clr();
+}
+
+void
+Pipeline::set_counts(const std::vector<Element>& elements, size_t num_otus, size_t num_samples)
+{
+  // Only f32 has a sparse CLR table.
+  set_counts(counts_from_elements(elements,
+                                  num_otus,
+                                  num_samples,
+                                  options_.precision == Precision::f32 && !options_.out_of_core
+                                  ? TableLayout::automatic
+                                  : TableLayout::dense));
+}
+
+void
+Pipeline::set_counts(const Eigen::Ref<const Eigen::MatrixXf>& counts)
+{
+  set_counts(counts_from_table(counts));
+}
+
+void
+Pipeline::set_counts(const SparseTable& counts)
+{
+  set_counts(counts_from_sparse(counts));
+}
+
+void
+Pipeline::set_counts_in_place(Eigen::Map<Eigen::MatrixXf> counts)
+{
+  if (options_.precision != Precision::f32) {
+    throw runtime_error("the CLR table can only be computed in place in f32");
+  }
+
+  set_counts(counts_from_table_in_place(counts));
+}
+
+const char*
+Pipeline::clr_layout() const
+{
+  return blocks_ ? "out of core" : sparse_ ? "sparse" : "dense";
+}
+
+double
+Pipeline::clr_bytes() const
+{
+  double bytes = 0;
+
+  visit_clr([&](const auto& clr) { bytes = table_bytes(clr); });
+
+  return bytes;
+}
+
+Eigen::MatrixXf
+Pipeline::clr_rows(Eigen::Index first, Eigen::Index count) const
+{
+  Eigen::MatrixXf rows;
+
+  visit_clr([&](const auto& clr) { rows = row_block(clr, first, count); });
+
+  return rows;
+}
+
+Eigen::MatrixXf
+Pipeline::clr() const
+{
+  Eigen::MatrixXf out(otus(), samples());
+
+  clr(out);
+
+  return out;
+}
+
+void
+Pipeline::clr(Eigen::Ref<Eigen::MatrixXf> out) const
+{
+  assert(out.rows() == otus() && out.cols() == samples());
+
+  visit_clr([&](const auto& clr) {
+    for (Eigen::Index first = 0; first < clr.rows(); first += output_block_rows) {
+      const Eigen::Index count = min(output_block_rows, clr.rows() - first);
+
+      out.middleRows(first, count) = row_block(clr, first, count);
+    }
+  });
+}
+
+bool
+uses_gram(const PipelineOptions& options, Eigen::Index samples)
+{
+  return options.gram == GramMode::always
+         || (options.gram == GramMode::automatic
+             && options.pca_method != PcaMethod::single_pass
+             && samples <= gram_max_samples);
+}
+
+PcaTarget
+pca_target(const PipelineOptions& options, Eigen::Index samples)
+{
+  PcaTarget target = options.pca;
+  if (target.rank == 0 && target.variance == 0) {
+    target.rank = samples;
+  }
+
+  return target;
+}
+
+bool
+Pipeline::uses_gram() const
+{
+  return ::uses_gram(options_, samples());
+}
+
+const Eigen::MatrixXd&
+Pipeline::gram()
+{
+  assert(uses_gram());
+
+  if (!have_gram_) {
+    visit_clr([&](const auto& clr) { gram_ = gram_matrix(clr); });
+
+    have_gram_ = true;
+  }
+
+  return gram_;
+}
+
+bool
+Pipeline::sketches() const
+{
+  return options_.sketch_dim > 0 || options_.sketch_eps > 0;
+}
+
+Eigen::Index
+Pipeline::sketch_dim() const
+{
+  assert(sketches());
+
+  return options_.sketch_dim > 0 ? options_.sketch_dim : jl_dimension(samples(), options_.sketch_eps);
+}
+
+const JlSketch&
+Pipeline::sketch()
+{
+  assert(sketches());
+
+  if (!sketch_) {
+    const Eigen::Index dim = sketch_dim();
+
+    visit_clr([&](const auto& clr) { sketch_ = make_unique<JlSketch>(jl_sketch(clr, dim, options_.seed)); });
+  }
+
+  return *sketch_;
+}
+
+Eigen::MatrixXf
+Pipeline::distances()
+{
+  Eigen::MatrixXf out(samples(), samples());
+
+  distances(out);
+
+  return out;
+}
+
+void
+Pipeline::distances(Eigen::Ref<Eigen::MatrixXf> out)
+{
+  if (sketches()) {
+    distance_matrix(sketch().sketch, out, options_.tile_cols);
+    return;
+  }
+
+  const Eigen::MatrixXd* gram_ptr = uses_gram() ? &gram() : nullptr;
+
+  visit_clr([&](const auto& clr) { distance_matrix(clr, out, options_.tile_cols, gram_ptr); });
+}
+
+NearestNeighbours
+Pipeline::neighbours(Eigen::Index k)
+{
+  if (sketches()) {
+    return nearest_neighbours(sketch().sketch, k, options_.tile_cols);
+  }
+
+  const Eigen::MatrixXd* gram_ptr = uses_gram() ? &gram() : nullptr;
+
+  NearestNeighbours out;
+
+  visit_clr([&](const auto& clr) { out = nearest_neighbours(clr, k, options_.tile_cols, gram_ptr); });
+
+  return out;
+}
+
+SamplePca
+Pipeline::pca()
+{
+  const PcaTarget target = pca_target(options_, samples());
+
+  if (uses_gram()) {
+    return gram_pca(gram(), target);
+  }
+
+  // Out of core, only the Gram path can grow the PCA to a variance target.
+  if (blocks_ && target.variance > 0) {
+    throw runtime_error("a variance target out of core needs the Gram matrix");
+  }
+
+  Rsvd::PhiloxEngine random_engine{};
+  random_engine.seed(options_.seed);
+
+  SamplePca pca;
+
+  visit_clr([&](const auto& clr) { pca = sample_pca(random_engine, clr, target, options_.pca_method); });
+
+  return pca;
+}
+
+void
+Pipeline::write_clr(const string& fname, AsyncWriter* async) const
+{
+  TsvWriter out(fname, async);
+
+  out.write_header("otu", counts_.samples);
+
+  visit_clr([&](const auto& clr) {
+    for (Eigen::Index first = 0; first < clr.rows(); first += output_block_rows) {
+      const Eigen::Index count = min(output_block_rows, clr.rows() - first);
+
+      out.write_rows(counts_.otus, first, row_block(clr, first, count));
+    }
+  });
+
+  out.close();
+}
+
+void
+Pipeline::write_distances(const string& fname, DistanceLayout layout, AsyncWriter* async)
+{
+  if (sketches()) {
+    ::write_distances(fname, sketch().sketch, counts_.samples, layout, options_.tile_cols, async);
+    return;
+  }
+
+  const Eigen::MatrixXd* gram_ptr = uses_gram() ? &gram() : nullptr;
+
+  visit_clr([&](const auto& clr) {
+    ::write_distances(fname, clr, counts_.samples, layout, options_.tile_cols, async, gram_ptr);
+  });
+}
+
+void
+Pipeline::write_neighbours(const string& fname, Eigen::Index k, AsyncWriter* async)
+{
+  ::write_neighbours(fname, neighbours(k), counts_.samples, async);
+}
+
+void
+Pipeline::write_projection(const string& fname, const SamplePca& pca, AsyncWriter* async) const
+{
+  ::write_projection(fname, counts_.samples, pca.projection, async);
+}
@@ -0,0 +1,248 @@
+#ifndef CODA_PIPELINE_H
+#define CODA_PIPELINE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "async_writer.h"
+#include "clr_blocks.h"
+#include "element.h"
+#include "ingest.h"
+#include "jl_sketch.h"
+#include "precision.h"
+#include "rsvd.h"
+#include "sparse_clr.h"
+#include "tiled_distance.h"
+
+/// Most samples for which `GramMode::automatic` uses the Gram matrix (n^2
+/// doubles, 128 MiB at this size).
+#define gram_max_samples ((Eigen::Index)4096)
+
+/// Rows of the CLR table handed to the writer, or copied out, at a time.
+#define output_block_rows ((Eigen::Index)1024)
+
+/// Whether to compute the Gram matrix once and get both the distances and
+/// the PCA from it.
+enum class GramMode
+{
+  // When there are at most gram_max_samples samples and the PCA isn't
+  // single pass.
+  automatic,
+  always,
+  never,
+};
+
+/// What the `coda` command line sets.
+typedef struct PipelineOptions
+{
+  int seed = 0;
+
+  // Rank 0 and variance 0 keep every component.
+  PcaTarget pca        = { 0, 0 };
+  PcaMethod pca_method = PcaMethod::subspace_iteration;
+  GramMode  gram       = GramMode::automatic;
+
+  // Samples per distance tile and band.
+  Eigen::Index tile_cols = distance_tile_cols;
+
+  // Anything but f32 needs a dense table.
+  Precision precision = Precision::f32;
+
+  // Compute the CLR a block of rows at a time from a dense table that is
+  // never changed (see ClrRowBlocks).  f32 only.
+  bool out_of_core = false;
+
+  // Approximate the distances from a sketch of the CLR table with this many
+  // dimensions (see jl_sketch()), or with jl_dimension() of them for
+  // distortion `sketch_eps`.  Both 0: exact distances.
+  Eigen::Index sketch_dim = 0;
+  double       sketch_eps = 0;
+} PipelineOptions;
+
+/// Whether the distances and PCA of `samples` samples come from the Gram
+/// matrix under `options`.
+bool
+uses_gram(const PipelineOptions& options, Eigen::Index samples);
+
+/// options.pca, with rank 0 and variance 0 meaning every component.
+PcaTarget
+pca_target(const PipelineOptions& options, Eigen::Index samples);
+
+/// @brief CLR transformation, Aitchison distances and sample PCA, from
+/// counts in memory to Eigen objects, for embedding coda in a program.
+///
+/// Give it counts with one of the set_counts() calls, which computes the CLR
+/// table, then ask for the outputs.  The Gram matrix, when the options call
+/// for it, is computed the first time the distances or the PCA need it and
+/// kept for the other.  With a sketch in the options, the distances come
+/// from it instead.  The `coda` command line is this plus reading and
+/// writing files.
+///
+/// Nothing is copied that needn't be: set_counts(Counts&&) takes the table
+/// over, set_counts_in_place() turns the caller's table into the CLR table,
+/// and the outputs can go straight into caller buffers.
+class Pipeline
+{
+public:
+  explicit Pipeline(const PipelineOptions& options = PipelineOptions());
+  ~Pipeline();
+
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  /// @brief Takes over counts from read_counts(), read_binary_table() or
+  /// the counts_from_*() functions in ingest.h, and computes the CLR table.
+  ///
+  /// Throws std::runtime_error if the options don't fit the table (a sparse
+  /// table in anything but f32, say).
+  void
+  set_counts(Counts&& counts);
+
+  /// One Element per filled cell; see counts_from_elements().
+  void
+  set_counts(const std::vector<Element>& elements, size_t num_otus, size_t num_samples);
+
+  /// Dense OTUs x samples normalized counts, copied; see counts_from_table().
+  void
+  set_counts(const Eigen::Ref<const Eigen::MatrixXf>& counts);
+
+  /// Sparse normalized counts, copied; see counts_from_sparse().
+  void
+  set_counts(const SparseTable& counts);
+
+  /// @brief Dense normalized counts that become the CLR table in place, with
+  /// no copy.  f32 only.  `counts` must outlive the pipeline.
+  void
+  set_counts_in_place(Eigen::Map<Eigen::MatrixXf> counts);
+
+  /// The counts as given, with names; the table itself may be the CLR
+  /// table by now.
+  const Counts&
+  counts() const
+  { return counts_; }
+
+  Eigen::Index
+  otus() const
+  { return (Eigen::Index)counts_.otus.size(); }
+
+  Eigen::Index
+  samples() const
+  { return (Eigen::Index)counts_.samples.size(); }
+
+  /// "dense", "sparse" or "out of core".
+  const char*
+  clr_layout() const;
+
+  /// Bytes one pass over the CLR table reads (see table_bytes()).
+  double
+  clr_bytes() const;
+
+  /// Rows [first, first + count) of the CLR table.
+  Eigen::MatrixXf
+  clr_rows(Eigen::Index first, Eigen::Index count) const;
+
+  /// The OTUs x samples CLR table, converted to f32 if need be.
+  Eigen::MatrixXf
+  clr() const;
+
+  /// Same as above into `out`, which must be OTUs x samples.
+  void
+  clr(Eigen::Ref<Eigen::MatrixXf> out) const;
+
+  /// Whether the distances and PCA come from the Gram matrix.
+  bool
+  uses_gram() const;
+
+  /// The samples x samples Gram matrix, computed on the first call.  Only
+  /// when uses_gram().
+  const Eigen::MatrixXd&
+  gram();
+
+  /// Whether the distances are approximated from a sketch.
+  bool
+  sketches() const;
+
+  /// Dimensions of the sketch, from the options.  Only when sketches().
+  Eigen::Index
+  sketch_dim() const;
+
+  /// The sketch of the CLR table (see jl_sketch()), computed on the first
+  /// call with the options' seed.  Only when sketches().
+  const JlSketch&
+  sketch();
+
+  /// The samples x samples Aitchison distance matrix, or its approximation
+  /// from the sketch.
+  Eigen::MatrixXf
+  distances();
+
+  /// Same as above into `out`, which must be samples x samples.
+  void
+  distances(Eigen::Ref<Eigen::MatrixXf> out);
+
+  /// Each sample's k nearest other samples, without the distance matrix
+  /// (see nearest_neighbours()).
+  NearestNeighbours
+  neighbours(Eigen::Index k);
+
+  /// The sample projection and the variance each component explains.
+  SamplePca
+  pca();
+
+  /// The CLR table as TSV, OTUs down and samples across.
+  ///
+  /// Throws std::runtime_error if the file can't be written.
+  void
+  write_clr(const std::string& fname, AsyncWriter* async = nullptr) const;
+
+  /// The distances as TSV, a band at a time (see write_distances()).
+  ///
+  /// Throws std::runtime_error if the file can't be written.
+  void
+  write_distances(const std::string& fname, DistanceLayout layout, AsyncWriter* async = nullptr);
+
+  /// neighbours(k) as TSV (see write_neighbours()).
+  ///
+  /// Throws std::runtime_error if the file can't be written.
+  void
+  write_neighbours(const std::string& fname, Eigen::Index k, AsyncWriter* async = nullptr);
+
+  /// `pca`'s projection as TSV, samples down and components across.
+  ///
+  /// Throws std::runtime_error if the file can't be written.
+  void
+  write_projection(const std::string& fname, const SamplePca& pca, AsyncWriter* async = nullptr) const;
+
+private:
+  /// Calls `f` with the CLR table: a DenseClr, SparseClr or ClrRowBlocks.
+  template <typename F>
+  void
+  visit_clr(F&& f) const;
+
+  /// Computes the CLR table from counts_.
+  void
+  make_clr();
+
+  PipelineOptions options_;
+
+  Counts counts_;
+
+  // At most one of these is set.  An f32 dense CLR table is counts_'s
+  // table, transformed in place.
+  std::unique_ptr<SparseClr>    sparse_;
+  std::unique_ptr<ClrRowBlocks> blocks_;
+
+  DoublePrecision::StorageMatrix clr_f64_;
+  Bf16Storage::StorageMatrix     clr_bf16_;
+  Fp16Storage::StorageMatrix     clr_f16_;
+
+  bool            have_gram_;
+  Eigen::MatrixXd gram_;
+
+  std::unique_ptr<JlSketch> sketch_;
+};
+
+#endif //CODA_PIPELINE_H
@@ -0,0 +1,90 @@
+#ifndef CODA_PRECISION_H
+#define CODA_PRECISION_H
+
+#include <cstring>
+
+#include <Eigen/Dense>
+
+/// @brief Number types for the dense CLR table.
+///
+/// The table is kept as `Storage` and converted to `Compute` a piece at a
+/// time for products, so reduced precision storage (bfloat16, fp16) halves
+/// the memory and the bytes every pass over the table reads, while the
+/// arithmetic stays in fp32.  Distances and Gram matrices are accumulated in
+/// double whatever the policy.
+template <typename StorageScalar, typename ComputeScalar>
+struct PrecisionPolicy
+{
+  typedef StorageScalar Storage;
+  typedef ComputeScalar Compute;
+
+  typedef Eigen::Matrix<Storage, Eigen::Dynamic, Eigen::Dynamic> StorageMatrix;
+  typedef Eigen::Matrix<Compute, Eigen::Dynamic, Eigen::Dynamic> ComputeMatrix;
+};
+
+typedef PrecisionPolicy<float, float>            SinglePrecision;
+typedef PrecisionPolicy<double, double>          DoublePrecision;
+typedef PrecisionPolicy<Eigen::bfloat16, float> Bf16Storage;
+typedef PrecisionPolicy<Eigen::half, float>      Fp16Storage;
+
+/// Calls X(policy) for each policy above, e.g. for explicit instantiations.
+#define CODA_FOR_EACH_PRECISION(X) \
+  X(SinglePrecision)               \
+  X(DoublePrecision)               \
+  X(Bf16Storage)                   \
+  X(Fp16Storage)
+
+/// The policies above, picked at run time.
+enum class Precision
+{
+  f32,  // SinglePrecision
+  f64,  // DoublePrecision
+  bf16, // Bf16Storage
+  f16,  // Fp16Storage
+};
+
+/// Parses "f32", "f64", "bf16" or "f16".  Returns false for anything else.
+inline bool
+parse_precision(const char* name, Precision& precision)
+{
+  static const struct
+  {
+    const char* name;
+    Precision   precision;
+  } names[] = {
+    { "f32", Precision::f32 },
+    { "f64", Precision::f64 },
+    { "bf16", Precision::bf16 },
+    { "f16", Precision::f16 },
+  };
+
+  for (const auto& entry : names) {
+    if (strcmp(name, entry.name) == 0) {
+      precision = entry.precision;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/// Calls `f` with a value of the policy type for `precision`, so one generic
+/// lambda runs the whole pipeline in any precision.
+template <typename F>
+auto
+dispatch_precision(Precision precision, F&& f)
+{
+  switch (precision) {
+    case Precision::f64:
+      return f(DoublePrecision{});
+    case Precision::bf16:
+      return f(Bf16Storage{});
+    case Precision::f16:
+      return f(Fp16Storage{});
+    case Precision::f32:
+    default:
+      return f(SinglePrecision{});
+  }
+}
+
+#endif //CODA_PRECISION_H
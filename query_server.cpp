@@ -0,0 +1,474 @@
+#include "query_server.h"
+
+#include <signal.h>     // signal, SIGPIPE
+#include <sys/socket.h> // socket, bind, listen, accept, shutdown
+#include <sys/stat.h>   // lstat
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>     // read, write, close, unlink
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+
+#include "clr_kernel.h"
+#include "element.h"
+
+using namespace std;
+
+/// Longest shortest-round-trip float, e.g. "-1.17549435e-38".
+#define max_float_chars ((size_t)16)
+
+struct QueryServer::Connection
+{
+  int fd;
+
+  // Held while a response is written, so responses don't interleave.
+  std::mutex              write_mutex;
+  std::condition_variable idle;
+
+  // Requests handed to the workers and not answered yet.
+  size_t pending;
+
+  // Set after a write fails; the rest of the responses are dropped.
+  bool failed;
+};
+
+static vector<string_view>
+split_fields(string_view line)
+{
+  vector<string_view> fields;
+
+  size_t start = 0;
+  while (true) {
+    const size_t stop = line.find('\t', start);
+
+    if (stop == string_view::npos) {
+      fields.push_back(line.substr(start));
+      break;
+    }
+
+    fields.push_back(line.substr(start, stop - start));
+    start = stop + 1;
+  }
+
+  return fields;
+}
+
+static void
+append_float(string& out, float value)
+{
+  char buffer[max_float_chars];
+
+  out += '\t';
+  out.append(buffer, to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+}
+
+static void
+append_names(string& out, const NameTable& names)
+{
+  for (size_t i = 0; i < names.size(); ++i) {
+    out += '\t';
+    out += names.name(i);
+  }
+}
+
+static Eigen::Index
+find_sample(const CodaState& state, string_view name)
+{
+  const size_t index = state.samples.find(name);
+
+  if (index == NameTable::npos) {
+    throw runtime_error("unknown sample '" + string(name) + "'");
+  }
+
+  return (Eigen::Index)index;
+}
+
+/// The k nearest other samples to sample j, nearest first (ties by index).
+static vector<Eigen::Index>
+nearest_samples(const CodaState& state, Eigen::Index j, Eigen::Index k)
+{
+  // The distance matrix is symmetric, so column j is row j, contiguous.
+  const auto distances = state.distances.col(j);
+
+  vector<Eigen::Index> others;
+  others.reserve(state.distances.rows());
+  for (Eigen::Index i = 0; i < state.distances.rows(); ++i) {
+    if (i != j) {
+      others.push_back(i);
+    }
+  }
+
+  k = min(k, (Eigen::Index)others.size());
+
+  partial_sort(others.begin(), others.begin() + k, others.end(), [&](Eigen::Index a, Eigen::Index b) {
+    return distances(a) < distances(b) || (distances(a) == distances(b) && a < b);
+  });
+  others.resize(k);
+
+  return others;
+}
+
+/// Projection of the sample with counts given as (otu, otu_len, count)
+/// fields, the way add_samples() folds one in.
+static Eigen::VectorXf
+project_counts(const CodaState& state, const vector<string_view>& fields, size_t first)
+{
+  if (fields.size() <= first || (fields.size() - first) % 3 != 0) {
+    throw runtime_error("project needs <otu> <otu_len> <count> triples");
+  }
+
+  const Eigen::Index m = state.clr.rows();
+
+  Eigen::VectorXf       clr = Eigen::VectorXf::Constant(m, zero_replacement);
+  vector<bool>          seen(m, false);
+  array<string_view, 4> tokens;
+
+  for (size_t i = first; i < fields.size(); i += 3) {
+    const size_t row = state.otus.find(fields[i]);
+
+    if (row == NameTable::npos) {
+      throw runtime_error("unknown OTU '" + string(fields[i]) + "'");
+    }
+    if (seen[row]) {
+      throw runtime_error("OTU '" + string(fields[i]) + "' is given twice");
+    }
+    seen[row] = true;
+
+    tokens = { string_view(), fields[i], fields[i + 1], fields[i + 2] };
+
+    clr(row) = element_normalize_count(parse_data_line(tokens, true));
+  }
+
+  // Same as clr_in_place() on one column.
+  const float mean_log = (float)(clr_log_column(clr.data(), clr.data(), m) / m);
+  clr.array() -= mean_log;
+
+  return state.axes.transpose() * clr;
+}
+
+string
+QueryServer::answer(string_view request) const
+{
+  const vector<string_view> fields = split_fields(request);
+  const string_view         id     = fields[0];
+
+  string out;
+
+  try {
+    if (fields.size() < 2) {
+      throw runtime_error("no command");
+    }
+
+    const string_view command = fields[1];
+
+    if (command == "samples" || command == "otus") {
+      out += id;
+      append_names(out, command == "samples" ? state_.samples : state_.otus);
+      out += '\n';
+    }
+    else if (command == "distances") {
+      for (size_t i = 2; i < fields.size(); ++i) {
+        const Eigen::Index j = find_sample(state_, fields[i]);
+
+        out += id;
+        out += '\t';
+        out += fields[i];
+        for (Eigen::Index k = 0; k < state_.distances.rows(); ++k) {
+          append_float(out, state_.distances(k, j));
+        }
+        out += '\n';
+      }
+    }
+    else if (command == "knn") {
+      long k = 0;
+      if (fields.size() < 3
+          || from_chars(fields[2].data(), fields[2].data() + fields[2].size(), k).ec != errc()
+          || k < 1) {
+        throw runtime_error("knn needs a positive k");
+      }
+
+      for (size_t i = 3; i < fields.size(); ++i) {
+        const Eigen::Index j = find_sample(state_, fields[i]);
+
+        out += id;
+        out += '\t';
+        out += fields[i];
+        for (Eigen::Index neighbour : nearest_samples(state_, j, k)) {
+          out += '\t';
+          out += state_.samples.name(neighbour);
+          append_float(out, state_.distances(neighbour, j));
+        }
+        out += '\n';
+      }
+    }
+    else if (command == "project") {
+      const Eigen::VectorXf projection = project_counts(state_, fields, 2);
+
+      out += id;
+      for (Eigen::Index k = 0; k < projection.size(); ++k) {
+        append_float(out, projection(k));
+      }
+      out += '\n';
+    }
+    else {
+      throw runtime_error("unknown command '" + string(command) + "'");
+    }
+  }
+  catch (const exception& e) {
+    // Bad numbers come from parse_data_line() as logic errors.
+    return string(id) + "\terror\t" + e.what() + "\n";
+  }
+
+  out += id;
+  out += "\tok\n";
+
+  return out;
+}
+
+QueryServer::QueryServer(const CodaState& state, int num_threads)
+  : state_(state),
+    done_(false)
+{
+  for (int i = 0; i < max(num_threads, 1); ++i) {
+    workers_.emplace_back(&QueryServer::run, this);
+  }
+}
+
+QueryServer::~QueryServer()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    done_ = true;
+  }
+  not_empty_.notify_all();
+
+  for (thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void
+QueryServer::submit(Job&& job)
+{
+  {
+    unique_lock<mutex> lock(mutex_);
+    not_full_.wait(lock, [&] { return queue_.size() < query_server_max_queued; });
+    queue_.push_back(std::move(job));
+  }
+  not_empty_.notify_one();
+}
+
+/// Returns false if the write fails.
+static bool
+write_all(int fd, const string& data)
+{
+  size_t written = 0;
+
+  while (written < data.size()) {
+    const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    written += (size_t)n;
+  }
+
+  return true;
+}
+
+void
+QueryServer::run()
+{
+  while (true) {
+    Job job;
+    {
+      unique_lock<mutex> lock(mutex_);
+      not_empty_.wait(lock, [&] { return done_ || !queue_.empty(); });
+
+      if (queue_.empty()) {
+        return;
+      }
+
+      job = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    not_full_.notify_one();
+
+    const string response = answer(job.request);
+
+    Connection&       connection = *job.connection;
+    lock_guard<mutex> lock(connection.write_mutex);
+
+    if (!connection.failed && !write_all(connection.fd, response)) {
+      connection.failed = true;
+    }
+
+    if (--connection.pending == 0) {
+      connection.idle.notify_all();
+    }
+  }
+}
+
+void
+QueryServer::serve(int in_fd, int out_fd)
+{
+  // A client that goes away mid-response (or a closed stdout) shows up as
+  // a failed write rather than killing the process.
+  signal(SIGPIPE, SIG_IGN);
+
+  auto connection = make_shared<Connection>();
+
+  connection->fd      = out_fd;
+  connection->pending = 0;
+  connection->failed  = false;
+
+  auto dispatch = [&](string_view line) {
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    if (line.empty()) {
+      return;
+    }
+
+    {
+      lock_guard<mutex> lock(connection->write_mutex);
+      ++connection->pending;
+    }
+
+    submit(Job{ string(line), connection });
+  };
+
+  string       buffer;
+  vector<char> chunk(query_server_read_bytes);
+  int          error = 0;
+
+  while (true) {
+    const ssize_t n = ::read(in_fd, chunk.data(), chunk.size());
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error = errno;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+
+    buffer.append(chunk.data(), (size_t)n);
+
+    size_t start = 0;
+    size_t stop;
+    while ((stop = buffer.find('\n', start)) != string::npos) {
+      dispatch(string_view(buffer).substr(start, stop - start));
+      start = stop + 1;
+    }
+    buffer.erase(0, start);
+  }
+
+  // The last line may not have a newline.
+  if (error == 0) {
+    dispatch(buffer);
+  }
+
+  {
+    unique_lock<mutex> lock(connection->write_mutex);
+    connection->idle.wait(lock, [&] { return connection->pending == 0; });
+  }
+
+  if (error != 0) {
+    throw runtime_error(string("couldn't read requests: ") + strerror(error));
+  }
+}
+
+void
+QueryServer::listen(const string& path)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw runtime_error("socket path '" + path + "' is too long");
+  }
+  memcpy(address.sun_path, path.c_str(), path.size());
+
+  struct stat path_stat;
+  if (lstat(path.c_str(), &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+    unlink(path.c_str());
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    throw runtime_error(string("couldn't make a socket: ") + strerror(errno));
+  }
+
+  if (bind(fd, (const struct sockaddr*)&address, sizeof(address)) != 0
+      || ::listen(fd, SOMAXCONN) != 0) {
+    const int error = errno;
+    close(fd);
+    throw runtime_error("couldn't listen on '" + path + "': " + strerror(error));
+  }
+
+  // The sockets of connections still being served.  Their threads use this
+  // object, so listen() doesn't throw (and let it be destroyed) until they
+  // are done.
+  mutex              live_mutex;
+  condition_variable live_done;
+  set<int>           live;
+
+  while (true) {
+    const int client = accept(fd, nullptr, nullptr);
+
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+
+      const int error = errno;
+      close(fd);
+
+      // Ending the connections makes their reads see end of file.
+      unique_lock<mutex> lock(live_mutex);
+      for (int socket : live) {
+        shutdown(socket, SHUT_RDWR);
+      }
+      live_done.wait(lock, [&] { return live.empty(); });
+
+      throw runtime_error("couldn't accept a connection on '" + path + "': " + strerror(error));
+    }
+
+    {
+      lock_guard<mutex> lock(live_mutex);
+      live.insert(client);
+    }
+
+    // Reading is cheap next to answering, so each connection gets a thread
+    // of its own that feeds the shared workers.  It cleans up after itself.
+    thread([this, client, &live_mutex, &live_done, &live] {
+      try {
+        serve(client, client);
+      }
+      catch (const runtime_error& e) {
+        fprintf(stderr, "ERROR -- %s\n", e.what());
+      }
+
+      // Closed under the lock, so listen() never shuts down a reused fd;
+      // notified under it, so listen() can't return before this is done.
+      lock_guard<mutex> lock(live_mutex);
+      live.erase(client);
+      close(client);
+      live_done.notify_all();
+    }).detach();
+  }
+}
@@ -0,0 +1,106 @@
+#ifndef CODA_QUERY_SERVER_H
+#define CODA_QUERY_SERVER_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "incremental.h"
+
+/// Requests that may wait for a worker before reading more blocks.
+#define query_server_max_queued ((size_t)1024)
+
+/// Bytes read from a connection at a time.
+#define query_server_read_bytes ((size_t)1 << 16)
+
+/// @brief Answers queries about a saved state (see incremental.h), which is
+/// loaded once and shared read-only by a pool of worker threads.
+///
+/// The protocol is lines of tab separated fields.  A request is an id of the
+/// client's choosing, a command and its arguments:
+///
+///   <id>  samples
+///   <id>  otus
+///   <id>  distances  <sample>...
+///   <id>  knn        <k>  <sample>...
+///   <id>  project    <otu>  <otu_len>  <count>  [<otu>  <otu_len>  <count>]...
+///
+/// `samples` and `otus` give the names in the state's order, on one line.
+/// `distances` gives one line per sample, the sample then its distance to
+/// every sample in order.  `knn` gives one line per sample, the sample then
+/// its k nearest other samples and their distances, nearest first.
+/// `project` takes the counts of one new sample, like the lines of a counts
+/// file (OTUs it leaves out are zeros), and gives its projection onto the
+/// principal axes, like --update folds new samples in.
+///
+/// Every line of a response starts with the request's id, and the last one
+/// is `<id> ok`, or `<id> error <message>` instead of any results.  The
+/// lines of one response are written together, but requests run in
+/// parallel, so responses come back in the order they finish, not the order
+/// they were sent.
+class QueryServer
+{
+public:
+  /// Keeps a reference to `state`, which must outlive this and not change.
+  /// Starts `num_threads` workers.
+  QueryServer(const CodaState& state, int num_threads);
+
+  /// Waits for the queued requests, then stops the workers.
+  ~QueryServer();
+
+  QueryServer(const QueryServer&) = delete;
+  QueryServer& operator=(const QueryServer&) = delete;
+
+  /// The response to one request line (without its newline), including the
+  /// final newline.  Safe to call from any thread.
+  std::string
+  answer(std::string_view request) const;
+
+  /// @brief Reads requests from `in_fd` until end of file, hands them to the
+  /// workers, and writes the responses to `out_fd`.  Returns once every
+  /// response is written.
+  ///
+  /// Throws std::runtime_error if `in_fd` can't be read.  A failed write
+  /// (e.g. the client went away) just drops the rest of the responses.
+  void
+  serve(int in_fd, int out_fd);
+
+  /// @brief Listens on a Unix domain socket at `path` and serves each
+  /// connection as above, on its own reading thread.  A stale socket file at
+  /// `path` is replaced.  Only returns by throwing std::runtime_error, once
+  /// the connections still open are shut down and their threads are done.
+  void
+  listen(const std::string& path);
+
+private:
+  struct Connection;
+
+  struct Job
+  {
+    std::string                 request;
+    std::shared_ptr<Connection> connection;
+  };
+
+  void
+  submit(Job&& job);
+
+  void
+  run();
+
+  const CodaState& state_;
+
+  std::mutex              mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<Job>         queue_;
+  bool                    done_;
+
+  std::vector<std::thread> workers_;
+};
+
+#endif //CODA_QUERY_SERVER_H
@@ -1,13 +1,259 @@
 #include "rsvd.h"
 
-Rsvd::RandomizedSvd<Eigen::MatrixXf, std::mt19937_64, Rsvd::SubspaceIterationConditioner::Lu>
-randomized_svd(std::mt19937_64& random_engine,
-               const Eigen::MatrixXf& m,
-               const int rank)
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "dense_clr.h"
+#include "mat.h"
+
+/// The randomized SVD and single-pass sketch, in the compute precision.
+template <typename Matrix>
+using Svd = Rsvd::RandomizedSvd<Matrix, Rsvd::PhiloxEngine, Rsvd::SubspaceIterationConditioner::Lu>;
+
+template <typename Matrix>
+using Sketch = Rsvd::TwoSidedSketch<Matrix, Rsvd::PhiloxEngine>;
+
+/// Rsvd's row block provider interface over a ClrRowBlocks.
+class ClrBlockProvider
+{
+public:
+  explicit ClrBlockProvider(const ClrRowBlocks& m)
+    : m_(m)
+  {}
+
+  Eigen::Index
+  rows() const
+  { return m_.rows(); }
+
+  Eigen::Index
+  cols() const
+  { return m_.cols(); }
+
+  Eigen::Index
+  blockRows() const
+  { return m_.block_rows(); }
+
+  Eigen::MatrixXf
+  rowBlock(Eigen::Index first, Eigen::Index count) const
+  { return m_.row_block(first, count); }
+
+private:
+  const ClrRowBlocks& m_;
+};
+
+/// The components can't explain more than all of the variance, but in
+/// rounding they can seem to: the singular values and the total are summed
+/// differently.  Scales `explained` down to a sum of at most 1.
+static void
+cap_explained(Eigen::VectorXd& explained)
 {
-  Rsvd::RandomizedSvd<Eigen::MatrixXf, std::mt19937_64, Rsvd::SubspaceIterationConditioner::Lu> rsvd(random_engine);
+  const double sum = explained.sum();
 
-  rsvd.compute(m, rank);
+  if (sum > 1) {
+    explained /= sum;
+  }
+}
+
+/// V * Sigma, and the variance explained, for the leading `rank` components.
+template <typename Matrix>
+static SamplePca
+make_pca(const Svd<Matrix>& rsvd, Eigen::Index rank, double squared_norm)
+{
+  typedef Eigen::Matrix<typename Matrix::Scalar, Eigen::Dynamic, 1> Vector;
 
-  return rsvd;
+  const Vector sigma = rsvd.singularValues().col(0).head(rank);
+
+  SamplePca pca;
+  pca.projection = (rsvd.matrixV().leftCols(rank) * sigma.asDiagonal()).template cast<float>();
+  pca.explained  = sigma.template cast<double>().array().square() / (squared_norm > 0 ? squared_norm : 1);
+
+  cap_explained(pca.explained);
+
+  return pca;
 }
+
+/// One pass over the row blocks of `m`, into the sketch and the squared norm
+/// at the same time.  `Matrix` is the compute matrix type.
+template <typename Matrix, typename Clr>
+static SamplePca
+single_pass_pca(Rsvd::PhiloxEngine& random_engine,
+                const Clr& m,
+                Eigen::Index rank,
+                Eigen::Index block_rows)
+{
+  const Eigen::Index max_rank = std::min(m.rows(), m.cols());
+
+  rank = std::min(rank, max_rank);
+
+  const Eigen::Index range_dim    = std::min(2 * rank + 1, max_rank);
+  const Eigen::Index co_range_dim = std::min(2 * range_dim + 1, m.rows());
+
+  Sketch<Matrix> sketch(m.rows(), m.cols(), range_dim, co_range_dim, random_engine);
+  double squared_norm = 0;
+
+  for (Eigen::Index first = 0; first < m.rows(); first += block_rows) {
+    const Eigen::Index count = std::min(block_rows, m.rows() - first);
+    const Matrix       block = m.row_block(first, count);
+
+    sketch.addRows(first, block);
+    squared_norm += block.template cast<double>().squaredNorm();
+  }
+
+  Svd<Matrix> rsvd(random_engine);
+  rsvd.computeFromSketch(sketch, rank);
+
+  SamplePca pca = make_pca(rsvd, rank, squared_norm);
+
+  // The sketch's singular values carry its own error, about k / (l - k - 1)
+  // times the energy outside the range in all, which swamps them when the
+  // spectrum hasn't decayed.  So they are never taken to explain more than
+  // the range captured, and the error is reported.
+  const double tail      = std::min(rsvd.sketchTailSquaredNorm(), squared_norm);
+  const double error     = tail * range_dim / std::max((double)(co_range_dim - range_dim - 1), 1.0);
+  const double explained = pca.explained.sum();
+  const double captured  = squared_norm > 0 ? (squared_norm - tail) / squared_norm : 0;
+
+  if (explained > 0) {
+    pca.sketch_error = error / (explained * (squared_norm > 0 ? squared_norm : 1));
+  }
+  if (explained > captured) {
+    pca.explained *= captured / explained;
+  }
+
+  return pca;
+}
+
+/// `Matrix` is the compute matrix type.
+template <typename Matrix, typename Clr>
+static SamplePca
+sample_pca_impl(Rsvd::PhiloxEngine& random_engine,
+                const Clr& m,
+                const PcaTarget& target,
+                PcaMethod method)
+{
+  if (method == PcaMethod::single_pass) {
+    assert(target.variance == 0);
+
+    return single_pass_pca<Matrix>(random_engine, m, target.rank, sketch_block_rows);
+  }
+
+  const Eigen::Index max_rank     = std::min(m.rows(), m.cols());
+  const double       squared_norm = col_squared_norms(m).sum();
+
+  Svd<Matrix> rsvd(random_engine);
+
+  Eigen::Index rank;
+  if (target.variance > 0) {
+    rsvd.computeToTolerance(m, squared_norm, std::sqrt(1 - std::min(target.variance, 1.0)), pca_block_cols, max_rank);
+
+    // Fewest leading components that reach the target.  The singular values
+    // of the whole range capture at least that much, so this stops in time
+    // unless rounding gets in the way.
+    const Matrix all_sigma = rsvd.singularValues();
+
+    double captured = 0;
+    for (rank = 0; rank < all_sigma.size() && captured < target.variance * squared_norm; ++rank) {
+      captured += (double)all_sigma(rank) * all_sigma(rank);
+    }
+  }
+  else {
+    rank = std::min(target.rank, max_rank);
+
+    rsvd.compute(m, rank);
+  }
+
+  return make_pca(rsvd, rank, squared_norm);
+}
+
+SamplePca
+sample_pca(Rsvd::PhiloxEngine& random_engine,
+           const Eigen::Ref<const Eigen::MatrixXf>& m,
+           const PcaTarget& target,
+           PcaMethod method)
+{
+  return sample_pca(random_engine, DenseClr<SinglePrecision>(m), target, method);
+}
+
+template <typename Policy>
+SamplePca
+sample_pca(Rsvd::PhiloxEngine& random_engine,
+           const DenseClr<Policy>& m,
+           const PcaTarget& target,
+           PcaMethod method)
+{
+  return sample_pca_impl<typename Policy::ComputeMatrix>(random_engine, m, target, method);
+}
+
+SamplePca
+sample_pca(Rsvd::PhiloxEngine& random_engine,
+           const SparseClr& m,
+           const PcaTarget& target,
+           PcaMethod method)
+{
+  return sample_pca_impl<Eigen::MatrixXf>(random_engine, m, target, method);
+}
+
+SamplePca
+sample_pca(Rsvd::PhiloxEngine& random_engine,
+           const ClrRowBlocks& m,
+           const PcaTarget& target,
+           PcaMethod method)
+{
+  assert(target.variance == 0);
+
+  if (method == PcaMethod::single_pass) {
+    return single_pass_pca<Eigen::MatrixXf>(random_engine, m, target.rank, m.block_rows());
+  }
+
+  const Eigen::Index rank         = std::min({ target.rank, m.rows(), m.cols() });
+  const double       squared_norm = col_squared_norms(m).sum();
+
+  Svd<Eigen::MatrixXf> rsvd(random_engine);
+  rsvd.computeFromRowBlocks(ClrBlockProvider(m), rank);
+
+  return make_pca(rsvd, rank, squared_norm);
+}
+
+SamplePca
+gram_pca(const Eigen::MatrixXd& gram, const PcaTarget& target)
+{
+  const Eigen::Index n = gram.cols();
+
+  // Eigenvalues come in increasing order; the largest ones are on the right.
+  const Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen(gram);
+
+  // Rounding can push the eigenvalues of a singular Gram matrix below 0.
+  const Eigen::VectorXd lambda = eigen.eigenvalues().reverse().cwiseMax(0.0);
+  const double          total  = gram.trace();
+
+  Eigen::Index rank;
+  if (target.variance > 0) {
+    double captured = 0;
+    for (rank = 0; rank < n && captured < target.variance * total; ++rank) {
+      captured += lambda(rank);
+    }
+  }
+  else {
+    rank = std::min(target.rank, n);
+  }
+
+  const Eigen::VectorXd sigma = lambda.head(rank).cwiseSqrt();
+
+  SamplePca pca;
+  pca.projection = (eigen.eigenvectors().rowwise().reverse().leftCols(rank) * sigma.asDiagonal()).cast<float>();
+  pca.explained  = lambda.head(rank) / (total > 0 ? total : 1);
+
+  // Clamping the negative eigenvalues to 0 can push their sum past the trace.
+  cap_explained(pca.explained);
+
+  return pca;
+}
+
+#define INSTANTIATE_SAMPLE_PCA(Policy)                                    \
+  template SamplePca sample_pca(Rsvd::PhiloxEngine&,                       \
+                                const DenseClr<Policy>&,                   \
+                                const PcaTarget&,                          \
+                                PcaMethod);
+
+CODA_FOR_EACH_PRECISION(INSTANTIATE_SAMPLE_PCA)
@@ -3,11 +3,105 @@
 
 #include <rsvd/Prelude.hpp>
 #include <Eigen/Dense>
-#include <random>
 
-Rsvd::RandomizedSvd<Eigen::MatrixXf, std::mt19937_64, Rsvd::SubspaceIterationConditioner::Lu>
-randomized_svd(std::mt19937_64& random_engine,
-               const Eigen::MatrixXf& m,
-               const int rank);
+#include "clr_blocks.h"
+#include "dense_clr.h"
+#include "sparse_clr.h"
+
+/// Range directions added per step when growing the PCA to a variance target.
+#define pca_block_cols ((Eigen::Index)16)
+
+/// Rows of the CLR table added to a single-pass sketch at a time.
+#define sketch_block_rows ((Eigen::Index)4096)
+
+/// SamplePca::sketch_error above which the single-pass PCA is reported as
+/// unreliable.
+#define sketch_max_error 0.5
+
+/// How the PCA gets at the CLR table.
+enum class PcaMethod
+{
+  // Randomized subspace iterations: a few passes over the table.
+  subspace_iteration,
+
+  // A two-sided sketch (Rsvd::TwoSidedSketch) built in one pass over the
+  // table.  Less accurate for the same rank, and rank targets only.
+  single_pass,
+};
+
+/// How many principal components to keep.  With `variance` > 0, the fewest
+/// that explain at least that fraction of the variance (`rank` is ignored).
+/// Otherwise, `rank` of them.
+typedef struct PcaTarget
+{
+  Eigen::Index rank;
+  double       variance;
+} PcaTarget;
+
+typedef struct SamplePca
+{
+  /// Samples x components: V * Sigma.
+  Eigen::MatrixXf projection;
+
+  /// Fraction of the variance (squared Frobenius norm of the CLR table)
+  /// explained by each component.
+  Eigen::VectorXd explained;
+
+  /// PcaMethod::single_pass only: the sketch's estimated error, as a
+  /// fraction of the variance the components seem to explain.  Near 1 or
+  /// more, the spectrum hasn't decayed enough for the sketch, and the
+  /// components and `explained` are rough.
+  double sketch_error = 0;
+} SamplePca;
+
+/// @brief Project the samples (columns) onto their leading principal axes.
+///
+/// The randomized SVD runs once.  For a rank target it samples rank + 5
+/// directions.  For a variance target it grows the range in pca_block_cols
+/// blocks until the residual says enough variance is captured, then keeps
+/// the leading components that reach the target.
+///
+/// PcaMethod::single_pass reads the table once, a block of rows at a time,
+/// into a sketch with 2 * rank + 1 range and 4 * rank + 3 co-range
+/// directions, and needs a rank target.  The variance it reports explained
+/// is capped at what the sketch's range captured, and how much of it is
+/// sketch error goes in SamplePca::sketch_error.
+SamplePca
+sample_pca(Rsvd::PhiloxEngine& random_engine,
+           const Eigen::Ref<const Eigen::MatrixXf>& m,
+           const PcaTarget& target,
+           PcaMethod method = PcaMethod::subspace_iteration);
+
+/// Same as above in any precision: the randomized SVD runs in
+/// `Policy::Compute`.  The Ref version is this with SinglePrecision.
+template <typename Policy>
+SamplePca
+sample_pca(Rsvd::PhiloxEngine& random_engine,
+           const DenseClr<Policy>& m,
+           const PcaTarget& target,
+           PcaMethod method = PcaMethod::subspace_iteration);
+
+SamplePca
+sample_pca(Rsvd::PhiloxEngine& random_engine,
+           const SparseClr& m,
+           const PcaTarget& target,
+           PcaMethod method = PcaMethod::subspace_iteration);
+
+/// Same as above, out of core: a few passes over the row blocks (just one
+/// with PcaMethod::single_pass), in order.  Only rank targets are supported.
+SamplePca
+sample_pca(Rsvd::PhiloxEngine& random_engine,
+           const ClrRowBlocks& m,
+           const PcaTarget& target,
+           PcaMethod method = PcaMethod::subspace_iteration);
+
+/// @brief Exact sample PCA from the Gram matrix C^T C (gram_matrix()).
+///
+/// C^T C = V Sigma^2 V^T, so a symmetric eigendecomposition of the n x n
+/// Gram matrix gives the projection V * Sigma without touching the table.
+/// Same targets as sample_pca(); the result matches it up to the sign of
+/// each component.
+SamplePca
+gram_pca(const Eigen::MatrixXd& gram, const PcaTarget& target);
 
 #endif //CODA_RSVD_H
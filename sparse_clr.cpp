@@ -0,0 +1,98 @@
+#include "sparse_clr.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "clr_kernel.h"
+#include "element.h"
+
+SparseClr::SparseClr(Counts& counts)
+  : sparse_(std::move(counts.sparse_table)),
+    offsets_(sparse_.cols())
+{
+  assert(counts.col_log_sums.size() == sparse_.cols());
+
+  const float log_zero_replacement = clr_log_zero_replacement();
+
+  float*             values = sparse_.valuePtr();
+  const Eigen::Index nnz    = sparse_.nonZeros();
+  const Eigen::Index pieces = (nnz + sparse_clr_log_values - 1) / sparse_clr_log_values;
+
+#pragma omp parallel for schedule(static)
+  for (Eigen::Index p = 0; p < pieces; ++p) {
+    const Eigen::Index first = p * sparse_clr_log_values;
+
+    clr_column(values + first,
+               values + first,
+               std::min(sparse_clr_log_values, nnz - first),
+               log_zero_replacement);
+  }
+
+  for (Eigen::Index j = 0; j < sparse_.cols(); ++j) {
+    float mean_log_col = (float)(counts.col_log_sums(j) / sparse_.rows());
+
+    offsets_(j) = log_zero_replacement - mean_log_col;
+  }
+}
+
+Eigen::MatrixXf
+SparseClr::row_block(Eigen::Index first, Eigen::Index count) const
+{
+  Eigen::MatrixXf block(count, cols());
+
+  const Eigen::Index* outer  = sparse_.outerIndexPtr();
+  const Eigen::Index* inner  = sparse_.innerIndexPtr();
+  const float*        values = sparse_.valuePtr();
+
+  for (Eigen::Index j = 0; j < cols(); ++j) {
+    block.col(j).setConstant(offsets_(j));
+
+    // Rows are sorted within each column.
+    const Eigen::Index* stop = inner + outer[j + 1];
+    const Eigen::Index* it   = std::lower_bound(inner + outer[j], stop, first);
+
+    for (; it != stop && *it < first + count; ++it) {
+      block(*it - first, j) += values[it - inner];
+    }
+  }
+
+  return block;
+}
+
+Eigen::MatrixXf
+SparseClr::multiply(const Eigen::Ref<const Eigen::MatrixXf>& x) const
+{
+  assert(x.rows() == cols());
+
+  Eigen::MatrixXf result(rows(), x.cols());
+
+  // Output columns are independent, which avoids scattering into shared rows.
+#pragma omp parallel for schedule(dynamic, 1)
+  for (Eigen::Index c = 0; c < x.cols(); ++c) {
+    result.col(c).noalias() = sparse_ * x.col(c);
+  }
+
+  // 1 * (offsets^T * x)
+  result.rowwise() += offsets_.transpose() * x;
+
+  return result;
+}
+
+Eigen::MatrixXf
+SparseClr::adjoint_multiply(const Eigen::Ref<const Eigen::MatrixXf>& y) const
+{
+  assert(y.rows() == rows());
+
+  Eigen::MatrixXf result(cols(), y.cols());
+
+  // Each output row is one column of S, so this splits cleanly by column.
+#pragma omp parallel for schedule(dynamic, 64)
+  for (Eigen::Index j = 0; j < cols(); ++j) {
+    result.row(j).noalias() = sparse_.col(j).transpose() * y;
+  }
+
+  // offsets * (1^T * y)
+  result.noalias() += offsets_ * y.colwise().sum();
+
+  return result;
+}
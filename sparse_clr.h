@@ -0,0 +1,125 @@
+#ifndef CODA_SPARSE_CLR_H
+#define CODA_SPARSE_CLR_H
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+#include "ingest.h"
+
+/// Filled cells per parallel piece when taking their logs.
+#define sparse_clr_log_values ((Eigen::Index)1 << 16)
+
+class SparseClrAdjoint;
+
+/// @brief CLR transformed table stored as a sparse matrix plus a per-column
+/// offset.
+///
+/// Every cell without an input line holds zero_replacement, so after the CLR
+/// all of those cells in column j hold the same value,
+/// log(zero_replacement) - mean_log_col(j).  The CLR matrix is therefore
+///
+///   A = S + 1 * offsets^T
+///
+/// where S has log(x / zero_replacement) at the filled cells and is zero
+/// everywhere else, and offsets(j) = log(zero_replacement) - mean_log_col(j).
+/// Memory scales with the number of filled cells instead of OTUs x samples.
+///
+/// Products with dense matrices (`a * x`, `a.adjoint() * y`, `y.adjoint() *
+/// a`) work like they do for an Eigen matrix, so Rsvd::RandomizedSvd can
+/// decompose A without densifying it.
+class SparseClr
+{
+public:
+  /// Takes over `counts.sparse_table` and transforms it in place.
+  explicit SparseClr(Counts& counts);
+
+  Eigen::Index
+  rows() const
+  { return sparse_.rows(); }
+
+  Eigen::Index
+  cols() const
+  { return sparse_.cols(); }
+
+  /// S, column-major with rows sorted within each column.
+  const SparseTable&
+  sparse() const
+  { return sparse_; }
+
+  const Eigen::VectorXf&
+  offsets() const
+  { return offsets_; }
+
+  /// Rows [first, first + count) of A as a dense matrix.
+  Eigen::MatrixXf
+  row_block(Eigen::Index first, Eigen::Index count) const;
+
+  /// A * x
+  Eigen::MatrixXf
+  multiply(const Eigen::Ref<const Eigen::MatrixXf>& x) const;
+
+  /// A^T * y
+  Eigen::MatrixXf
+  adjoint_multiply(const Eigen::Ref<const Eigen::MatrixXf>& y) const;
+
+  SparseClrAdjoint
+  adjoint() const;
+
+private:
+  SparseTable     sparse_;
+  Eigen::VectorXf offsets_;
+};
+
+/// A^T, only good for multiplying.
+class SparseClrAdjoint
+{
+public:
+  explicit SparseClrAdjoint(const SparseClr& m)
+    : m_(m)
+  {}
+
+  Eigen::Index
+  rows() const
+  { return m_.cols(); }
+
+  Eigen::Index
+  cols() const
+  { return m_.rows(); }
+
+  const SparseClr&
+  nested() const
+  { return m_; }
+
+private:
+  const SparseClr& m_;
+};
+
+inline SparseClrAdjoint
+SparseClr::adjoint() const
+{
+  return SparseClrAdjoint(*this);
+}
+
+template <typename Derived>
+Eigen::MatrixXf
+operator*(const SparseClr& a, const Eigen::MatrixBase<Derived>& x)
+{
+  return a.multiply(x);
+}
+
+template <typename Derived>
+Eigen::MatrixXf
+operator*(const SparseClrAdjoint& a, const Eigen::MatrixBase<Derived>& y)
+{
+  return a.nested().adjoint_multiply(y);
+}
+
+/// y^T * A = (A^T * y)^T
+template <typename Derived>
+Eigen::MatrixXf
+operator*(const Eigen::MatrixBase<Derived>& y, const SparseClr& a)
+{
+  return a.adjoint_multiply(y.adjoint()).adjoint();
+}
+
+#endif //CODA_SPARSE_CLR_H
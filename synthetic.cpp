@@ -0,0 +1,151 @@
+#include "synthetic.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <charconv>
+#include <cmath>
+#include <vector>
+
+#include <rsvd/Philox.hpp>
+
+/// Standard deviation of the log OTU abundances.
+#define synthetic_abundance_sigma 2.0
+
+/// Standard deviation of the log sequencing depth of the samples.
+#define synthetic_depth_sigma 0.5
+
+/// Standard deviation of the log noise on each count.
+#define synthetic_count_sigma 0.5
+
+/// Expected count of an OTU of median abundance at median depth.
+#define synthetic_count_scale 10.0
+
+/// How strongly prevalence follows abundance: p ~ abundance^this.
+#define synthetic_prevalence_power 0.5
+
+/// Counter words that say what a draw is for, so no two draws share a counter.
+enum SyntheticDraw : uint32_t
+{
+  otu_draw,
+  sample_draw,
+  presence_draw,
+  noise_draw,
+};
+
+/// Uniform in (0, 1) from the first 64 bits of a Philox output.
+static double
+uniform(const std::array<uint32_t, 4>& bits)
+{
+  const uint64_t x = ((uint64_t)bits[0] << 32) | bits[1];
+
+  return ((double)(x >> 11) + 0.5) * 0x1.0p-53;
+}
+
+/// Scale c with mean(min(1, c * weights)) = density, by bisection.
+static double
+prevalence_scale(const std::vector<double>& weights, double density)
+{
+  double lo = 0;
+  double hi = 1 / *std::min_element(weights.begin(), weights.end());
+
+  for (int i = 0; i < 100; ++i) {
+    const double mid = (lo + hi) / 2;
+
+    double total = 0;
+    for (double w : weights) {
+      total += std::min(1.0, mid * w);
+    }
+
+    if (total < density * weights.size()) {
+      lo = mid;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return hi;
+}
+
+static void
+append_int(std::string& out, long value)
+{
+  char buf[24];
+
+  const auto result = std::to_chars(buf, buf + sizeof buf, value);
+
+  out.append(buf, result.ptr);
+}
+
+std::string
+synthetic_counts(const SyntheticSpec& spec)
+{
+  assert(spec.otus > 0 && spec.samples > 0);
+  assert(spec.density > 0 && spec.density <= 1);
+
+  const Rsvd::PhiloxEngine engine(spec.seed);
+
+  std::vector<double> log_abundance(spec.otus);
+  std::vector<double> prevalence(spec.otus);
+  std::vector<long>   length(spec.otus);
+
+  for (Eigen::Index i = 0; i < spec.otus; ++i) {
+    const std::array<uint32_t, 4> counter = { (uint32_t)i, 0, otu_draw, 0 };
+
+    log_abundance[i] = synthetic_abundance_sigma * engine.normalPair(counter)[0];
+    length[i]        = 300 + (long)(2700 * uniform(engine.bits(counter)));
+    prevalence[i]    = std::exp(synthetic_prevalence_power * log_abundance[i]);
+  }
+
+  const double scale = prevalence_scale(prevalence, spec.density);
+  for (double& p : prevalence) {
+    p = std::min(1.0, scale * p);
+  }
+
+  std::vector<std::string> sample_text(spec.samples);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (Eigen::Index j = 0; j < spec.samples; ++j) {
+    const double log_depth
+      = synthetic_depth_sigma * engine.normalPair({ 0, (uint32_t)j, sample_draw, 0 })[0];
+
+    std::string& out = sample_text[j];
+
+    for (Eigen::Index i = 0; i < spec.otus; ++i) {
+      if (uniform(engine.bits({ (uint32_t)i, (uint32_t)j, presence_draw, 0 })) >= prevalence[i]) {
+        continue;
+      }
+
+      const double noise = synthetic_count_sigma
+                           * engine.normalPair({ (uint32_t)i, (uint32_t)j, noise_draw, 0 })[0];
+      const double count
+        = synthetic_count_scale * std::exp(log_abundance[i] + log_depth + noise);
+
+      out += "sample";
+      append_int(out, (long)j + 1);
+      out += "\totu";
+      append_int(out, (long)i + 1);
+      out += '\t';
+      append_int(out, length[i]);
+      out += '\t';
+      append_int(out, std::max(1L, std::lround(std::min(count, 0x1.0p30))));
+      out += '\n';
+    }
+  }
+
+  size_t total_size = 0;
+  for (const std::string& text : sample_text) {
+    total_size += text.size();
+  }
+
+  std::string table;
+  table.reserve(total_size);
+
+  for (std::string& text : sample_text) {
+    table += text;
+    std::string().swap(text);
+  }
+
+  return table;
+}
@@ -0,0 +1,37 @@
+#ifndef CODA_SYNTHETIC_H
+#define CODA_SYNTHETIC_H
+
+#include <cstdint>
+#include <string>
+
+#include <Eigen/Dense>
+
+/// Shape of a synthetic counts table.
+typedef struct SyntheticSpec
+{
+  Eigen::Index otus;
+  Eigen::Index samples;
+
+  // Fraction of OTU/sample cells that get a line, in (0, 1].
+  double density;
+
+  uint64_t seed;
+} SyntheticSpec;
+
+/// @brief A long format counts table (sample, OTU, length, count per line)
+/// that looks roughly like amplicon or metagenome data.
+///
+/// OTU abundances are log-normal, so a few OTUs hold most of the reads.
+/// Abundant OTUs are also the most prevalent: each OTU shows up in a sample
+/// with a probability that grows with its abundance, scaled so that about
+/// `density` of all cells have a line.  Samples differ in sequencing depth
+/// (log-normal too), and each count is the expected count times log-normal
+/// noise, at least 1.  OTU lengths are uniform in [300, 3000).
+///
+/// Every draw comes from Rsvd::PhiloxEngine keyed by `seed`, with the
+/// OTU/sample indices as the counter, so the table depends only on `spec`.
+/// Lines are grouped by sample, OTUs in order, names "sample1", "otu1", ...
+std::string
+synthetic_counts(const SyntheticSpec& spec);
+
+#endif //CODA_SYNTHETIC_H
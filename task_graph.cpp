@@ -0,0 +1,138 @@
+#include "task_graph.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+using namespace std;
+
+size_t
+TaskGraph::add(vector<size_t> after, function<void()> run)
+{
+  for (size_t id : after) {
+    assert(id < stages_.size());
+    (void)id;
+  }
+
+  stages_.push_back(Stage{ std::move(after), std::move(run) });
+
+  return stages_.size() - 1;
+}
+
+void
+TaskGraph::run(int num_threads)
+{
+  // Stages only depend on earlier ones, so this order is always safe.
+  if (num_threads <= 1) {
+    for (Stage& stage : stages_) {
+      stage.run();
+    }
+    return;
+  }
+
+  const size_t n = stages_.size();
+
+  vector<size_t>         waiting_on(n);
+  vector<vector<size_t>> dependents(n);
+  deque<size_t>          ready;
+
+  for (size_t i = 0; i < n; ++i) {
+    waiting_on[i] = stages_[i].after.size();
+
+    for (size_t id : stages_[i].after) {
+      dependents[id].push_back(i);
+    }
+
+    if (waiting_on[i] == 0) {
+      ready.push_back(i);
+    }
+  }
+
+  std::mutex         stage_mutex;
+  condition_variable stage_done;
+  vector<size_t>     finished;
+  exception_ptr      error;
+
+  vector<thread> threads(n);
+  vector<int>    shares(n, 0);
+  int            free_threads = num_threads;
+  size_t         running      = 0;
+
+  unique_lock<std::mutex> lock(stage_mutex);
+
+  while (true) {
+    // Split the free threads evenly over the ready stages, in the order
+    // they became ready; any left over wait for the next stage to finish.
+    while (!error && !ready.empty() && free_threads > 0) {
+      const size_t id = ready.front();
+      ready.pop_front();
+
+      const int share = max(1, free_threads / (int)(ready.size() + 1));
+
+      shares[id] = share;
+      free_threads -= share;
+      ++running;
+
+      threads[id] = thread([&, id, share] {
+#ifdef _OPENMP
+        // Only this thread's parallel regions: each stage gets a team of
+        // its own.
+        omp_set_num_threads(share);
+#else
+        (void)share;
+#endif
+
+        exception_ptr stage_error;
+        try {
+          stages_[id].run();
+        }
+        catch (...) {
+          stage_error = current_exception();
+        }
+
+        {
+          lock_guard<std::mutex> done_lock(stage_mutex);
+
+          if (stage_error && !error) {
+            error = stage_error;
+          }
+          finished.push_back(id);
+        }
+        stage_done.notify_one();
+      });
+    }
+
+    if (running == 0) {
+      break;
+    }
+
+    stage_done.wait(lock, [&] { return !finished.empty(); });
+
+    for (size_t id : finished) {
+      threads[id].join();
+
+      free_threads += shares[id];
+      --running;
+
+      for (size_t dependent : dependents[id]) {
+        if (--waiting_on[dependent] == 0) {
+          ready.push_back(dependent);
+        }
+      }
+    }
+    finished.clear();
+  }
+
+  if (error) {
+    rethrow_exception(error);
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef CODA_TASK_GRAPH_H
+#define CODA_TASK_GRAPH_H
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+/// @brief Stages of a run and the stages each one needs first, run as soon
+/// as what they need is done.
+///
+/// Every parallel loop in coda is an OpenMP loop over pieces that don't
+/// depend on the number of threads, so stages can run side by side with
+/// the threads split between them and give the same results as one after
+/// another.  run() hands each stage that becomes ready a share of the
+/// threads that are free, and a stage's threads go back to the free ones,
+/// for the next ready stages, when it finishes.  So there are never more
+/// OpenMP threads busy than were asked for.
+class TaskGraph
+{
+public:
+  /// Adds a stage that runs `run` once the stages in `after` (ids from
+  /// earlier add() calls) are done.  Returns its id.
+  size_t
+  add(std::vector<size_t> after, std::function<void()> run);
+
+  /// @brief Runs every stage with up to `num_threads` OpenMP threads between
+  /// them.  With one thread, the stages run on this thread in the order
+  /// they were added.
+  ///
+  /// If a stage throws, no more stages are started, and once the running
+  /// ones are done, the first exception is rethrown.
+  void
+  run(int num_threads);
+
+private:
+  typedef struct Stage
+  {
+    std::vector<size_t>   after;
+    std::function<void()> run;
+  } Stage;
+
+  std::vector<Stage> stages_;
+};
+
+#endif //CODA_TASK_GRAPH_H
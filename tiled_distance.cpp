@@ -0,0 +1,523 @@
+#include "tiled_distance.h"
+
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <utility>
+#include <vector>
+
+#include "mat.h"
+#include "tsv_writer.h"
+
+using namespace std;
+
+/// Fills `band` with rows [first_row, first_row + band.rows()) of the
+/// distance matrix, columns [first_col, n), from `gram` if there is one.
+template <typename Matrix>
+static void
+fill_band(const Matrix& m,
+          const Eigen::MatrixXd* gram,
+          const Eigen::VectorXd& sq_norms,
+          Eigen::Index first_row,
+          Eigen::Index first_col,
+          Eigen::Index tile_cols,
+          Eigen::Ref<Eigen::MatrixXf> band)
+{
+  const Eigen::Index n          = m.cols();
+  const long         num_tiles  = (long)((n - first_col + tile_cols - 1) / tile_cols);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long t = 0; t < num_tiles; ++t) {
+    const Eigen::Index j  = first_col + t * tile_cols;
+    const Eigen::Index nj = min(tile_cols, n - j);
+
+    if (gram) {
+      distance_tile(m, *gram, sq_norms, first_row, j, band.middleCols(j - first_col, nj));
+    }
+    else {
+      distance_tile(m, sq_norms, first_row, j, band.middleCols(j - first_col, nj));
+    }
+  }
+}
+
+/// Out of core, the whole band comes from one pass over the row blocks.
+static void
+fill_band(const ClrRowBlocks& m,
+          const Eigen::MatrixXd* gram,
+          const Eigen::VectorXd& sq_norms,
+          Eigen::Index first_row,
+          Eigen::Index first_col,
+          Eigen::Index,
+          Eigen::Ref<Eigen::MatrixXf> band)
+{
+  if (gram) {
+    distance_band(m, *gram, sq_norms, first_row, first_col, band);
+  }
+  else {
+    distance_band(m, sq_norms, first_row, first_col, band);
+  }
+}
+
+/// Writes rows [first_row, first_row + band.rows()) of the distance matrix:
+/// the whole rows in the square layout, and in the condensed one, `band`
+/// starts at the diagonal and only the entries right of it are written.
+/// `upper` is scratch space.
+static void
+write_band(TsvWriter& out,
+           const NameTable& samples,
+           DistanceLayout layout,
+           Eigen::Index first_row,
+           const Eigen::Ref<const Eigen::MatrixXf>& band,
+           Eigen::VectorXf& upper)
+{
+  if (layout == DistanceLayout::square) {
+    out.write_rows(samples, first_row, band);
+
+    return;
+  }
+
+  const Eigen::Index nrows = band.rows();
+  const Eigen::Index ncols = band.cols();
+
+  // Row i of the band keeps the ncols - 1 - i entries right of the diagonal.
+  upper.resize(nrows * (ncols - 1) - nrows * (nrows - 1) / 2);
+
+  Eigen::Index k = 0;
+  for (Eigen::Index i = 0; i < nrows; ++i) {
+    const Eigen::Index len = ncols - 1 - i;
+    upper.segment(k, len) = band.row(i).tail(len).transpose();
+    k += len;
+  }
+
+  out.write_values(upper);
+}
+
+template <typename Matrix>
+static void
+write_tiled_distances(const string& fname,
+                      const Matrix& m,
+                      const NameTable& samples,
+                      DistanceLayout layout,
+                      Eigen::Index tile_cols,
+                      AsyncWriter* async,
+                      const Eigen::MatrixXd* gram)
+{
+  const Eigen::Index n = m.cols();
+
+  TsvWriter out(fname, async);
+
+  out.write_header(layout == DistanceLayout::square ? "sample" : "", samples);
+
+  const Eigen::VectorXd sq_norms = gram ? Eigen::VectorXd(gram->diagonal()) : col_squared_norms(m);
+
+  Eigen::MatrixXf band;
+  Eigen::VectorXf upper;
+
+  for (Eigen::Index first_row = 0; first_row < n; first_row += tile_cols) {
+    const Eigen::Index nrows = min(tile_cols, n - first_row);
+
+    if (layout == DistanceLayout::square) {
+      band.resize(nrows, n);
+      fill_band(m, gram, sq_norms, first_row, 0, tile_cols, band);
+    }
+    else {
+      band.resize(nrows, n - first_row);
+      fill_band(m, gram, sq_norms, first_row, first_row, tile_cols, band);
+    }
+
+    write_band(out, samples, layout, first_row, band, upper);
+  }
+
+  out.close();
+}
+
+template <typename Matrix>
+static void
+fill_distance_matrix(const Matrix& m,
+                     Eigen::Ref<Eigen::MatrixXf> out,
+                     Eigen::Index tile_cols,
+                     const Eigen::MatrixXd* gram)
+{
+  const Eigen::Index n = m.cols();
+
+  assert(out.rows() == n && out.cols() == n);
+
+  const Eigen::VectorXd sq_norms = gram ? Eigen::VectorXd(gram->diagonal()) : col_squared_norms(m);
+
+  for (Eigen::Index first_row = 0; first_row < n; first_row += tile_cols) {
+    const Eigen::Index nrows = min(tile_cols, n - first_row);
+
+    fill_band(m, gram, sq_norms, first_row, 0, tile_cols, out.middleRows(first_row, nrows));
+  }
+}
+
+void
+write_distances(const string& fname,
+                const Eigen::Ref<const Eigen::MatrixXf>& clr,
+                const NameTable& samples,
+                DistanceLayout layout,
+                Eigen::Index tile_cols,
+                AsyncWriter* async,
+                const Eigen::MatrixXd* gram)
+{
+  write_tiled_distances(fname, DenseClr<SinglePrecision>(clr), samples, layout, tile_cols, async, gram);
+}
+
+template <typename Policy>
+void
+write_distances(const string& fname,
+                const DenseClr<Policy>& clr,
+                const NameTable& samples,
+                DistanceLayout layout,
+                Eigen::Index tile_cols,
+                AsyncWriter* async,
+                const Eigen::MatrixXd* gram)
+{
+  write_tiled_distances(fname, clr, samples, layout, tile_cols, async, gram);
+}
+
+void
+write_distances(const string& fname,
+                const SparseClr& clr,
+                const NameTable& samples,
+                DistanceLayout layout,
+                Eigen::Index tile_cols,
+                AsyncWriter* async,
+                const Eigen::MatrixXd* gram)
+{
+  write_tiled_distances(fname, clr, samples, layout, tile_cols, async, gram);
+}
+
+void
+write_distances(const string& fname,
+                const ClrRowBlocks& clr,
+                const NameTable& samples,
+                DistanceLayout layout,
+                Eigen::Index tile_cols,
+                AsyncWriter* async,
+                const Eigen::MatrixXd* gram)
+{
+  write_tiled_distances(fname, clr, samples, layout, tile_cols, async, gram);
+}
+
+void
+distance_matrix(const Eigen::Ref<const Eigen::MatrixXf>& clr,
+                Eigen::Ref<Eigen::MatrixXf> out,
+                Eigen::Index tile_cols,
+                const Eigen::MatrixXd* gram)
+{
+  fill_distance_matrix(DenseClr<SinglePrecision>(clr), out, tile_cols, gram);
+}
+
+template <typename Policy>
+void
+distance_matrix(const DenseClr<Policy>& clr,
+                Eigen::Ref<Eigen::MatrixXf> out,
+                Eigen::Index tile_cols,
+                const Eigen::MatrixXd* gram)
+{
+  fill_distance_matrix(clr, out, tile_cols, gram);
+}
+
+void
+distance_matrix(const SparseClr& clr,
+                Eigen::Ref<Eigen::MatrixXf> out,
+                Eigen::Index tile_cols,
+                const Eigen::MatrixXd* gram)
+{
+  fill_distance_matrix(clr, out, tile_cols, gram);
+}
+
+void
+distance_matrix(const ClrRowBlocks& clr,
+                Eigen::Ref<Eigen::MatrixXf> out,
+                Eigen::Index tile_cols,
+                const Eigen::MatrixXd* gram)
+{
+  fill_distance_matrix(clr, out, tile_cols, gram);
+}
+
+void
+distance_rows(const Eigen::Ref<const Eigen::MatrixXf>& clr,
+              Eigen::Index first_row,
+              Eigen::Ref<Eigen::MatrixXf> out,
+              Eigen::Index tile_cols)
+{
+  assert(out.cols() == clr.cols() && first_row + out.rows() <= clr.cols());
+
+  const DenseClr<SinglePrecision> m(clr);
+  const Eigen::VectorXd           sq_norms = col_squared_norms(m);
+
+  // Bands of at most tile_cols rows, so that a column tile starting at a
+  // band's first row (a diagonal tile) is square.
+  for (Eigen::Index i = 0; i < out.rows(); i += tile_cols) {
+    const Eigen::Index nrows = min(tile_cols, out.rows() - i);
+
+    fill_band(m, nullptr, sq_norms, first_row + i, 0, tile_cols, out.middleRows(i, nrows));
+  }
+}
+
+void
+write_distance_matrix(const string& fname,
+                      const Eigen::Ref<const Eigen::MatrixXf>& distances,
+                      const NameTable& samples,
+                      DistanceLayout layout,
+                      AsyncWriter* async)
+{
+  const Eigen::Index n = distances.rows();
+
+  TsvWriter out(fname, async);
+
+  out.write_header(layout == DistanceLayout::square ? "sample" : "", samples);
+
+  Eigen::VectorXf upper;
+
+  // The same bands write_distances() writes.
+  for (Eigen::Index first_row = 0; first_row < n; first_row += distance_tile_cols) {
+    const Eigen::Index nrows = min(distance_tile_cols, n - first_row);
+
+    if (layout == DistanceLayout::square) {
+      write_band(out, samples, layout, first_row, distances.middleRows(first_row, nrows), upper);
+    }
+    else {
+      write_band(out,
+                 samples,
+                 layout,
+                 first_row,
+                 distances.block(first_row, first_row, nrows, n - first_row),
+                 upper);
+    }
+  }
+
+  out.close();
+}
+
+/// A neighbour offered to a bounded heap: (distance, index), so ties go to
+/// the lower index.
+typedef pair<float, Eigen::Index> Neighbour;
+
+/// Keeps the k smallest neighbours offered to `heap`, a max-heap.
+static inline void
+offer_neighbour(Neighbour* heap, Eigen::Index& size, Eigen::Index k, Neighbour candidate)
+{
+  if (size < k) {
+    heap[size++] = candidate;
+    push_heap(heap, heap + size);
+  }
+  else if (candidate < heap[0]) {
+    pop_heap(heap, heap + k);
+    heap[k - 1] = candidate;
+    push_heap(heap, heap + k);
+  }
+}
+
+/// Offers row q of `block` (distances from sample first_row + q to samples
+/// [first_col, first_col + block.cols())) to heap q, leaving out the sample
+/// itself.
+static void
+offer_block(const Eigen::Ref<const Eigen::MatrixXf>& block,
+            Eigen::Index first_row,
+            Eigen::Index first_col,
+            Eigen::Index k,
+            vector<Neighbour>& heaps,
+            vector<Eigen::Index>& sizes)
+{
+  for (Eigen::Index c = 0; c < block.cols(); ++c) {
+    for (Eigen::Index q = 0; q < block.rows(); ++q) {
+      const Eigen::Index j = first_col + c;
+
+      if (j != first_row + q) {
+        offer_neighbour(&heaps[q * k], sizes[q], k, Neighbour(block(q, c), j));
+      }
+    }
+  }
+}
+
+/// Sorts heap q, nearest first, into column first_row + q of `out`.
+static void
+take_neighbours(vector<Neighbour>& heaps,
+                const vector<Eigen::Index>& sizes,
+                Eigen::Index first_row,
+                Eigen::Index k,
+                NearestNeighbours& out)
+{
+  for (size_t q = 0; q < sizes.size(); ++q) {
+    Neighbour* heap = &heaps[q * k];
+
+    sort_heap(heap, heap + sizes[q]);
+
+    for (Eigen::Index r = 0; r < sizes[q]; ++r) {
+      out.distance(r, first_row + q) = heap[r].first;
+      out.index(r, first_row + q)    = heap[r].second;
+    }
+  }
+}
+
+static NearestNeighbours
+empty_neighbours(Eigen::Index n, Eigen::Index& k)
+{
+  k = max((Eigen::Index)0, min(k, n - 1));
+
+  NearestNeighbours out;
+  out.index.resize(k, n);
+  out.distance.resize(k, n);
+
+  return out;
+}
+
+template <typename Matrix>
+static NearestNeighbours
+tiled_neighbours(const Matrix& m, Eigen::Index k, Eigen::Index tile_cols, const Eigen::MatrixXd* gram)
+{
+  const Eigen::Index n = m.cols();
+
+  NearestNeighbours out = empty_neighbours(n, k);
+  if (k == 0) {
+    return out;
+  }
+
+  const Eigen::VectorXd sq_norms  = gram ? Eigen::VectorXd(gram->diagonal()) : col_squared_norms(m);
+  const long            num_tiles = (long)((n + tile_cols - 1) / tile_cols);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long t = 0; t < num_tiles; ++t) {
+    const Eigen::Index i  = t * tile_cols;
+    const Eigen::Index ni = min(tile_cols, n - i);
+
+    vector<Neighbour>    heaps(ni * k);
+    vector<Eigen::Index> sizes(ni, 0);
+    Eigen::MatrixXf      tile(ni, tile_cols);
+
+    for (Eigen::Index j = 0; j < n; j += tile_cols) {
+      const Eigen::Index nj = min(tile_cols, n - j);
+
+      auto block = tile.leftCols(nj);
+      if (gram) {
+        distance_tile(m, *gram, sq_norms, i, j, block);
+      }
+      else {
+        distance_tile(m, sq_norms, i, j, block);
+      }
+
+      offer_block(block, i, j, k, heaps, sizes);
+    }
+
+    take_neighbours(heaps, sizes, i, k, out);
+  }
+
+  return out;
+}
+
+NearestNeighbours
+nearest_neighbours(const Eigen::Ref<const Eigen::MatrixXf>& clr,
+                   Eigen::Index k,
+                   Eigen::Index tile_cols,
+                   const Eigen::MatrixXd* gram)
+{
+  return tiled_neighbours(DenseClr<SinglePrecision>(clr), k, tile_cols, gram);
+}
+
+template <typename Policy>
+NearestNeighbours
+nearest_neighbours(const DenseClr<Policy>& clr,
+                   Eigen::Index k,
+                   Eigen::Index tile_cols,
+                   const Eigen::MatrixXd* gram)
+{
+  return tiled_neighbours(clr, k, tile_cols, gram);
+}
+
+NearestNeighbours
+nearest_neighbours(const SparseClr& clr,
+                   Eigen::Index k,
+                   Eigen::Index tile_cols,
+                   const Eigen::MatrixXd* gram)
+{
+  return tiled_neighbours(clr, k, tile_cols, gram);
+}
+
+NearestNeighbours
+nearest_neighbours(const ClrRowBlocks& clr,
+                   Eigen::Index k,
+                   Eigen::Index tile_cols,
+                   const Eigen::MatrixXd* gram)
+{
+  const Eigen::Index n = clr.cols();
+
+  NearestNeighbours out = empty_neighbours(n, k);
+  if (k == 0) {
+    return out;
+  }
+
+  const Eigen::VectorXd sq_norms = gram ? Eigen::VectorXd(gram->diagonal()) : col_squared_norms(clr);
+
+  Eigen::MatrixXf band;
+
+  for (Eigen::Index first_row = 0; first_row < n; first_row += tile_cols) {
+    const Eigen::Index nrows = min(tile_cols, n - first_row);
+
+    band.resize(nrows, n);
+    fill_band(clr, gram, sq_norms, first_row, 0, tile_cols, band);
+
+#pragma omp parallel for schedule(static)
+    for (Eigen::Index q = 0; q < nrows; ++q) {
+      vector<Neighbour>    heap(k);
+      vector<Eigen::Index> size(1, 0);
+
+      offer_block(band.row(q), first_row + q, 0, k, heap, size);
+      take_neighbours(heap, size, first_row + q, k, out);
+    }
+  }
+
+  return out;
+}
+
+void
+write_neighbours(const string& fname,
+                 const NearestNeighbours& neighbours,
+                 const NameTable& samples,
+                 AsyncWriter* async)
+{
+  // Longest shortest-round-trip float, e.g. "-1.17549435e-38".
+  char number[16];
+
+  TsvWriter out(fname, async);
+
+  out.write("sample\tneighbour\tdistance\n");
+
+  string line;
+
+  for (Eigen::Index j = 0; j < neighbours.index.cols(); ++j) {
+    for (Eigen::Index r = 0; r < neighbours.index.rows(); ++r) {
+      line.assign(samples.name(j));
+      line += '\t';
+      line += samples.name(neighbours.index(r, j));
+      line += '\t';
+      line.append(number, to_chars(number, number + sizeof(number), neighbours.distance(r, j)).ptr);
+      line += '\n';
+
+      out.write(line);
+    }
+  }
+
+  out.close();
+}
+
+#define INSTANTIATE_WRITE_DISTANCES(Policy)                            \
+  template void write_distances(const string&,                          \
+                                const DenseClr<Policy>&,                \
+                                const NameTable&,                       \
+                                DistanceLayout,                         \
+                                Eigen::Index,                           \
+                                AsyncWriter*,                           \
+                                const Eigen::MatrixXd*);            \
+  template void distance_matrix(const DenseClr<Policy>&,                \
+                                Eigen::Ref<Eigen::MatrixXf>,            \
+                                Eigen::Index,                           \
+                                const Eigen::MatrixXd*);                \
+  template NearestNeighbours nearest_neighbours(const DenseClr<Policy>&, \
+                                                Eigen::Index,           \
+                                                Eigen::Index,           \
+                                                const Eigen::MatrixXd*);
+
+CODA_FOR_EACH_PRECISION(INSTANTIATE_WRITE_DISTANCES)
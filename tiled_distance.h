@@ -0,0 +1,185 @@
+#ifndef CODA_TILED_DISTANCE_H
+#define CODA_TILED_DISTANCE_H
+
+#include <string>
+
+#include <Eigen/Dense>
+
+#include "async_writer.h"
+#include "clr_blocks.h"
+#include "dense_clr.h"
+#include "mat.h"
+#include "name_table.h"
+#include "sparse_clr.h"
+
+enum class DistanceLayout
+{
+  // n x n TSV with a header row and sample names down the first column.
+  square,
+
+  // Upper triangle only, row by row (scipy's pdist order): d(0, 1), d(0, 2),
+  // ..., d(0, n - 1), d(1, 2), ...  A header row of sample names, then one
+  // distance per line.
+  condensed,
+};
+
+/// @brief Compute the Aitchison distances between columns and stream them to
+/// `fname` band by band.
+///
+/// A band is `tile_cols` rows of the distance matrix.  It is computed as
+/// distance_tile() tiles in parallel, written out, and dropped, so memory
+/// stays at about tile_cols * n floats no matter how many samples there are.
+/// The condensed layout only computes tiles on or above the diagonal.  The
+/// square layout has to compute the lower triangle as well, since its rows
+/// are written in full.
+///
+/// With `async`, the text is written on its thread while the next band is
+/// computed, and write errors are reported by AsyncWriter::finish().
+///
+/// With `gram` (gram_matrix(clr)), the Gram blocks come from it instead of
+/// new passes over the table.
+///
+/// Throws std::runtime_error if the file can't be written.
+void
+write_distances(const std::string& fname,
+                const Eigen::Ref<const Eigen::MatrixXf>& clr,
+                const NameTable& samples,
+                DistanceLayout layout,
+                Eigen::Index tile_cols,
+                AsyncWriter* async = nullptr,
+                const Eigen::MatrixXd* gram = nullptr);
+
+template <typename Policy>
+void
+write_distances(const std::string& fname,
+                const DenseClr<Policy>& clr,
+                const NameTable& samples,
+                DistanceLayout layout,
+                Eigen::Index tile_cols,
+                AsyncWriter* async = nullptr,
+                const Eigen::MatrixXd* gram = nullptr);
+
+void
+write_distances(const std::string& fname,
+                const SparseClr& clr,
+                const NameTable& samples,
+                DistanceLayout layout,
+                Eigen::Index tile_cols,
+                AsyncWriter* async = nullptr,
+                const Eigen::MatrixXd* gram = nullptr);
+
+/// Out of core, each band is one pass over the row blocks, so a bigger
+/// `tile_cols` means fewer passes.
+void
+write_distances(const std::string& fname,
+                const ClrRowBlocks& clr,
+                const NameTable& samples,
+                DistanceLayout layout,
+                Eigen::Index tile_cols,
+                AsyncWriter* async = nullptr,
+                const Eigen::MatrixXd* gram = nullptr);
+
+/// @brief The whole n x n distance matrix in `out`, band by band, the same
+/// numbers write_distances() writes in the square layout.  `out` must be
+/// n x n; nothing else is allocated but the squared norms.
+void
+distance_matrix(const Eigen::Ref<const Eigen::MatrixXf>& clr,
+                Eigen::Ref<Eigen::MatrixXf> out,
+                Eigen::Index tile_cols = distance_tile_cols,
+                const Eigen::MatrixXd* gram = nullptr);
+
+template <typename Policy>
+void
+distance_matrix(const DenseClr<Policy>& clr,
+                Eigen::Ref<Eigen::MatrixXf> out,
+                Eigen::Index tile_cols = distance_tile_cols,
+                const Eigen::MatrixXd* gram = nullptr);
+
+void
+distance_matrix(const SparseClr& clr,
+                Eigen::Ref<Eigen::MatrixXf> out,
+                Eigen::Index tile_cols = distance_tile_cols,
+                const Eigen::MatrixXd* gram = nullptr);
+
+void
+distance_matrix(const ClrRowBlocks& clr,
+                Eigen::Ref<Eigen::MatrixXf> out,
+                Eigen::Index tile_cols = distance_tile_cols,
+                const Eigen::MatrixXd* gram = nullptr);
+
+/// @brief Rows [first_row, first_row + out.rows()) of the distance matrix of
+/// a dense f32 CLR table, e.g. for samples just added to it.  `out` must
+/// have a column for every sample.
+void
+distance_rows(const Eigen::Ref<const Eigen::MatrixXf>& clr,
+              Eigen::Index first_row,
+              Eigen::Ref<Eigen::MatrixXf> out,
+              Eigen::Index tile_cols = distance_tile_cols);
+
+/// @brief Writes a distance matrix already in memory, in the same format as
+/// write_distances().
+///
+/// Throws std::runtime_error if the file can't be written.
+void
+write_distance_matrix(const std::string& fname,
+                      const Eigen::Ref<const Eigen::MatrixXf>& distances,
+                      const NameTable& samples,
+                      DistanceLayout layout,
+                      AsyncWriter* async = nullptr);
+
+/// Each sample's k nearest other samples, nearest first, ties by index.
+typedef struct NearestNeighbours
+{
+  // k x samples: column j holds sample j's neighbours and their distances.
+  Eigen::Matrix<Eigen::Index, Eigen::Dynamic, Eigen::Dynamic> index;
+  Eigen::MatrixXf                                             distance;
+} NearestNeighbours;
+
+/// @brief The k nearest neighbours of every sample, without the distance
+/// matrix.
+///
+/// The samples are split into query tiles of `tile_cols`, run in parallel.
+/// Each tile goes through the reference tiles one distance_tile() (a GEMM,
+/// or with `gram`, a copy) at a time, offering every distance to a bounded
+/// max-heap of k per query sample.  So memory is the k x n result plus a
+/// tile and k heap entries per query sample in flight, not n x n.  The
+/// result doesn't depend on the number of threads.  `k` is capped at n - 1.
+NearestNeighbours
+nearest_neighbours(const Eigen::Ref<const Eigen::MatrixXf>& clr,
+                   Eigen::Index k,
+                   Eigen::Index tile_cols = distance_tile_cols,
+                   const Eigen::MatrixXd* gram = nullptr);
+
+template <typename Policy>
+NearestNeighbours
+nearest_neighbours(const DenseClr<Policy>& clr,
+                   Eigen::Index k,
+                   Eigen::Index tile_cols = distance_tile_cols,
+                   const Eigen::MatrixXd* gram = nullptr);
+
+NearestNeighbours
+nearest_neighbours(const SparseClr& clr,
+                   Eigen::Index k,
+                   Eigen::Index tile_cols = distance_tile_cols,
+                   const Eigen::MatrixXd* gram = nullptr);
+
+/// Out of core, a band of `tile_cols` query samples at a time, each one pass
+/// over the row blocks (see distance_band()), so this also holds a band of
+/// tile_cols x n distances.
+NearestNeighbours
+nearest_neighbours(const ClrRowBlocks& clr,
+                   Eigen::Index k,
+                   Eigen::Index tile_cols = distance_tile_cols,
+                   const Eigen::MatrixXd* gram = nullptr);
+
+/// @brief Writes `neighbours` as TSV: a header of "sample", "neighbour" and
+/// "distance", then one line per pair, by sample, nearest first.
+///
+/// Throws std::runtime_error if the file can't be written.
+void
+write_neighbours(const std::string& fname,
+                 const NearestNeighbours& neighbours,
+                 const NameTable& samples,
+                 AsyncWriter* async = nullptr);
+
+#endif //CODA_TILED_DISTANCE_H
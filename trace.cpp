@@ -0,0 +1,483 @@
+#include "trace.h"
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "utils.h"
+#include "version.h"
+
+/// Hardware counters read for each span, in the order of counter_names.
+#define trace_num_counters 3
+
+typedef std::array<uint64_t, trace_num_counters> CounterValues;
+
+typedef std::chrono::steady_clock Clock;
+
+static const uint64_t counter_configs[trace_num_counters] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES, // last level cache misses on x86
+};
+
+static const char* const counter_names[trace_num_counters] = {
+  "cycles",
+  "instructions",
+  "llc_misses",
+};
+
+typedef struct SpanRecord
+{
+  const char* name;
+
+  // Spans open around this one on its thread.
+  int depth;
+
+  // Which thread opened it, from 1 in the order they first did.
+  int thread;
+
+  // Seconds since trace_start().
+  double start;
+  double seconds;
+
+  // Bytes, or -1 if /proc/self/status can't be read.
+  long peak_rss;
+
+  double rows;
+  double bytes;
+
+  // Counts at the start while the span is open, then the difference.
+  CounterValues counters;
+} SpanRecord;
+
+typedef struct TraceState
+{
+  bool enabled = false;
+
+  // Whether peaks can be reset, so are per span.
+  bool rss_resettable = false;
+
+  Clock::time_point origin;
+
+  // Guards everything from here on once spans can open on several threads.
+  std::mutex mutex;
+
+  std::vector<SpanRecord> spans;
+
+  // Indices into `spans` of the open spans on any thread.
+  std::vector<size_t> open;
+
+  // Threads that have opened a span.
+  int threads = 0;
+
+  // trace_num_counters descriptors per OpenMP thread.
+  std::vector<int> counter_fds;
+} TraceState;
+
+static TraceState state;
+
+// This thread's number in SpanRecord::thread, or 0 before its first span.
+static thread_local int span_thread = 0;
+
+// Indices into `spans` of this thread's open spans, innermost last.
+static thread_local std::vector<size_t> thread_open;
+
+static const size_t no_span = SIZE_MAX;
+
+/// VmHWM from /proc/self/status in bytes, or -1.
+static long
+read_peak_rss()
+{
+  FILE* status = fopen("/proc/self/status", "r");
+  if (!status) {
+    return -1;
+  }
+
+  long kib = -1;
+  char line[256];
+  while (fgets(line, sizeof line, status)) {
+    if (sscanf(line, "VmHWM: %ld kB", &kib) == 1) {
+      break;
+    }
+  }
+
+  fclose(status);
+
+  return kib < 0 ? -1 : kib * 1024;
+}
+
+/// Resets VmHWM to the current RSS.  Returns false if the kernel won't.
+static bool
+reset_peak_rss()
+{
+  const int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  const bool ok = write(fd, "5", 1) == 1;
+
+  close(fd);
+
+  return ok;
+}
+
+static int
+open_counter(uint64_t config)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof attr);
+
+  attr.type           = PERF_TYPE_HARDWARE;
+  attr.size           = sizeof attr;
+  attr.config         = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+
+  // This thread, on any CPU.
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void
+close_counters()
+{
+  for (int fd : state.counter_fds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  state.counter_fds.clear();
+}
+
+/// Sums over the threads.
+static CounterValues
+read_counters()
+{
+  CounterValues values{};
+
+  for (size_t i = 0; i < state.counter_fds.size(); ++i) {
+    uint64_t value = 0;
+
+    if (read(state.counter_fds[i], &value, sizeof value) == (ssize_t)sizeof value) {
+      values[i % trace_num_counters] += value;
+    }
+  }
+
+  return values;
+}
+
+void
+trace_start(bool perf_counters)
+{
+  state.enabled        = true;
+  state.rss_resettable = reset_peak_rss();
+  state.origin         = Clock::now();
+
+  if (!state.rss_resettable) {
+    fprintf(stderr, "INFO -- Can't reset the peak RSS, so spans show the process's\n");
+  }
+
+  if (!perf_counters) {
+    return;
+  }
+
+  int error = 0;
+
+#pragma omp parallel
+  {
+    std::array<int, trace_num_counters> fds;
+    int                                 thread_error = 0;
+
+    for (int c = 0; c < trace_num_counters; ++c) {
+      fds[c] = open_counter(counter_configs[c]);
+
+      if (fds[c] < 0 && thread_error == 0) {
+        thread_error = errno;
+      }
+    }
+
+#pragma omp critical(trace_counters)
+    {
+      state.counter_fds.insert(state.counter_fds.end(), fds.begin(), fds.end());
+
+      if (thread_error != 0) {
+        error = thread_error;
+      }
+    }
+  }
+
+  if (error != 0) {
+    fprintf(stderr, "INFO -- No hardware counters: %s\n", strerror(error));
+
+    close_counters();
+  }
+}
+
+TraceSpan::TraceSpan(const char* name)
+  : index_(no_span)
+{
+  log_msg(name);
+
+  if (!state.enabled) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(state.mutex);
+
+  // The open spans' peak so far, before this one resets it.
+  if (!state.open.empty()) {
+    const long peak_rss = read_peak_rss();
+
+    for (size_t i : state.open) {
+      state.spans[i].peak_rss = std::max(state.spans[i].peak_rss, peak_rss);
+    }
+  }
+
+  if (span_thread == 0) {
+    span_thread = ++state.threads;
+  }
+
+  if (state.rss_resettable) {
+    reset_peak_rss();
+  }
+
+  SpanRecord record;
+  record.name     = name;
+  record.depth    = (int)thread_open.size();
+  record.thread   = span_thread;
+  record.seconds  = 0;
+  record.peak_rss = -1;
+  record.rows     = 0;
+  record.bytes    = 0;
+  record.counters = read_counters();
+  record.start    = std::chrono::duration<double>(Clock::now() - state.origin).count();
+
+  index_ = state.spans.size();
+
+  state.spans.push_back(record);
+  state.open.push_back(index_);
+  thread_open.push_back(index_);
+}
+
+TraceSpan::~TraceSpan()
+{
+  if (index_ == no_span) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(state.mutex);
+
+  const double        end      = std::chrono::duration<double>(Clock::now() - state.origin).count();
+  const CounterValues counters = read_counters();
+
+  SpanRecord& record = state.spans[index_];
+
+  record.seconds  = end - record.start;
+  record.peak_rss = std::max(record.peak_rss, read_peak_rss());
+
+  for (int c = 0; c < trace_num_counters; ++c) {
+    record.counters[c] = counters[c] - record.counters[c];
+  }
+
+  state.open.erase(std::find(state.open.begin(), state.open.end(), index_));
+  thread_open.pop_back();
+
+  for (size_t i : state.open) {
+    state.spans[i].peak_rss = std::max(state.spans[i].peak_rss, record.peak_rss);
+  }
+}
+
+void
+TraceSpan::add_rows(double rows)
+{
+  if (index_ != no_span) {
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    state.spans[index_].rows += rows;
+  }
+}
+
+void
+TraceSpan::add_bytes(double bytes)
+{
+  if (index_ != no_span) {
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    state.spans[index_].bytes += bytes;
+  }
+}
+
+/// `s` as a JSON string literal.
+static void
+print_json_string(FILE* out, const char* s)
+{
+  fputc('"', out);
+
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(out, "\\%c", *s);
+    }
+    else if ((unsigned char)*s < 0x20) {
+      fprintf(out, "\\u%04x", (unsigned)*s);
+    }
+    else {
+      fputc(*s, out);
+    }
+  }
+
+  fputc('"', out);
+}
+
+/// The figures for one span as JSON members, without braces.
+static void
+print_span_figures(FILE* out, const SpanRecord& span, const char* indent)
+{
+  const double seconds = span.seconds > 0 ? span.seconds : 1;
+
+  fprintf(out, "%s\"seconds\": %.9g,\n", indent, span.seconds);
+  fprintf(out, "%s\"peak_rss_bytes\": %ld,\n", indent, span.peak_rss);
+  fprintf(out, "%s\"rows\": %.17g,\n", indent, span.rows);
+  fprintf(out, "%s\"bytes\": %.17g,\n", indent, span.bytes);
+  fprintf(out, "%s\"rows_per_second\": %.9g,\n", indent, span.rows / seconds);
+  fprintf(out, "%s\"gb_per_second\": %.9g", indent, span.bytes / seconds * 1e-9);
+
+  if (!state.counter_fds.empty()) {
+    for (int c = 0; c < trace_num_counters; ++c) {
+      fprintf(out, ",\n%s\"%s\": %llu", indent, counter_names[c], (unsigned long long)span.counters[c]);
+    }
+
+    const double cycles = (double)span.counters[0];
+
+    fprintf(out,
+            ",\n%s\"instructions_per_cycle\": %.6g",
+            indent,
+            cycles > 0 ? span.counters[1] / cycles : 0.0);
+  }
+
+  fputc('\n', out);
+}
+
+static FILE*
+open_output(const std::string& fname)
+{
+  FILE* out = fopen(fname.c_str(), "w");
+
+  if (!out) {
+    throw std::runtime_error("couldn't open '" + fname + "': " + strerror(errno));
+  }
+
+  return out;
+}
+
+static void
+close_output(FILE* out, const std::string& fname)
+{
+  const bool failed = ferror(out) != 0;
+
+  if (fclose(out) != 0 || failed) {
+    throw std::runtime_error("couldn't write '" + fname + "'");
+  }
+}
+
+void
+trace_write_json(const std::string& fname)
+{
+  FILE* out = open_output(fname);
+
+  // Resetting the peak for each span resets the process's too, so take the
+  // largest one.
+  long max_rss = read_peak_rss();
+  for (const SpanRecord& span : state.spans) {
+    max_rss = std::max(max_rss, span.peak_rss);
+  }
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"version\": \"%s\",\n", VERSION);
+  fprintf(out,
+          "  \"total_seconds\": %.9g,\n",
+          std::chrono::duration<double>(Clock::now() - state.origin).count());
+  fprintf(out, "  \"max_rss_bytes\": %ld,\n", max_rss);
+  fprintf(out, "  \"peak_rss_per_span\": %s,\n", state.rss_resettable ? "true" : "false");
+
+  fprintf(out, "  \"counters\": [");
+  if (!state.counter_fds.empty()) {
+    for (int c = 0; c < trace_num_counters; ++c) {
+      fprintf(out, "%s\"%s\"", c > 0 ? ", " : "", counter_names[c]);
+    }
+  }
+  fprintf(out, "],\n");
+
+  fprintf(out, "  \"spans\": [");
+  for (size_t i = 0; i < state.spans.size(); ++i) {
+    const SpanRecord& span = state.spans[i];
+
+    fprintf(out, "%s\n    {\n      \"name\": ", i > 0 ? "," : "");
+    print_json_string(out, span.name);
+    fprintf(out, ",\n      \"depth\": %d,\n", span.depth);
+    fprintf(out, "      \"thread\": %d,\n", span.thread);
+    fprintf(out, "      \"start_seconds\": %.9g,\n", span.start);
+    print_span_figures(out, span, "      ");
+    fprintf(out, "    }");
+  }
+  fprintf(out, "\n  ]\n}\n");
+
+  close_output(out, fname);
+}
+
+void
+trace_write_chrome(const std::string& fname)
+{
+  FILE* out = open_output(fname);
+
+  const long pid = (long)getpid();
+
+  fprintf(out, "{\n  \"displayTimeUnit\": \"ms\",\n");
+  fprintf(out, "  \"otherData\": { \"version\": \"%s\" },\n", VERSION);
+  fprintf(out, "  \"traceEvents\": [");
+
+  for (size_t i = 0; i < state.spans.size(); ++i) {
+    const SpanRecord& span = state.spans[i];
+
+    // Microseconds, as the format wants.
+    const double start = span.start * 1e6;
+    const double end   = (span.start + span.seconds) * 1e6;
+
+    fprintf(out, "%s\n    {\n      \"name\": ", i > 0 ? "," : "");
+    print_json_string(out, span.name);
+    fprintf(out,
+            ",\n      \"cat\": \"coda\",\n      \"ph\": \"X\",\n      \"pid\": %ld,\n      \"tid\": %d,\n",
+            pid,
+            span.thread);
+    fprintf(out, "      \"ts\": %.3f,\n      \"dur\": %.3f,\n", start, end - start);
+    fprintf(out, "      \"args\": {\n");
+    print_span_figures(out, span, "        ");
+    fprintf(out, "      }\n    }");
+
+    // A memory track next to the spans.
+    if (span.peak_rss >= 0) {
+      fprintf(out,
+              ",\n    { \"name\": \"peak RSS\", \"ph\": \"C\", \"pid\": %ld, \"ts\": %.3f, "
+              "\"args\": { \"MiB\": %.3f } }",
+              pid,
+              end,
+              span.peak_rss / 1048576.0);
+    }
+  }
+
+  fprintf(out, "\n  ]\n}\n");
+
+  close_output(out, fname);
+}
@@ -0,0 +1,69 @@
+#ifndef CODA_TRACE_H
+#define CODA_TRACE_H
+
+#include <string>
+
+/// @brief Starts recording spans.
+///
+/// Until this is called, a TraceSpan only logs its name.  Afterwards each
+/// span also records its start and duration, peak RSS, the rows and bytes
+/// it was given, and with `perf_counters`, CPU cycles, instructions and
+/// last level cache misses from perf_event_open(2).
+///
+/// The counters are opened once for every OpenMP thread (OpenMP keeps its
+/// threads between parallel regions, so these are the threads that do the
+/// work) and summed; other threads, like the AsyncWriter's, aren't
+/// counted.  Only user space is counted, so perf_event_paranoid up to 2
+/// allows it.  If the counters can't be opened, this says so and carries
+/// on without them.
+void
+trace_start(bool perf_counters);
+
+/// @brief Scoped span around one stage of the pipeline.
+///
+/// Logs `name` when it starts, like log_msg().  Spans nest within a
+/// thread, and stages running side by side (see TaskGraph) may each open
+/// their own on their own threads.
+///
+/// Peak RSS is per span: the kernel's high water mark is reset (through
+/// /proc/self/clear_refs) when a span starts, and folded into every span
+/// still open, the enclosing ones and any on other threads, when one starts
+/// or ends.  So spans that overlap in time each count the peak of the
+/// overlap.  Where it can't be reset, the peak is the process's so far.
+class TraceSpan
+{
+public:
+  /// `name` must outlive the trace (a string literal, say).
+  explicit TraceSpan(const char* name);
+  ~TraceSpan();
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  /// Rows (of the CLR table, or of output) this stage got through.
+  void
+  add_rows(double rows);
+
+  /// Bytes this stage read.
+  void
+  add_bytes(double bytes);
+
+private:
+  size_t index_;
+};
+
+/// @brief Writes the recorded spans as a JSON document: one object per span,
+/// in the order they started, with timing, memory, throughput and counters.
+///
+/// Throws std::runtime_error if the file can't be written.
+void
+trace_write_json(const std::string& fname);
+
+/// @brief Writes the recorded spans in Chrome's trace event format ("X"
+/// events with the figures in `args`), for chrome://tracing or Perfetto.
+///
+/// Throws std::runtime_error if the file can't be written.
+void
+trace_write_chrome(const std::string& fname);
+
+#endif //CODA_TRACE_H
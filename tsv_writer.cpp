@@ -0,0 +1,228 @@
+#include "tsv_writer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>  // open
+#include <unistd.h> // write, close
+
+using namespace std;
+
+/// Longest shortest-round-trip float, e.g. "-1.17549435e-38".
+#define max_float_chars ((size_t)16)
+
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMajorMatrixXf;
+
+static inline char*
+format_float(char* out, float value)
+{
+  return to_chars(out, out + max_float_chars, value).ptr;
+}
+
+TsvWriter::TsvWriter(const string& fname, AsyncWriter* async)
+  : fname_(fname),
+    async_(async)
+{
+  fd_ = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    throw runtime_error("couldn't open '" + fname + "' for writing: " + strerror(errno));
+  }
+
+  buffer_.reserve(tsv_buffer_bytes);
+}
+
+TsvWriter::~TsvWriter()
+{
+  if (fd_ >= 0) {
+    try {
+      flush();
+    }
+    catch (const runtime_error&) {
+      // Nowhere to report it.
+    }
+
+    if (async_) {
+      async_->close(fd_, fname_);
+    }
+    else {
+      ::close(fd_);
+    }
+  }
+}
+
+void
+TsvWriter::write(string_view text)
+{
+  buffer_.append(text);
+
+  if (buffer_.size() >= tsv_buffer_bytes) {
+    flush();
+  }
+}
+
+void
+TsvWriter::write_header(string_view corner, const NameTable& names)
+{
+  write(corner);
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (!corner.empty() || i > 0) {
+      write("\t");
+    }
+    write(names.name(i));
+  }
+  write("\n");
+}
+
+void
+TsvWriter::write_rows(const NameTable& labels,
+                      size_t first_label,
+                      const Eigen::Ref<const Eigen::MatrixXf>& block)
+{
+  // Each row is contiguous once transposed.
+  const RowMajorMatrixXf rows = block;
+
+  const Eigen::Index nrows      = rows.rows();
+  const Eigen::Index ncols      = rows.cols();
+  const Eigen::Index piece_rows = max((Eigen::Index)1, tsv_piece_values / max((Eigen::Index)1, ncols));
+  const long         num_pieces = (long)((nrows + piece_rows - 1) / piece_rows);
+
+  vector<string> pieces(num_pieces);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long p = 0; p < num_pieces; ++p) {
+    const Eigen::Index first = p * piece_rows;
+    const Eigen::Index count = min(piece_rows, nrows - first);
+
+    size_t max_bytes = count * (ncols * (max_float_chars + 1) + 1);
+    for (Eigen::Index i = first; i < first + count; ++i) {
+      max_bytes += labels.name(first_label + i).size();
+    }
+
+    string& piece = pieces[p];
+    piece.resize(max_bytes);
+
+    char* out = piece.data();
+    for (Eigen::Index i = first; i < first + count; ++i) {
+      const string_view label = labels.name(first_label + i);
+      memcpy(out, label.data(), label.size());
+      out += label.size();
+
+      const float* row = rows.data() + i * ncols;
+      for (Eigen::Index j = 0; j < ncols; ++j) {
+        *out++ = '\t';
+        out    = format_float(out, row[j]);
+      }
+      *out++ = '\n';
+    }
+
+    piece.resize(out - piece.data());
+  }
+
+  append(pieces);
+}
+
+void
+TsvWriter::write_values(const Eigen::Ref<const Eigen::VectorXf>& values)
+{
+  const Eigen::Index n          = values.size();
+  const long         num_pieces = (long)((n + tsv_piece_values - 1) / tsv_piece_values);
+
+  vector<string> pieces(num_pieces);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long p = 0; p < num_pieces; ++p) {
+    const Eigen::Index first = p * tsv_piece_values;
+    const Eigen::Index count = min(tsv_piece_values, n - first);
+
+    string& piece = pieces[p];
+    piece.resize(count * (max_float_chars + 1));
+
+    char* out = piece.data();
+    for (Eigen::Index i = first; i < first + count; ++i) {
+      out    = format_float(out, values[i]);
+      *out++ = '\n';
+    }
+
+    piece.resize(out - piece.data());
+  }
+
+  append(pieces);
+}
+
+void
+TsvWriter::close()
+{
+  flush();
+
+  const int fd = fd_;
+  fd_ = -1;
+
+  if (async_) {
+    async_->close(fd, fname_);
+  }
+  else if (::close(fd) != 0) {
+    throw runtime_error("couldn't write '" + fname_ + "': " + strerror(errno));
+  }
+}
+
+void
+TsvWriter::append(const vector<string>& pieces)
+{
+  for (const string& piece : pieces) {
+    write(piece);
+  }
+}
+
+void
+TsvWriter::flush()
+{
+  if (async_) {
+    if (!buffer_.empty()) {
+      async_->write(fd_, fname_, std::move(buffer_));
+
+      buffer_ = string();
+      buffer_.reserve(tsv_buffer_bytes);
+    }
+    return;
+  }
+
+  const char* data = buffer_.data();
+  size_t      left = buffer_.size();
+
+  while (left > 0) {
+    const ssize_t written = ::write(fd_, data, left);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error("couldn't write '" + fname_ + "': " + strerror(errno));
+    }
+
+    data += written;
+    left -= written;
+  }
+
+  buffer_.clear();
+}
+
+void
+write_projection(const string& fname,
+                 const NameTable& samples,
+                 const Eigen::Ref<const Eigen::MatrixXf>& projection,
+                 AsyncWriter* async)
+{
+  TsvWriter out(fname, async);
+
+  out.write("sample");
+  for (Eigen::Index i = 0; i < projection.cols(); ++i) {
+    out.write("\tPC" + to_string(i + 1));
+  }
+  out.write("\n");
+
+  out.write_rows(samples, 0, projection);
+
+  out.close();
+}
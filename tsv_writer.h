@@ -0,0 +1,93 @@
+#ifndef CODA_TSV_WRITER_H
+#define CODA_TSV_WRITER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "async_writer.h"
+#include "name_table.h"
+
+/// Bytes buffered before they are written to the file.
+#define tsv_buffer_bytes ((size_t)8 << 20)
+
+/// Values formatted per parallel piece of a block.
+#define tsv_piece_values ((Eigen::Index)1 << 16)
+
+/// Writes numeric tables as TSV.
+///
+/// Floats are formatted with std::to_chars (shortest text that reads back as
+/// the same float).  Blocks of rows are transposed to row-major, formatted
+/// in parallel pieces, and appended in order, so the output doesn't depend on
+/// the thread count.  Text goes out in a few big write(2) calls, either
+/// right away or, given an AsyncWriter, on its thread while this one
+/// formats the next block.
+class TsvWriter
+{
+public:
+  /// With `async`, full buffers and the final close are handed to it, and it
+  /// reports any write errors from AsyncWriter::finish().  It must outlive
+  /// this writer.
+  ///
+  /// Throws std::runtime_error if the file can't be opened.
+  explicit TsvWriter(const std::string& fname, AsyncWriter* async = nullptr);
+
+  /// Closes without reporting errors.  Call close() to find out about them.
+  ~TsvWriter();
+
+  TsvWriter(const TsvWriter&) = delete;
+  TsvWriter& operator=(const TsvWriter&) = delete;
+
+  /// Appends raw text (e.g., a header).
+  void
+  write(std::string_view text);
+
+  /// Header line: `corner`, then a tab and each name in `names`.  An empty
+  /// `corner` leaves out the leading tab.
+  void
+  write_header(std::string_view corner, const NameTable& names);
+
+  /// One line per row of `block`: `labels.name(first_label + i)`, a tab, and
+  /// the row's values separated by tabs.
+  void
+  write_rows(const NameTable& labels,
+             size_t first_label,
+             const Eigen::Ref<const Eigen::MatrixXf>& block);
+
+  /// One value per line.
+  void
+  write_values(const Eigen::Ref<const Eigen::VectorXf>& values);
+
+  /// Writes out anything buffered and closes the file.
+  ///
+  /// Throws std::runtime_error if any write failed.  With an AsyncWriter,
+  /// this only queues the rest of the file.
+  void
+  close();
+
+private:
+  void
+  flush();
+
+  void
+  append(const std::vector<std::string>& pieces);
+
+  std::string  fname_;
+  int          fd_;
+  std::string  buffer_;
+  AsyncWriter* async_;
+};
+
+/// @brief Writes a sample projection (samples x components): a header of
+/// "sample" and PC1, PC2, ..., then one line per sample.
+///
+/// Throws std::runtime_error if the file can't be written.
+void
+write_projection(const std::string& fname,
+                 const NameTable& samples,
+                 const Eigen::Ref<const Eigen::MatrixXf>& projection,
+                 AsyncWriter* async = nullptr);
+
+#endif //CODA_TSV_WRITER_H
@@ -1,5 +1,7 @@
 #include "utils.h"
 
+#include <cstring>
+
 using namespace std;
 
 void
@@ -22,20 +24,49 @@ split(const string& s, char delimiter)
   return tokens;
 }
 
-/// Will throw if there are more tokens than will fit in `tokens`.
-void
-split(array<string, 4>& tokens, const string& s, char delimiter)
+/// Will throw if there are more tokens than will fit in `tokens`.  Like
+/// getline, a delimiter at the very end doesn't start another (empty) token.
+size_t
+split(array<string_view, 4>& tokens, string_view s, char delimiter)
 {
-  string        token;
-  istringstream token_stream(s);
+  size_t i     = 0;
+  size_t start = 0;
 
-  int i    = 0;
-  int size = tokens.size();
-  while (getline(token_stream, token, delimiter)) {
-    if (i >= size) {
+  while (true) {
+    size_t stop = s.find(delimiter, start);
+
+    if (i >= tokens.size()) {
       throw runtime_error("Too many tokens; won't fit!");
     }
 
-    tokens[i++] = token;
+    if (stop == string_view::npos) {
+      tokens[i++] = s.substr(start);
+      break;
+    }
+
+    tokens[i++] = s.substr(start, stop - start);
+    start = stop + 1;
+
+    if (start == s.size()) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+bool
+next_line(const char*& cursor, const char* end, string_view& line)
+{
+  if (cursor >= end) {
+    return false;
   }
+
+  const char* newline = (const char*)memchr(cursor, '\n', end - cursor);
+  const char* stop    = newline == nullptr ? end : newline;
+
+  line   = string_view(cursor, stop - cursor);
+  cursor = newline == nullptr ? end : newline + 1;
+
+  return true;
 }
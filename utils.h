@@ -1,8 +1,10 @@
 #ifndef CODA_UTILS_H
 #define CODA_UTILS_H
 
+#include <array>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <Eigen/Dense>
 
@@ -13,8 +15,16 @@ log_msg(const char* msg);
 std::vector<std::string>
 split(const std::string& s, char delimiter);
 
-void
-split(std::array<std::string, 4>& tokens, const std::string& s, char delimiter);
+/// Splits `s` in place; the tokens point into `s`.  Returns the number of
+/// tokens found.  Will throw if there are more tokens than will fit in
+/// `tokens`.  A delimiter at the very end of `s` is ignored.
+size_t
+split(std::array<std::string_view, 4>& tokens, std::string_view s, char delimiter);
+
+/// Sets `line` to the next line in [cursor, end) without its newline and
+/// moves `cursor` past it.  Returns false once there is nothing left.
+bool
+next_line(const char*& cursor, const char* end, std::string_view& line);
 
 
 #endif //CODA_UTILS_H
@@ -0,0 +1,6 @@
+#ifndef CODA_VERSION_H
+#define CODA_VERSION_H
+
+#define VERSION "0.2.2"
+
+#endif //CODA_VERSION_H